@@ -0,0 +1,304 @@
+/*
+
+    C++ WMI COM classes
+
+    Visit https://github.com/g40
+
+    Copyright (c) Jerry Evans, 2016-2024
+
+    All rights reserved.
+
+    The MIT License (MIT)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+
+*/
+
+//-----------------------------------------------------------------------------
+// wmipp_bench. times the library's primitives against the local machine.
+// each benchmark runs warmup untimed samples then N timed ones, and the
+// per operation latencies are reported as percentiles on stdout and,
+// with -o, as JSON
+//-----------------------------------------------------------------------------
+
+#include <Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <tchar.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+//-----------------------------------------------------------------------------
+#include <g40/nv2_opt.h>
+
+//-----------------------------------------------------------------------------
+#include "nv2_wmi.h"
+
+//-----------------------------------------------------------------------------
+// trace to stdout
+#define TRMSG(args) std::wcout << args << std::endl;
+
+//-----------------------------------------------------------------------------
+// one benchmark's samples, in microseconds per operation
+struct BenchResult
+{
+    std::string name;
+    // operations timed together per sample. cheap calls are looped
+    size_t ops = 1;
+    std::vector<double> samples;
+
+    //-------------------------------------------------------------------------
+    // nearest rank on the sorted samples
+    double Percentile(double p) const
+    {
+        if (samples.empty())
+            return 0;
+        size_t rank = (size_t)(p / 100.0 * (samples.size() - 1) + 0.5);
+        return samples[(std::min)(rank, samples.size() - 1)];
+    }
+
+    double Mean() const
+    {
+        double sum = 0;
+        for (double s : samples)
+            sum += s;
+        return (samples.empty() ? 0 : sum / samples.size());
+    }
+};
+
+//-----------------------------------------------------------------------------
+class Bench
+{
+    int m_warmup;
+    int m_repetitions;
+    double m_ticksPerUs;
+    std::vector<BenchResult> m_results;
+
+public:
+
+    //-------------------------------------------------------------------------
+    Bench(int warmup, int repetitions)
+        : m_warmup(warmup)
+        , m_repetitions(repetitions)
+    {
+        LARGE_INTEGER freq = {};
+        QueryPerformanceFrequency(&freq);
+        m_ticksPerUs = freq.QuadPart / 1e6;
+    }
+
+    //-------------------------------------------------------------------------
+    // fn performs ops operations per call
+    template <typename F>
+    void Run(const char* name, size_t ops, F&& fn)
+    {
+        BenchResult result;
+        result.name = name;
+        result.ops = ops;
+        try
+        {
+            for (int i = 0; i < m_warmup; i++)
+                fn();
+            result.samples.reserve(m_repetitions);
+            for (int i = 0; i < m_repetitions; i++)
+            {
+                LARGE_INTEGER t0 = {}, t1 = {};
+                QueryPerformanceCounter(&t0);
+                fn();
+                QueryPerformanceCounter(&t1);
+                result.samples.push_back((t1.QuadPart - t0.QuadPart) / m_ticksPerUs / ops);
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            // report what we have, carry on with the rest
+            std::cout << name << ": " << ex.what() << std::endl;
+        }
+        catch (const DWORD& ex)
+        {
+            // i.e. GetOwner denied or ExecMethod failing
+            std::wcout << name << L": " << nv2::s_error(ex).c_str() << std::endl;
+        }
+        catch (...)
+        {
+            std::cout << name << ": unknown error" << std::endl;
+        }
+        std::sort(result.samples.begin(), result.samples.end());
+        std::cout << name
+                  << " p50=" << result.Percentile(50)
+                  << "us p90=" << result.Percentile(90)
+                  << "us p99=" << result.Percentile(99)
+                  << "us n=" << result.samples.size() << std::endl;
+        m_results.push_back(std::move(result));
+    }
+
+    //-------------------------------------------------------------------------
+    std::string ToJson() const
+    {
+        std::ostringstream os;
+        os << "{\n  \"warmup\": " << m_warmup
+           << ",\n  \"repetitions\": " << m_repetitions
+           << ",\n  \"unit\": \"us\",\n  \"results\": [";
+        for (size_t i = 0; i < m_results.size(); i++)
+        {
+            const BenchResult& r = m_results[i];
+            // names are ours, nothing to escape
+            os << (i ? "," : "") << "\n    { \"name\": \"" << r.name << "\""
+               << ", \"ops\": " << r.ops
+               << ", \"samples\": " << r.samples.size()
+               << ", \"min\": " << (r.samples.empty() ? 0 : r.samples.front())
+               << ", \"mean\": " << r.Mean()
+               << ", \"p50\": " << r.Percentile(50)
+               << ", \"p90\": " << r.Percentile(90)
+               << ", \"p99\": " << r.Percentile(99)
+               << ", \"max\": " << (r.samples.empty() ? 0 : r.samples.back())
+               << " }";
+        }
+        os << "\n  ]\n}\n";
+        return os.str();
+    }
+};
+
+//-----------------------------------------------------------------------------
+#ifdef _UNICODE
+int _tmain(int argc, char_t* argv[])
+#else
+int main(int argc, char* argv[])
+#endif
+{
+    int ret = -1;
+    try
+    {
+        //---------------------------------------------------------------------
+        bool help = false;
+        string_t warmup = _T("3");
+        string_t repetitions = _T("20");
+        string_t output;
+        // map options to default values
+        std::vector<nv2::ap::Opt> opts = 
+        {
+            { _T("-?"), help, _T("Display help text") },
+            { _T("--help"), help, _T("Display help text") },
+            { _T("-w"), warmup, _T("Untimed warmup samples per benchmark (3)") },
+            { _T("-n"), repetitions, _T("Timed samples per benchmark (20)") },
+            { _T("-o"), output, _T("Write the results as JSON to this file") },
+        };
+
+        // parse the command line. returns any positionals in vp
+        std::vector<string_t> vp = nv2::ap::parse(argc, (const char_t**)argv, opts);
+
+        if (help) {
+            string_t s = nv2::ap::to_string(opts, _T("wmipp_bench. wmipp micro-benchmarks."));
+            std::wcout << nv2::t2w(s);
+            return 0;
+        }
+
+        Bench bench(std::stoi(warmup), (std::max)(1, std::stoi(repetitions)));
+        //
+        nv2::wmi::ComInit ci;
+
+        //---------------------------------------------------------------------
+        // connection
+        bench.Run("Services", 1, []()
+        {
+            nv2::wmi::Services srv;
+        });
+
+        nv2::wmi::Services srv;
+
+        //---------------------------------------------------------------------
+        // enumeration
+        bench.Run("GetInstances/Win32_LogicalDisk", 1, [&]() { srv.GetInstances(_W("Win32_LogicalDisk")); });
+        bench.Run("GetInstances/Win32_Service", 1, [&]() { srv.GetInstances(_W("Win32_Service")); });
+        bench.Run("GetInstances/Win32_Process", 1, [&]() { srv.GetInstances(_W("Win32_Process")); });
+        bench.Run("GetClassNames", 1, [&]() { srv.GetClassNames(); });
+
+        //---------------------------------------------------------------------
+        // value access on one instance. cheap, so loop
+        std::vector<nv2::wmi::Object> disks = srv.GetInstances(_W("Win32_LogicalDisk"));
+        nv2::throw_if(disks.empty(), nv2::acc("no Win32_LogicalDisk instances"));
+        nv2::wmi::Object& disk = disks.front();
+        const size_t loop = 1000;
+
+        bench.Run("Object::GetValue", loop, [&]()
+        {
+            for (size_t i = 0; i < loop; i++)
+                disk.GetValue(_W("Size"));
+        });
+        bench.Run("Object::Get<uint64_t>", loop, [&]()
+        {
+            for (size_t i = 0; i < loop; i++)
+                disk.Get<uint64_t>(_W("Size"));
+        });
+        nv2::wmi::BoundProperty size(nv2::wmi::ObjectAccess(disk.Interface()), _W("Size"));
+        CComPtr<IWbemObjectAccess> pAccess = nv2::wmi::ObjectAccess(disk.Interface());
+        bench.Run("BoundProperty::ReadUInt64", loop, [&]()
+        {
+            uint64_t value = 0;
+            for (size_t i = 0; i < loop; i++)
+                size.ReadUInt64(pAccess, value);
+        });
+        bench.Run("Object::GetProperties", loop, [&]()
+        {
+            for (size_t i = 0; i < loop; i++)
+                disk.GetProperties();
+        });
+        bench.Run("Object::GetMethods", loop, [&]()
+        {
+            for (size_t i = 0; i < loop; i++)
+                disk.GetMethods();
+        });
+
+        //---------------------------------------------------------------------
+        // a side effect free method: GetOwner on our own process
+        std::wstring path = _W("Win32_Process.Handle=\"") + std::to_wstring(GetCurrentProcessId()) + _W("\"");
+        nv2::wmi::Object self = srv.GetObject(path);
+        bench.Run("Object::ExecMethod", 1, [&]()
+        {
+            nv2::wmi::Object::param_map oparams;
+            self.ExecMethod(_W("GetOwner"), {}, oparams);
+        });
+
+        //---------------------------------------------------------------------
+        if (!output.empty())
+        {
+            std::ofstream os(std::filesystem::path(nv2::t2w(output)));
+            nv2::throw_if(!os, nv2::acc("cannot open output file"));
+            os << bench.ToJson();
+        }
+        //
+        ret = 0;
+    }
+    catch (const std::exception& ex)
+    {
+        std::cout << "Error: " << ex.what() << std::endl;
+    }
+    catch (const DWORD& ex)
+    {
+        std::wcout << "Error: " << nv2::s_error(ex).c_str() << std::endl;
+    }
+    catch (...)
+    {
+        std::cout << "Unknown error ..." << std::endl;
+    }
+    //
+    return ret;
+}
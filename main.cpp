@@ -36,19 +36,726 @@
 #include <conio.h>
 #include <string.h>
 #include <tchar.h>
+#include <Psapi.h>
+#include <TlHelp32.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
 #include <set>
+#include <thread>
 
 //-----------------------------------------------------------------------------
 #include <g40/nv2_opt.h>
 
 //-----------------------------------------------------------------------------
 #include "nv2_wmi.h"
+#include "nv2_wmi_format.h"
 
 //-----------------------------------------------------------------------------
 // trace to stdout
 #define TRMSG(args) std::wcout << args << std::endl;
 
+//-----------------------------------------------------------------------------
+// --replay. a workload is one operation per line:
+//
+//   # comment
+//   namespace ROOT\WMI                 applies to the lines that follow
+//   query  <interval> <WQL>
+//   get    <interval> <object path>
+//   method <interval> <object path> <method> [name=value ...]
+//
+// each operation is issued every interval ms, whichever thread is free,
+// or back to back when the interval is 0. double quotes keep spaces in
+// a token, i.e. Win32_Service.Name="Print Spooler"
+//-----------------------------------------------------------------------------
+struct ReplayOp
+{
+    enum class Kind { Query, Get, Method };
+
+    Kind kind = Kind::Query;
+    std::wstring ns;
+    DWORD interval = 0;
+    // WQL or object path
+    std::wstring target;
+    std::wstring method;
+    std::vector<std::pair<std::wstring, CComVariant>> params;
+    // as written, for the report
+    std::wstring line;
+};
+
+//-----------------------------------------------------------------------------
+// whitespace separated, except inside double quotes. quotes are kept
+static std::vector<std::wstring> SplitTokens(const std::wstring& text)
+{
+    std::vector<std::wstring> ret;
+    std::wstring token;
+    bool quoted = false;
+    for (wchar_t c : text)
+    {
+        if (c == L'"')
+            quoted = !quoted;
+        if (!quoted && iswspace(c))
+        {
+            if (!token.empty())
+                ret.push_back(token);
+            token.clear();
+            continue;
+        }
+        token += c;
+    }
+    if (!token.empty())
+        ret.push_back(token);
+    return ret;
+}
+
+//-----------------------------------------------------------------------------
+// integers and true/false are typed, anything else is a string
+static CComVariant ParseParamValue(std::wstring value)
+{
+    if (value.size() >= 2 && value.front() == L'"' && value.back() == L'"')
+        return CComVariant(value.substr(1, value.size() - 2).c_str());
+    if (value == L"true" || value == L"false")
+        return CComVariant(value == L"true");
+    size_t digits = (!value.empty() && value[0] == L'-') ? 1 : 0;
+    if (digits < value.size() && value.size() - digits <= 9 && value.find_first_not_of(L"0123456789", digits) == std::wstring::npos)
+        return CComVariant((long)std::stol(value));
+    return CComVariant(value.c_str());
+}
+
+//-----------------------------------------------------------------------------
+static std::vector<ReplayOp> ReadWorkload(const std::wstring& path)
+{
+    std::ifstream is(std::filesystem::path(path), std::ios::binary);
+    nv2::throw_if(!is, nv2::acc("Cannot open the --replay workload."));
+
+    std::vector<ReplayOp> ret;
+    std::wstring ns = _W("ROOT\\CIMV2");
+    std::string bytes;
+    for (size_t number = 1; std::getline(is, bytes); number++)
+    {
+        if (number == 1 && bytes.compare(0, 3, "\xEF\xBB\xBF") == 0)
+            bytes.erase(0, 3);
+        if (!bytes.empty() && bytes.back() == '\r')
+            bytes.pop_back();
+        std::wstring text(bytes.size(), L'\0');
+        if (!bytes.empty())
+            text.resize(MultiByteToWideChar(CP_UTF8, 0, bytes.data(), (int)bytes.size(), &text[0], (int)text.size()));
+
+        std::vector<std::wstring> tokens = SplitTokens(text);
+        if (tokens.empty() || tokens[0][0] == L'#')
+            continue;
+        if (tokens[0] == L"namespace" && tokens.size() == 2)
+        {
+            ns = tokens[1];
+            continue;
+        }
+
+        ReplayOp op;
+        op.ns = ns;
+        op.line = text;
+        bool ok = (tokens.size() >= 3 && tokens[1].find_first_not_of(L"0123456789") == std::wstring::npos);
+        if (ok)
+        {
+            op.interval = (DWORD)std::stoul(tokens[1]);
+            if (tokens[0] == L"query")
+            {
+                // the WQL as written, spacing included
+                op.kind = ReplayOp::Kind::Query;
+                size_t pos = text.find(tokens[1], text.find(tokens[0]) + tokens[0].size()) + tokens[1].size();
+                op.target = text.substr(text.find_first_not_of(L" \t", pos));
+            }
+            else if (tokens[0] == L"get" && tokens.size() == 3)
+            {
+                op.kind = ReplayOp::Kind::Get;
+                op.target = tokens[2];
+            }
+            else if (tokens[0] == L"method" && tokens.size() >= 4)
+            {
+                op.kind = ReplayOp::Kind::Method;
+                op.target = tokens[2];
+                op.method = tokens[3];
+                for (size_t i = 4; ok && i < tokens.size(); i++)
+                {
+                    size_t eq = tokens[i].find(L'=');
+                    ok = (eq != std::wstring::npos && eq > 0);
+                    if (ok)
+                        op.params.push_back({ tokens[i].substr(0, eq), ParseParamValue(tokens[i].substr(eq + 1)) });
+                }
+            }
+            else
+            {
+                ok = false;
+            }
+        }
+        if (!ok)
+        {
+            TRMSG("Workload line " << number << ": " << text);
+            nv2::throw_if(true, nv2::acc("Expected query, get, method or namespace in the --replay workload."));
+        }
+        ret.push_back(std::move(op));
+    }
+    nv2::throw_if(ret.empty(), nv2::acc("The --replay workload has no operations."));
+    return ret;
+}
+
+//-----------------------------------------------------------------------------
+// outcome of one ReplayOp across all threads
+struct ReplayStats
+{
+    std::mutex lock;
+    // ms, every completed call
+    std::vector<double> latencies;
+    std::map<HRESULT, size_t> errors;
+    size_t issued = 0;
+    size_t objects = 0;
+    // methods that ran but returned a non zero ReturnValue
+    size_t failed = 0;
+    // scheduled slots skipped because the previous one was still queued
+    // or in flight, or missed because the scheduler fell behind
+    size_t late = 0;
+    // an interval op is queued or in flight. one at a time, so a busy
+    // provider shows up as late rather than as a growing queue
+    std::atomic<bool> busy{ false };
+
+    //-------------------------------------------------------------------------
+    void Record(double ms, HRESULT hr, size_t count, bool nonzero)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        latencies.push_back(ms);
+        objects += count;
+        if (FAILED(hr))
+            errors[hr]++;
+        else if (nonzero)
+            failed++;
+    }
+};
+
+//-----------------------------------------------------------------------------
+// nearest rank on sorted values. see BenchResult in bench.cpp
+static double Percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[(std::min)(rank, sorted.size() - 1)];
+}
+
+//-----------------------------------------------------------------------------
+// CPU and memory of every WmiPrvSE.exe, read with the process APIs
+// rather than Win32_PerfFormattedData_PerfProc_Process so sampling does
+// not add to the load being measured
+class ProviderHostMonitor
+{
+    using clock = std::chrono::steady_clock;
+
+    // kernel + user time (100ns units) per process at the last sample
+    std::map<DWORD, uint64_t> m_cpu;
+    clock::time_point m_last;
+    bool m_first = true;
+    unsigned m_processors = 1;
+
+public:
+
+    size_t samples = 0;
+    double cpuSum = 0;
+    double cpuPeak = 0;
+    size_t processesPeak = 0;
+    size_t privateFirst = 0;
+    size_t privateLast = 0;
+    size_t privatePeak = 0;
+    size_t workingSetPeak = 0;
+
+    //-------------------------------------------------------------------------
+    ProviderHostMonitor()
+    {
+        m_processors = (std::max)(1u, std::thread::hardware_concurrency());
+    }
+
+    //-------------------------------------------------------------------------
+    void Sample()
+    {
+        HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+        if (hSnapshot == INVALID_HANDLE_VALUE)
+            return;
+        clock::time_point now = clock::now();
+        std::map<DWORD, uint64_t> cpu;
+        size_t privateBytes = 0;
+        size_t workingSet = 0;
+        PROCESSENTRY32W entry = {};
+        entry.dwSize = sizeof(entry);
+        for (BOOL ok = Process32FirstW(hSnapshot, &entry); ok; ok = Process32NextW(hSnapshot, &entry))
+        {
+            if (_wcsicmp(entry.szExeFile, L"WmiPrvSE.exe") != 0)
+                continue;
+            HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, entry.th32ProcessID);
+            if (hProcess == NULL)
+                continue;
+            FILETIME created = {}, exited = {}, kernel = {}, user = {};
+            if (GetProcessTimes(hProcess, &created, &exited, &kernel, &user))
+            {
+                cpu[entry.th32ProcessID] = (((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime)
+                                        + (((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime);
+            }
+            PROCESS_MEMORY_COUNTERS_EX counters = {};
+            counters.cb = sizeof(counters);
+            if (GetProcessMemoryInfo(hProcess, (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters)))
+            {
+                privateBytes += counters.PrivateUsage;
+                workingSet += counters.WorkingSetSize;
+            }
+            CloseHandle(hProcess);
+        }
+        CloseHandle(hSnapshot);
+
+        if (!m_first)
+        {
+            // a host started since the last sample used all of its time in
+            // the interval. one that exited takes its last interval with it
+            uint64_t busy = 0;
+            for (auto& p : cpu)
+            {
+                auto it = m_cpu.find(p.first);
+                busy += p.second - (it != m_cpu.end() ? (std::min)(it->second, p.second) : 0);
+            }
+            double wall = std::chrono::duration<double>(now - m_last).count() * 1e7 * m_processors;
+            double percent = (wall > 0 ? 100.0 * busy / wall : 0);
+            cpuSum += percent;
+            cpuPeak = (std::max)(cpuPeak, percent);
+            samples++;
+        }
+        else
+        {
+            privateFirst = privateBytes;
+        }
+        m_first = false;
+        m_cpu.swap(cpu);
+        m_last = now;
+        processesPeak = (std::max)(processesPeak, m_cpu.size());
+        privateLast = privateBytes;
+        privatePeak = (std::max)(privatePeak, privateBytes);
+        workingSetPeak = (std::max)(workingSetPeak, workingSet);
+    }
+};
+
+//-----------------------------------------------------------------------------
+// runs a workload for a fixed time. this thread schedules, the workers
+// (MTA, so they can share connections) issue the calls. with depth 1
+// calls are synchronous, above that each worker keeps up to depth
+// asynchronous calls in flight
+class Replay
+{
+    using clock = std::chrono::steady_clock;
+
+    // completion state of one asynchronous call, shared with its sink
+    struct CallState
+    {
+        clock::time_point start;
+        std::atomic<size_t> objects{ 0 };
+        std::atomic<bool> nonzero{ false };
+        std::atomic<bool> done{ false };
+    };
+
+    using pending_t = std::pair<std::shared_ptr<nv2::wmi::AsyncCall>, std::shared_ptr<CallState>>;
+
+    std::vector<ReplayOp> m_ops;
+    std::vector<std::unique_ptr<ReplayStats>> m_stats;
+    size_t m_threads;
+    size_t m_connections;
+    size_t m_depth;
+    std::chrono::seconds m_duration;
+    double m_elapsed = 0;
+
+    // (slot, namespace) => connection, made on first use by a worker
+    std::mutex m_connectLock;
+    std::map<std::pair<size_t, std::wstring>, std::shared_ptr<nv2::wmi::Services>> m_services;
+
+    // an operation waiting for a free worker. latency is measured from
+    // when it was due, so time spent queued counts
+    struct Scheduled
+    {
+        size_t index;
+        clock::time_point due;
+    };
+
+    // operations waiting for a free worker
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::deque<Scheduled> m_queue;
+    bool m_stop = false;
+
+    ProviderHostMonitor m_monitor;
+
+    //-------------------------------------------------------------------------
+    std::shared_ptr<nv2::wmi::Services> Connection(size_t slot, const std::wstring& ns)
+    {
+        std::lock_guard<std::mutex> guard(m_connectLock);
+        auto key = std::make_pair(slot, ns);
+        auto it = m_services.find(key);
+        if (it == m_services.end())
+            it = m_services.insert(std::make_pair(key, std::make_shared<nv2::wmi::Services>(ns.c_str()))).first;
+        return it->second;
+    }
+
+    //-------------------------------------------------------------------------
+    // null when the method takes no parameters or none were given
+    static CComPtr<IWbemClassObject> MakeInParams(const ReplayOp& op, const nv2::wmi::Services& srv)
+    {
+        CComPtr<IWbemClassObject> ret;
+        if (op.params.empty())
+            return ret;
+        std::shared_ptr<const nv2::wmi::ClassSchema> pSchema = srv.Cache()->GetComplete(nv2::wmi::PathClass(op.target));
+        CComPtr<IWbemClassObject> pClass = pSchema->InParams(op.method.c_str());
+        nv2::throw_if(pClass == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_INVALID_PARAMETER))));
+        HRESULT hr = pClass->SpawnInstance(0, &ret);
+        nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+        for (auto& param : op.params)
+        {
+            hr = ret->Put(param.first.c_str(), 0, &const_cast<CComVariant&>(param.second), 0);
+            nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+        }
+        return ret;
+    }
+
+    //-------------------------------------------------------------------------
+    static bool NonZeroReturn(IWbemClassObject* pOutParams)
+    {
+        CComVariant value;
+        if (pOutParams == NULL || pOutParams->Get(_W("ReturnValue"), 0, &value, NULL, NULL) != WBEM_S_NO_ERROR)
+            return false;
+        return (value.ChangeType(VT_I4) == S_OK && value.lVal != 0);
+    }
+
+    //-------------------------------------------------------------------------
+    // raw COM rather than the Services helpers: the HRESULT is the result
+    static HRESULT RunSync(const ReplayOp& op, const nv2::wmi::Services& srv, size_t& count, bool& nonzero)
+    {
+        IWbemServices* pServices = srv.Interface();
+        switch (op.kind)
+        {
+        case ReplayOp::Kind::Query:
+        {
+            CComPtr<IEnumWbemClassObject> pEnum;
+            HRESULT hr = pServices->ExecQuery(CComBSTR(L"WQL"), CComBSTR(op.target.c_str()), WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY, NULL, &pEnum);
+            while (hr == WBEM_S_NO_ERROR)
+            {
+                IWbemClassObject* batch[64] = {};
+                ULONG returned = 0;
+                hr = pEnum->Next(WBEM_INFINITE, 64, batch, &returned);
+                for (ULONG i = 0; i < returned; i++)
+                    batch[i]->Release();
+                count += returned;
+            }
+            return (hr == WBEM_S_FALSE ? WBEM_S_NO_ERROR : hr);
+        }
+        case ReplayOp::Kind::Get:
+        {
+            CComPtr<IWbemClassObject> pObj;
+            HRESULT hr = pServices->GetObject(CComBSTR(op.target.c_str()), 0, NULL, &pObj, NULL);
+            count = (pObj != NULL ? 1 : 0);
+            return hr;
+        }
+        case ReplayOp::Kind::Method:
+        {
+            CComPtr<IWbemClassObject> pInParams = MakeInParams(op, srv);
+            CComPtr<IWbemClassObject> pOutParams;
+            HRESULT hr = pServices->ExecMethod(CComBSTR(op.target.c_str()), CComBSTR(op.method.c_str()), 0, NULL, pInParams, &pOutParams, NULL);
+            nonzero = NonZeroReturn(pOutParams);
+            count = (pOutParams != NULL ? 1 : 0);
+            return hr;
+        }
+        }
+        return E_UNEXPECTED;
+    }
+
+    //-------------------------------------------------------------------------
+    // start op asynchronously. the sink records the outcome. false if
+    // the call was rejected outright, in which case it is recorded here
+    bool StartAsync(size_t index, clock::time_point due, const nv2::wmi::Services& srv, std::vector<pending_t>& calls)
+    {
+        const ReplayOp& op = m_ops[index];
+        ReplayStats* pStats = m_stats[index].get();
+        auto state = std::make_shared<CallState>();
+        state->start = due;
+        bool method = (op.kind == ReplayOp::Kind::Method);
+
+        auto onBatch = [state, method](std::vector<nv2::wmi::Object>& objects)
+        {
+            state->objects += objects.size();
+            if (method && !objects.empty() && NonZeroReturn(objects[0].Interface()))
+                state->nonzero = true;
+            objects.clear();
+        };
+        auto onComplete = [this, state, pStats](HRESULT hr)
+        {
+            pStats->Record(std::chrono::duration<double, std::milli>(clock::now() - state->start).count(), hr, state->objects, state->nonzero);
+            pStats->busy = false;
+            state->done = true;
+            m_cv.notify_all();
+        };
+        auto call = std::make_shared<nv2::wmi::AsyncCall>(srv.Interface(), onBatch, onComplete, srv.Cache());
+
+        IWbemServices* pServices = srv.Interface();
+        HRESULT hr = E_UNEXPECTED;
+        switch (op.kind)
+        {
+        case ReplayOp::Kind::Query:
+            hr = pServices->ExecQueryAsync(CComBSTR(L"WQL"), CComBSTR(op.target.c_str()), 0, NULL, call->Sink());
+            break;
+        case ReplayOp::Kind::Get:
+            hr = pServices->GetObjectAsync(CComBSTR(op.target.c_str()), 0, NULL, call->Sink());
+            break;
+        case ReplayOp::Kind::Method:
+            hr = pServices->ExecMethodAsync(CComBSTR(op.target.c_str()), CComBSTR(op.method.c_str()), 0, NULL, MakeInParams(op, srv), call->Sink());
+            break;
+        }
+        if (hr != WBEM_S_NO_ERROR)
+        {
+            // rejected outright, the sink will not be called
+            pStats->Record(std::chrono::duration<double, std::milli>(clock::now() - state->start).count(), hr, 0, false);
+            return false;
+        }
+        call->Started(hr);
+        calls.push_back(pending_t(call, state));
+        return true;
+    }
+
+    //-------------------------------------------------------------------------
+    static size_t Active(const std::vector<pending_t>& calls)
+    {
+        size_t ret = 0;
+        for (auto& call : calls)
+            ret += (call.second->done ? 0 : 1);
+        return ret;
+    }
+
+    //-------------------------------------------------------------------------
+    void Worker(size_t slot)
+    {
+        nv2::wmi::ComInit ci(COINIT_MULTITHREADED);
+        std::vector<pending_t> calls;
+        for (;;)
+        {
+            calls.erase(std::remove_if(calls.begin(), calls.end(), [](const pending_t& call) { return call.second->done.load(); }), calls.end());
+            Scheduled entry = {};
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_cv.wait_for(lock, std::chrono::milliseconds(100), [&]() { return m_stop || (!m_queue.empty() && Active(calls) < m_depth); });
+                if (m_stop)
+                    break;
+                if (m_queue.empty() || Active(calls) >= m_depth)
+                    continue;
+                entry = m_queue.front();
+                m_queue.pop_front();
+            }
+            // the scheduler tops up back to back operations
+            m_cv.notify_all();
+
+            size_t index = entry.index;
+            ReplayStats& stats = *m_stats[index];
+            {
+                std::lock_guard<std::mutex> guard(stats.lock);
+                stats.issued++;
+            }
+            clock::time_point start = entry.due;
+            // the sink clears busy once an asynchronous call completes
+            bool async = false;
+            try
+            {
+                std::shared_ptr<nv2::wmi::Services> srv = Connection(slot % m_connections, m_ops[index].ns);
+                if (m_depth > 1)
+                {
+                    async = StartAsync(index, start, *srv, calls);
+                }
+                else
+                {
+                    size_t count = 0;
+                    bool nonzero = false;
+                    HRESULT hr = RunSync(m_ops[index], *srv, count, nonzero);
+                    stats.Record(std::chrono::duration<double, std::milli>(clock::now() - start).count(), hr, count, nonzero);
+                }
+            }
+            catch (const DWORD& ex)
+            {
+                // i.e. access denied connecting or spawning the parameters
+                DBMSG("Replay::Worker => " << nv2::s_error(ex));
+                stats.Record(std::chrono::duration<double, std::milli>(clock::now() - start).count(), HRESULT_FROM_WIN32(ex), 0, false);
+            }
+            catch (const std::exception& ex)
+            {
+                // i.e. a failed connect or a bad method parameter
+                DBMSG("Replay::Worker => " << ex.what());
+                stats.Record(std::chrono::duration<double, std::milli>(clock::now() - start).count(), WBEM_E_FAILED, 0, false);
+            }
+            catch (...)
+            {
+                DBMSG("Replay::Worker => unknown exception");
+                stats.Record(std::chrono::duration<double, std::milli>(clock::now() - start).count(), E_UNEXPECTED, 0, false);
+            }
+            if (!async)
+                stats.busy = false;
+        }
+        // the sinks' callbacks use this object, so every call must have
+        // completed before the worker returns. give what is in flight 30s,
+        // then cancel and wait for the SetStatus the cancel provokes
+        for (auto& call : calls)
+        {
+            if (call.first->Wait(30000) != WBEM_S_TIMEDOUT)
+                continue;
+            try
+            {
+                call.first->Cancel();
+            }
+            catch (...)
+            {
+                DBMSG("Replay::Worker => CancelAsyncCall failed");
+            }
+            call.first->Wait();
+        }
+    }
+
+public:
+
+    //-------------------------------------------------------------------------
+    Replay(std::vector<ReplayOp> ops, size_t threads, size_t connections, size_t depth, std::chrono::seconds duration)
+        : m_ops(std::move(ops))
+        , m_threads(std::max<size_t>(1, threads))
+        , m_connections(std::max<size_t>(1, connections))
+        , m_depth(std::max<size_t>(1, depth))
+        , m_duration(duration)
+    {
+        for (size_t i = 0; i < m_ops.size(); i++)
+            m_stats.push_back(std::unique_ptr<ReplayStats>(new ReplayStats()));
+    }
+
+    //-------------------------------------------------------------------------
+    void Run()
+    {
+        std::vector<size_t> backToBack;
+        for (size_t i = 0; i < m_ops.size(); i++)
+        {
+            if (m_ops[i].interval == 0)
+                backToBack.push_back(i);
+        }
+        // enough queued to keep every slot busy, no more, so the mix stays
+        // round robin rather than racing ahead
+        const size_t bound = m_threads * m_depth;
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < m_threads; i++)
+            workers.push_back(std::thread([this, i]() { Worker(i); }));
+
+        clock::time_point start = clock::now();
+        clock::time_point end = start + m_duration;
+        clock::time_point nextSample = start;
+        std::vector<clock::time_point> due(m_ops.size(), start);
+        size_t next = 0;
+        for (clock::time_point now = start; now < end; now = clock::now())
+        {
+            if (now >= nextSample)
+            {
+                m_monitor.Sample();
+                nextSample += std::chrono::seconds(1);
+            }
+            std::unique_lock<std::mutex> lock(m_lock);
+            clock::time_point wake = (std::min)(end, nextSample);
+            for (size_t i = 0; i < m_ops.size(); i++)
+            {
+                if (m_ops[i].interval == 0)
+                    continue;
+                std::chrono::milliseconds interval(m_ops[i].interval);
+                if (due[i] <= now)
+                {
+                    ReplayStats& stats = *m_stats[i];
+                    // slots the scheduler slept through are skipped
+                    // rather than burst, as is this one if the last is
+                    // still queued or in flight
+                    size_t missed = (size_t)((now - due[i]) / interval);
+                    due[i] += interval * missed;
+                    if (stats.busy.exchange(true))
+                        missed++;
+                    else
+                        m_queue.push_back(Scheduled{ i, due[i] });
+                    if (missed)
+                    {
+                        std::lock_guard<std::mutex> guard(stats.lock);
+                        stats.late += missed;
+                    }
+                    due[i] += interval;
+                }
+                wake = (std::min)(wake, due[i]);
+            }
+            while (!backToBack.empty() && m_queue.size() < bound)
+                m_queue.push_back(Scheduled{ backToBack[next++ % backToBack.size()], now });
+            lock.unlock();
+            m_cv.notify_all();
+            lock.lock();
+            m_cv.wait_until(lock, wake);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stop = true;
+            m_queue.clear();
+        }
+        m_cv.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+        m_elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        m_monitor.Sample();
+    }
+
+    //-------------------------------------------------------------------------
+    void Report()
+    {
+        TRMSG("replay: " << m_elapsed << "s, " << m_threads << " threads, " << m_connections
+            << " connections, depth " << m_depth);
+        size_t calls = 0;
+        size_t errors = 0;
+        std::vector<double> all;
+        for (size_t i = 0; i < m_ops.size(); i++)
+        {
+            ReplayStats& stats = *m_stats[i];
+            std::sort(stats.latencies.begin(), stats.latencies.end());
+            size_t failures = 0;
+            for (auto& e : stats.errors)
+                failures += e.second;
+            TRMSG(m_ops[i].line);
+            TRMSG("\tcalls=" << stats.latencies.size()
+                << " ops/s=" << (m_elapsed > 0 ? stats.latencies.size() / m_elapsed : 0)
+                << " objects=" << stats.objects
+                << " errors=" << failures
+                << " late=" << stats.late
+                << " p50=" << Percentile(stats.latencies, 50)
+                << "ms p90=" << Percentile(stats.latencies, 90)
+                << "ms p99=" << Percentile(stats.latencies, 99)
+                << "ms max=" << (stats.latencies.empty() ? 0 : stats.latencies.back()) << "ms");
+            if (stats.failed)
+                TRMSG("\tnon zero ReturnValue x" << stats.failed);
+            for (auto& e : stats.errors)
+                TRMSG("\t0x" << std::hex << (unsigned long)e.first << std::dec << " x" << e.second << " " << nv2::s_error(uw32::Win32FromHResult(e.first)).c_str());
+            calls += stats.latencies.size();
+            errors += failures;
+            all.insert(all.end(), stats.latencies.begin(), stats.latencies.end());
+        }
+        std::sort(all.begin(), all.end());
+        TRMSG("total calls=" << calls
+            << " ops/s=" << (m_elapsed > 0 ? calls / m_elapsed : 0)
+            << " errors=" << errors
+            << " p50=" << Percentile(all, 50)
+            << "ms p99=" << Percentile(all, 99) << "ms");
+        TRMSG("WmiPrvSE processes=" << m_monitor.processesPeak
+            << " cpu avg=" << (m_monitor.samples ? m_monitor.cpuSum / m_monitor.samples : 0)
+            << "% peak=" << m_monitor.cpuPeak
+            << "% private start=" << m_monitor.privateFirst / (1024 * 1024)
+            << "MB end=" << m_monitor.privateLast / (1024 * 1024)
+            << "MB peak=" << m_monitor.privatePeak / (1024 * 1024)
+            << "MB working set peak=" << m_monitor.workingSetPeak / (1024 * 1024) << "MB");
+    }
+};
+
 //-----------------------------------------------------------------------------
 #ifdef _UNICODE
 int _tmain(int argc, char_t* argv[])
@@ -72,6 +779,12 @@ int main(int argc, char* argv[])
         bool list_properties = false;
         bool list_methods = false;
         std::wstring targetName;
+        std::wstring format = _W("text");
+        std::wstring replayFile;
+        std::wstring threads = _W("4");
+        std::wstring connections = _W("1");
+        std::wstring depth = _W("1");
+        std::wstring duration = _W("60");
         // map options to default values
         std::vector<nv2::ap::Opt> opts = 
         {
@@ -83,6 +796,12 @@ int main(int argc, char* argv[])
             { _T("-tn"), targetName, _T("Limit enumeration to classes that match. Use of '%' wildcard works..") },
             { _W("-lp"), list_properties, _W("List properties while enumerating.")},
             { _W("-lm"), list_methods, _W("List methods (and parameters) while enumerating.")},
+            { _W("--format"), format, _W("Output format for -tp: text, json, ndjson or csv.")},
+            { _W("--replay"), replayFile, _W("Replay the workload in this file. Reports throughput, latency, errors and WmiPrvSE load.")},
+            { _W("--threads"), threads, _W("--replay worker threads (4)")},
+            { _W("--connections"), connections, _W("--replay connections per namespace, shared by the threads (1)")},
+            { _W("--depth"), depth, _W("--replay calls in flight per thread. Above 1 calls are asynchronous (1)")},
+            { _W("--duration"), duration, _W("--replay run time in seconds (60)")},
         };
 
         // parse the command line. returns any positionals in vp
@@ -98,26 +817,49 @@ int main(int argc, char* argv[])
         if (!targetName.empty()) {
             test_enumeration = true;
         }
+        nv2::wmi::Format outputFormat = nv2::wmi::Format::Text;
+        nv2::throw_if(!nv2::wmi::ParseFormat(format, outputFormat),
+                    nv2::acc("--format must be one of text, json, ndjson or csv."));
+        // --replay counts. checked here: a negative value would wrap to a
+        // huge size_t in Replay
+        auto replayCount = [](const std::wstring& value, const char* error)
+        {
+            size_t used = 0;
+            int ret = 0;
+            try
+            {
+                ret = std::stoi(value, &used);
+            }
+            catch (const std::exception&)
+            {
+                used = 0;
+            }
+            nv2::throw_if(used == 0 || used != value.size() || ret < 1, nv2::acc(error));
+            return ret;
+        };
+        const int replayThreads = replayCount(threads, "--threads must be a whole number of at least 1.");
+        const int replayConnections = replayCount(connections, "--connections must be a whole number of at least 1.");
+        const int replayDepth = replayCount(depth, "--depth must be a whole number of at least 1.");
+        const int replayDuration = replayCount(duration, "--duration must be a whole number of seconds, at least 1.");
         //
         nv2::wmi::ComInit ci;
         // 
-        nv2::wmi::Services srv;
+        // connected once per process and namespace. see ConnectionManager
+        nv2::wmi::Services srv = nv2::wmi::Services::Shared();
         //
         if (test_enumeration)
         {
-            // enumerate all classes in the namespace           
-            //std::set<std::wstring> classNames = srv.GetClassNames();
-            std::set<std::wstring> classNames = srv.GetClassNames(targetName.c_str());
-            //std::set<std::wstring> classNames = srv.GetClassNames(_W("Win32_Processor"));
+            // enumerate all classes in the namespace. meta_class returns the
+            // class objects themselves, parsed in parallel
+            std::vector<std::shared_ptr<const nv2::wmi::ClassSchema>> schemas = srv.GetSchemas(targetName);
+            std::sort(schemas.begin(), schemas.end(), [](const auto& a, const auto& b) { return a->name < b->name; });
             // dump all properties and methods
-            for (auto& className : classNames) 
+            for (auto& schema : schemas) 
             {
-                TRMSG("Classname: " << className);
-                nv2::wmi::Object obj = srv.GetObject(className);
+                TRMSG("Classname: " << schema->name);
 
                 if (list_properties) {
-                    std::vector<std::wstring> props = obj.GetProperties();
-                    for (auto& prop : props)
+                    for (auto& prop : schema->names)
                     {
                         TRMSG("\tProperty: " << prop);
                     }
@@ -125,8 +867,7 @@ int main(int argc, char* argv[])
 
                 if (list_methods) 
                 {
-                    std::vector<nv2::wmi::MethodDef> methods = obj.GetMethods();
-                    for (auto& method : methods)
+                    for (auto& method : schema->methods)
                     {
                         TRMSG("\tMethod: " << method.name);
                         for (auto& ipp : method.ipParams)
@@ -146,45 +887,66 @@ int main(int argc, char* argv[])
             //
             //key = _W("Win32_Processor");
             //
-            std::vector<nv2::wmi::Object> disks = srv.GetInstances(key);
-            for (auto& disk : disks)
+            // encoded straight from the VARIANTs as UTF-8, written in large blocks
+            std::wcout.flush();
+            // the code page belongs to the console, so put it back after
+            UINT codePage = GetConsoleOutputCP();
+            SetConsoleOutputCP(CP_UTF8);
+            try
             {
-                std::vector<std::wstring> props = disk.GetProperties();
-                for (auto& prop : props)
+                nv2::wmi::Encoder encoder(outputFormat);
+                for (nv2::wmi::Object disk : srv.Enumerate(key, 256))
                 {
-                    std::wstring sv = disk.GetValue(prop);
-                    std::wcout << prop << " => " << sv << std::endl;
+                    encoder.Write(disk);
                 }
+                encoder.End();
+            }
+            catch (...)
+            {
+                SetConsoleOutputCP(codePage);
+                throw;
             }
+            SetConsoleOutputCP(codePage);
         }
       
         // use WMI to actually do something.
         if (test_methods)
         {
             std::wstring key = _W("Win32_LogicalDisk");
-            std::vector<nv2::wmi::Object> disks = srv.GetInstances(key);
+            // DeviceID is the key, so this is a GetObject of
+            // Win32_LogicalDisk.DeviceID="G:" rather than enumerating every disk
+            std::vector<nv2::wmi::Object> disks = srv.Find(key, nv2::wmi::Where::Eq(_W("DeviceID"), _W("G:")));
             for (auto& disk : disks)
             {
-                std::wstring diskId = disk.GetValue(_W("DeviceID"));
-                if (diskId == _W("G:"))
-                {
-                    // see next snippet
-                    int ir = -1;
-                    nv2::wmi::Object::param_list iparams = {
-                        { _T("FixErrors"), false },
-                        { _T("OKToRunAtBootUp"), false },
-                    };
-                    //
-                    nv2::wmi::Object::param_map oparams;
-                    //
-                    CComVariant result = disk.ExecMethod(_W("chkdsk"),
-                                                        iparams, 
-                                                        oparams);
-                    //
-                    ir = result.intVal;
-                }
+                // see next snippet
+                int ir = -1;
+                nv2::wmi::Object::param_list iparams = {
+                    { _T("FixErrors"), false },
+                    { _T("OKToRunAtBootUp"), false },
+                };
+                //
+                nv2::wmi::Object::param_map oparams;
+                //
+                CComVariant result = disk.ExecMethod(_W("chkdsk"),
+                                                    iparams, 
+                                                    oparams);
+                //
+                ir = result.intVal;
             }
         }
+
+        if (!replayFile.empty())
+        {
+            Replay replay(ReadWorkload(replayFile),
+                        replayThreads,
+                        replayConnections,
+                        replayDepth,
+                        std::chrono::seconds(replayDuration));
+            replay.Run();
+            replay.Report();
+        }
+        // drop the shared connections while COM is still initialized
+        nv2::wmi::ConnectionManager::Instance().Release();
         //
         ret = 0;
     }
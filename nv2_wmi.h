@@ -34,10 +34,28 @@
 #pragma once
 
 #include <map>
+#include <set>
 #include <vector>
 #include <initializer_list>
 #include <string>
 #include <cstdint>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <iterator>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <chrono>
+#include <string_view>
+#include <type_traits>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <shared_mutex>
+#include <unordered_map>
 #include <atlbase.h>
 #include <atlcom.h>
 #include <comdef.h>
@@ -58,12 +76,14 @@ namespace nv2
 		{
 			bool ok = false;
 		public:
-			ComInit()
+			// COINIT_MULTITHREADED for worker threads. see Executor
+			explicit ComInit(DWORD dwCoInit = COINIT_APARTMENTTHREADED)
 			{
 				// initialize COM (must do before InitializeForBackup works)
-				HRESULT result = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
+				HRESULT result = CoInitializeEx(NULL, dwCoInit);
 				uw32::trace_hresult(LFL "ComInit", result);
-				nv2::throw_if(result != S_OK, nv2::acc(LFL));
+				// S_FALSE => already initialized on this thread, still needs balancing
+				nv2::throw_if(result != S_OK && result != S_FALSE, nv2::acc(LFL));
 				ok = true;
 			}
 			~ComInit()
@@ -76,6 +96,264 @@ namespace nv2
 			}
 		};
 
+		//-----------------------------------------------------------------------------
+		// operations reported to an Instrumentation
+		enum class Op : uint8_t
+		{
+			Connect,			// IWbemLocator::ConnectServer
+			GetObject,			// IWbemServices::GetObject
+			CreateInstanceEnum,
+			ExecQuery,
+			Next,				// IEnumWbemClassObject::Next, one batch
+			GetValue,			// Object::GetValue, Get plus conversion
+			ExecMethod,
+			ExecMethodAsync,	// the call, not its completion
+			GetClassNames,		// the whole enumeration
+			Count
+		};
+
+		//-----------------------------------------------------------------------------
+		static
+		LPCWSTR
+			OpName(Op op)
+		{
+			static const LPCWSTR names[] =
+			{
+				_W("Connect"),
+				_W("GetObject"),
+				_W("CreateInstanceEnum"),
+				_W("ExecQuery"),
+				_W("Next"),
+				_W("GetValue"),
+				_W("ExecMethod"),
+				_W("ExecMethodAsync"),
+				_W("GetClassNames"),
+			};
+			return ((size_t)op < (size_t)Op::Count ? names[(size_t)op] : _W("?"));
+		}
+
+		//-----------------------------------------------------------------------------
+		// one completed call
+		struct CallInfo
+		{
+			Op op = Op::Count;
+			// class, query, object path, property or method name. may be empty
+			LPCWSTR target = nullptr;
+			HRESULT hr = S_OK;
+			uint64_t ns = 0;
+			// objects returned, i.e. by Next
+			ULONG objects = 0;
+		};
+
+		//-----------------------------------------------------------------------------
+		// callback interface. OnCall runs on whichever thread made the call,
+		// so implementations must be thread safe and quick.
+		// see nv2_wmi_trace.h for ready made ones
+		class Instrumentation
+		{
+		public:
+			virtual ~Instrumentation() {}
+			virtual void OnCall(const CallInfo& info) = 0;
+		};
+
+		//-----------------------------------------------------------------------------
+		// inline, not static, so there is one slot per process rather than
+		// one per translation unit
+		inline
+		std::atomic<Instrumentation*>&
+			InstrumentationSlot()
+		{
+			static std::atomic<Instrumentation*> slot{ nullptr };
+			return slot;
+		}
+
+		//-----------------------------------------------------------------------------
+		// install (or with nullptr, remove) the process wide callback. the
+		// caller keeps it alive until it has been removed and calls in
+		// flight have finished
+		inline
+		void
+			SetInstrumentation(Instrumentation* pInstrumentation)
+		{
+			InstrumentationSlot().store(pInstrumentation, std::memory_order_release);
+		}
+
+		//-----------------------------------------------------------------------------
+		// times one call. when no callback is installed this is an atomic
+		// load and a branch: the clock is never read
+		class CallTimer
+		{
+			Instrumentation* m_pInstrumentation;
+			Op m_op;
+			LPCWSTR m_target;
+			LARGE_INTEGER m_start;
+
+			//-------------------------------------------------------------------------
+			static double NsPerTick()
+			{
+				static const double ret = []()
+				{
+					LARGE_INTEGER freq = {};
+					QueryPerformanceFrequency(&freq);
+					return 1e9 / (double)freq.QuadPart;
+				}();
+				return ret;
+			}
+
+		public:
+
+			//-------------------------------------------------------------------------
+			CallTimer(Op op, LPCWSTR target)
+				: m_pInstrumentation(InstrumentationSlot().load(std::memory_order_acquire))
+				, m_op(op)
+				, m_target(target)
+			{
+				if (m_pInstrumentation)
+					QueryPerformanceCounter(&m_start);
+			}
+
+			CallTimer(const CallTimer&) = delete;
+			CallTimer& operator=(const CallTimer&) = delete;
+
+			//-------------------------------------------------------------------------
+			// report the call. only the first Done counts
+			void Done(HRESULT hr, ULONG objects = 0)
+			{
+				if (!m_pInstrumentation)
+					return;
+				LARGE_INTEGER now;
+				QueryPerformanceCounter(&now);
+				CallInfo info;
+				info.op = m_op;
+				info.target = m_target;
+				info.hr = hr;
+				info.ns = (uint64_t)((now.QuadPart - m_start.QuadPart) * NsPerTick());
+				info.objects = objects;
+				Instrumentation* pInstrumentation = m_pInstrumentation;
+				m_pInstrumentation = nullptr;
+				try
+				{
+					pInstrumentation->OnCall(info);
+				}
+				catch (...)
+				{
+					DBMSG("Instrumentation::OnCall => exception");
+				}
+			}
+		};
+
+		//-----------------------------------------------------------------------------
+		// cooperative cancellation shared by copies. a default constructed
+		// token can never be cancelled, use Create for one that can
+		class CancelToken
+		{
+			std::shared_ptr<std::atomic<bool>> m_pCancelled;
+
+		public:
+
+			CancelToken() {}
+
+			//-------------------------------------------------------------------------
+			static CancelToken Create()
+			{
+				CancelToken ret;
+				ret.m_pCancelled = std::make_shared<std::atomic<bool>>(false);
+				return ret;
+			}
+
+			//-------------------------------------------------------------------------
+			// any thread. calls using the token stop at their next wait
+			void Cancel() const
+			{
+				if (m_pCancelled)
+					*m_pCancelled = true;
+			}
+
+			bool Cancelled() const
+			{
+				return m_pCancelled && *m_pCancelled;
+			}
+
+			bool CanCancel() const
+			{
+				return m_pCancelled != nullptr;
+			}
+		};
+
+		//-----------------------------------------------------------------------------
+		// when a call has to give up: a point in time, a CancelToken, both or
+		// neither (the default, which waits forever). blocking WMI waits are
+		// split into slices so a cancel is noticed within one slice
+		class Deadline
+		{
+			using clock = std::chrono::steady_clock;
+
+			clock::time_point m_at = clock::time_point::max();
+			CancelToken m_token;
+
+		public:
+
+			Deadline() {}
+
+			//-------------------------------------------------------------------------
+			explicit Deadline(std::chrono::milliseconds timeout, const CancelToken& token = CancelToken())
+				: m_at(clock::now() + timeout)
+				, m_token(token)
+			{
+			}
+
+			//-------------------------------------------------------------------------
+			explicit Deadline(const CancelToken& token)
+				: m_token(token)
+			{
+			}
+
+			//-------------------------------------------------------------------------
+			// false if the call may wait forever
+			bool Bounded() const
+			{
+				return m_at != clock::time_point::max() || m_token.CanCancel();
+			}
+
+			bool Expired() const
+			{
+				return m_token.Cancelled() || (m_at != clock::time_point::max() && clock::now() >= m_at);
+			}
+
+			//-------------------------------------------------------------------------
+			// WBEM_E_CALL_CANCELLED, WBEM_E_TIMED_OUT or WBEM_S_NO_ERROR
+			HRESULT Status() const
+			{
+				if (m_token.Cancelled())
+					return WBEM_E_CALL_CANCELLED;
+				if (Expired())
+					return WBEM_E_TIMED_OUT;
+				return WBEM_S_NO_ERROR;
+			}
+
+			//-------------------------------------------------------------------------
+			// timeout (ms) for the next blocking wait: WBEM_INFINITE when not
+			// Bounded, otherwise what is left, at most slice if cancellable
+			long Slice(long slice = 100) const
+			{
+				if (!Bounded())
+					return WBEM_INFINITE;
+				if (m_at == clock::time_point::max())
+					return slice;
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(m_at - clock::now()).count();
+				if (left <= 0)
+					return 0;
+				if (m_token.CanCancel() && left > slice)
+					return slice;
+				return (long)std::min<long long>(left, LONG_MAX - 1);
+			}
+
+			const CancelToken& Token() const
+			{
+				return m_token;
+			}
+		};
+
 		//-----------------------------------------------------------------------------
 		// for SAFEARRAY cleanup
 		class SAHandle 
@@ -109,446 +387,4539 @@ namespace nv2
 		};
 
 		//-----------------------------------------------------------------------------
-		// get the collection of names associated with the IWbemClassObject
-		static
-		std::vector<std::wstring>
-			EnumNames(const CComPtr<IWbemClassObject>& pClass)
+		// WMI names (classes, properties, methods) are case insensitive
+		struct NoCaseLess
 		{
-			std::vector<std::wstring> ret;
-
-			SAFEARRAY* psaNames = NULL;
-			HRESULT hResult = pClass->GetNames(
-				NULL,
-				WBEM_FLAG_ALWAYS | WBEM_FLAG_NONSYSTEM_ONLY,
-				NULL,
-				&psaNames);
-			nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
-			
-			// handle cleanup
-			SAHandle sah(psaNames);	
-
-			// Get the number of properties.
-			long lLower = 0;
-			hResult = SafeArrayGetLBound(psaNames, 1, &lLower);
-			nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
-
-			long lUpper = 0;
-			hResult = SafeArrayGetUBound(psaNames, 1, &lUpper);
-			nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
-
-			for (long i = lLower; i <= lUpper; i++)
+			bool operator()(const std::wstring& a, const std::wstring& b) const
 			{
-				CComBSTR name;
-				hResult = SafeArrayGetElement(
-					psaNames,
-					&i,
-					&name);
-				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
-				ret.push_back((BSTR)name);
+				return _wcsicmp(a.c_str(), b.c_str()) < 0;
 			}
-			//
-			return ret;
-		}
+		};
 
 		//-----------------------------------------------------------------------------
-		// badly named 
-		class Object
+		// the VARTYPE a SAFEARRAY of T holds. WMI's mapping from CIM types
+		// decides which T a property needs: uint16 and uint32 arrive as VT_I4
+		// (int32_t), sint8 as VT_I2, uint8 as VT_UI1 and 64 bit integers as
+		// VT_BSTR. VARIANT_BOOL (VT_BOOL) is a short, so int16_t takes both
+		template <typename T> struct SafeArrayType;
+		template <> struct SafeArrayType<BSTR> { static bool Match(VARTYPE vt) { return vt == VT_BSTR; } };
+		template <> struct SafeArrayType<int8_t> { static bool Match(VARTYPE vt) { return vt == VT_I1; } };
+		template <> struct SafeArrayType<uint8_t> { static bool Match(VARTYPE vt) { return vt == VT_UI1; } };
+		template <> struct SafeArrayType<int16_t> { static bool Match(VARTYPE vt) { return vt == VT_I2 || vt == VT_BOOL; } };
+		template <> struct SafeArrayType<uint16_t> { static bool Match(VARTYPE vt) { return vt == VT_UI2; } };
+		template <> struct SafeArrayType<int32_t> { static bool Match(VARTYPE vt) { return vt == VT_I4 || vt == VT_INT; } };
+		template <> struct SafeArrayType<uint32_t> { static bool Match(VARTYPE vt) { return vt == VT_UI4 || vt == VT_UINT; } };
+		template <> struct SafeArrayType<int64_t> { static bool Match(VARTYPE vt) { return vt == VT_I8; } };
+		template <> struct SafeArrayType<uint64_t> { static bool Match(VARTYPE vt) { return vt == VT_UI8; } };
+		template <> struct SafeArrayType<float> { static bool Match(VARTYPE vt) { return vt == VT_R4; } };
+		template <> struct SafeArrayType<double> { static bool Match(VARTYPE vt) { return vt == VT_R8; } };
+		template <> struct SafeArrayType<IUnknown*> { static bool Match(VARTYPE vt) { return vt == VT_UNKNOWN; } };
+
+		//-----------------------------------------------------------------------------
+		// the elements of a one dimensional SAFEARRAY in place, via
+		// SafeArrayAccessData: no per element SafeArrayGetElement copies.
+		// BSTR elements are still owned by the array. move only. when owned
+		// the array is destroyed with the view, i.e. for GetNames results
+		template <typename T>
+		class SafeArrayView
 		{
-		// protected:
-				
-			CComPtr<IWbemClassObject> m_pObj;
-			CComPtr<IWbemServices> m_pServices;
+			SAFEARRAY* m_psa = nullptr;
+			T* m_pData = nullptr;
+			size_t m_size = 0;
+			bool m_owned = false;
+
+			void Release()
+			{
+				if (m_pData)
+					SafeArrayUnaccessData(m_psa);
+				if (m_owned && m_psa)
+					SafeArrayDestroy(m_psa);
+				m_psa = nullptr;
+				m_pData = nullptr;
+				m_size = 0;
+				m_owned = false;
+			}
 
 		public:
 
-			// Creates an empty (invalid) WMIObject
-			// Object() {}
+			SafeArrayView() {}
 
-			//-----------------------------------------------------------------------------
-			// Creates a WMIObject for a given IWbemClassObject instance
-			Object(const CComPtr<IWbemClassObject>& pObj, 
-					const CComPtr<IWbemServices>& pServices)
-				: m_pObj(pObj)
-				, m_pServices(pServices)
+			//-----------------------------------------------------------------
+			// throws if psa does not hold T (see SafeArrayType) or is not one
+			// dimensional. if owned psa is destroyed even when this throws
+			SafeArrayView(SAFEARRAY* psa, bool owned)
+				: m_psa(psa)
+				, m_owned(owned)
 			{
+				if (m_psa == nullptr)
+					return;
+				try
+				{
+					VARTYPE vt = VT_EMPTY;
+					HRESULT hr = SafeArrayGetVartype(m_psa, &vt);
+					nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+					bool ok = SafeArrayType<T>::Match(vt) && SafeArrayGetDim(m_psa) == 1 && m_psa->cbElements == sizeof(T);
+					nv2::throw_if(!ok, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_TYPE_MISMATCH))));
+					void* pData = nullptr;
+					hr = SafeArrayAccessData(m_psa, &pData);
+					nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+					m_pData = (T*)pData;
+					m_size = m_psa->rgsabound[0].cElements;
+				}
+				catch (...)
+				{
+					Release();
+					throw;
+				}
 			}
 
-			//-----------------------------------------------------------------------------
-			Object(const VARIANT* pInterface, const CComPtr<IWbemServices>& pServices)
+			//-----------------------------------------------------------------
+			// take the array out of a VARIANT (left VT_EMPTY). VT_NULL and
+			// VT_EMPTY give an empty view
+			static SafeArrayView Take(VARIANT& val)
 			{
-				nv2::throw_if(pInterface == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
-				nv2::throw_if(pInterface && pInterface->vt != VT_UNKNOWN, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_INVALIDARG))));
-
-				nv2::throw_if(!pServices, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				if (val.vt == VT_NULL || val.vt == VT_EMPTY)
+					return SafeArrayView();
+				nv2::throw_if(!(val.vt & VT_ARRAY) || (val.vt & VT_BYREF), (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_TYPE_MISMATCH))));
+				SAFEARRAY* psa = val.parray;
+				val.vt = VT_EMPTY;
+				val.parray = nullptr;
+				return SafeArrayView(psa, true);
+			}
 
-				pInterface->punkVal->QueryInterface(&m_pObj);
+			SafeArrayView(const SafeArrayView&) = delete;
+			SafeArrayView& operator=(const SafeArrayView&) = delete;
 
-				m_pServices = pServices;
+			SafeArrayView(SafeArrayView&& other)
+				: m_psa(other.m_psa)
+				, m_pData(other.m_pData)
+				, m_size(other.m_size)
+				, m_owned(other.m_owned)
+			{
+				other.m_psa = nullptr;
+				other.m_pData = nullptr;
+				other.m_size = 0;
+				other.m_owned = false;
 			}
 
-			//-----------------------------------------------------------------------------
-			Object(IUnknown* pUnknown, const CComPtr<IWbemServices>& pServices)
+			SafeArrayView& operator=(SafeArrayView&& other)
 			{
-				nv2::throw_if(!pUnknown, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
-				pUnknown->QueryInterface(&m_pObj);
-
-				m_pServices = pServices;
+				if (this != &other)
+				{
+					Release();
+					std::swap(m_psa, other.m_psa);
+					std::swap(m_pData, other.m_pData);
+					std::swap(m_size, other.m_size);
+					std::swap(m_owned, other.m_owned);
+				}
+				return *this;
 			}
 
-			//-----------------------------------------------------------------------------
-			// Tests WMIObject instance for validity
-			bool Valid() const
+			~SafeArrayView()
 			{
-				return m_pObj != NULL;
+				Release();
 			}
 
-			//-----------------------------------------------------------------------------
-			// get all properties
-			std::vector<std::wstring> 
-				GetProperties() const
+			//-----------------------------------------------------------------
+			const T* data() const
 			{
-				std::vector<std::wstring> ret;
-				//
-				SAFEARRAY* psaNames = NULL;
-				//
-				HRESULT hResult = m_pObj->GetNames(NULL,
-													WBEM_FLAG_ALWAYS | WBEM_FLAG_NONSYSTEM_ONLY,
-													NULL,
-													&psaNames);
-				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
-				// for cleanup
-				SAHandle sah(psaNames);
-				//
-				ret = EnumNames(m_pObj);
-				//
-				return ret;
+				return m_pData;
 			}
 
-			//-----------------------------------------------------------------------------
-			std::wstring 
-				GetValue(const std::wstring& property) const
+			size_t size() const
 			{
-				nv2::throw_if(!m_pObj, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
-
-				CComVariant val;
-				HRESULT hResult = m_pObj->Get(property.c_str(), 0, &val, NULL, NULL);
-				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
-
-				std::wstring ret;
-				if (val.vt == VT_NULL) 
-				{
-					ret = _W("NULL");
-				}
-				else if (val.vt == VT_BOOL)
-				{
-					ret = (val.bVal ? _W("true") : _W("false"));
-				}
-				else if (!((val.vt == VT_LPWSTR) || (val.vt == VT_BSTR)))
-				{	
-					val.ChangeType(VT_BSTR);
-					ret = val.bstrVal;
-				}
-				else
-				{
-					ret = val.bstrVal;
-				}
-				return ret;
+				return m_size;
 			}
 
-			//-----------------------------------------------------------------------------
-			int
-				GetIValue(const std::wstring& property) const
+			bool empty() const
 			{
-				nv2::throw_if(!m_pObj, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
-
-				CComVariant val;
-				HRESULT hResult = m_pObj->Get(property.c_str(), 0, &val, NULL, NULL);
-				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
-
-				// should be a trait
-				if (val.vt != VT_INT)
-					val.ChangeType(VT_INT);
+				return m_size == 0;
+			}
 
-				//
-				return val.intVal;
+			const T* begin() const
+			{
+				return m_pData;
 			}
 
-			//-----------------------------------------------------------------------------
-			std::vector<MethodDef> GetMethods()
+			const T* end() const
 			{
-				long lFlags = 0;
-				std::vector<MethodDef> ret;
+				return m_pData + m_size;
+			}
 
-				CComPtr<IWbemClassObject> pClassDefinition;
-				//std::wstring className = asString(L"__CLASS");
-				std::wstring className = GetValue(L"__CLASS");
-				HRESULT hR = m_pServices->GetObject(CComBSTR(className.c_str()), 0, NULL, &pClassDefinition, NULL);
-				nv2::throw_if(hR != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hR))));
+			const T& operator[](size_t i) const
+			{
+				return m_pData[i];
+			}
+		};
 
-				HRESULT hr = pClassDefinition->BeginMethodEnumeration(lFlags);
-				if (SUCCEEDED(hr))
+		//-----------------------------------------------------------------------------
+		// an array VARIANT as a,b,c with each element converted as
+		// Object::GetValue converts scalars
+		static
+		std::wstring
+			ArrayText(const VARIANT& val)
+		{
+			std::wstring ret;
+			SAFEARRAY* psa = val.parray;
+			if (psa == nullptr || SafeArrayGetDim(psa) != 1)
+				return ret;
+			VARTYPE vt = (VARTYPE)(val.vt & VT_TYPEMASK);
+			void* pData = nullptr;
+			HRESULT hr = SafeArrayAccessData(psa, &pData);
+			nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			try
+			{
+				for (ULONG i = 0; i < psa->rgsabound[0].cElements; i++)
 				{
-					for (;;)
+					const uint8_t* p = (const uint8_t*)pData + (size_t)i * psa->cbElements;
+					if (i)
+						ret += _W(",");
+					if (vt == VT_BOOL)
 					{
-						// 
-						CComBSTR name;
-						CComPtr<IWbemClassObject> ppInSignature;
-						CComPtr<IWbemClassObject> ppOutSignature;
-						hr = pClassDefinition->NextMethod(0, &name, &ppInSignature, &ppOutSignature);
-						if (FAILED(hr)) {
-							break;
-						}
-						//
-						if (name == nullptr)
-							break;
-						//
-						MethodDef def;
-						def.name = (BSTR)name;
-						if (ppInSignature)
-							def.ipParams = EnumNames(ppInSignature);
-						if (ppOutSignature)
-							def.opParams = EnumNames(ppOutSignature);
-						//
-						ret.push_back(def);
+						ret += (*(const VARIANT_BOOL*)p ? _W("true") : _W("false"));
+						continue;
 					}
-					hr = pClassDefinition->EndMethodEnumeration();
+					// a shallow copy of the element. never cleared, the array owns it
+					VARIANT element;
+					VariantInit(&element);
+					element.vt = vt;
+					memcpy(&element.llVal, p, std::min<size_t>(psa->cbElements, sizeof(element.llVal)));
+					CComVariant text;
+					if (VariantChangeType(&text, (vt == VT_VARIANT ? (const VARIANT*)p : &element), 0, VT_BSTR) == S_OK)
+						ret.append(text.bstrVal, SysStringLen(text.bstrVal));
 				}
-				else
-				{
-					DBMSG(nv2::s_error(uw32::Win32FromHResult(hr)));
-				}
-				return ret;	
 			}
+			catch (...)
+			{
+				SafeArrayUnaccessData(psa);
+				throw;
+			}
+			SafeArrayUnaccessData(psa);
+			return ret;
+		}
 
-			//-----------------------------------------------------------------------------
-			// simplify parameter declarations
-			using name_t = std::wstring;
-			using value_t = CComVariant;
-			using param_t = std::pair<name_t, value_t>;
+		//-----------------------------------------------------------------------------
+		// the property names of an object, in place
+		static
+		SafeArrayView<BSTR>
+			NameView(IWbemClassObject* pClass, long lFlags = WBEM_FLAG_ALWAYS | WBEM_FLAG_NONSYSTEM_ONLY)
+		{
+			nv2::throw_if(pClass == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+			SAFEARRAY* psaNames = NULL;
+			HRESULT hResult = pClass->GetNames(NULL, lFlags, NULL, &psaNames);
+			nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+			return SafeArrayView<BSTR>(psaNames, true);
+		}
+
+		//-----------------------------------------------------------------------------
+		// get the collection of names associated with the IWbemClassObject
+		static
+		std::vector<std::wstring>
+			EnumNames(const CComPtr<IWbemClassObject>& pClass)
+		{
+			SafeArrayView<BSTR> names = NameView(pClass);
+			std::vector<std::wstring> ret;
+			ret.reserve(names.size());
+			for (BSTR name : names)
+			{
+				ret.emplace_back(name ? name : _W(""), SysStringLen(name));
+			}
+			return ret;
+		}
+
+		//-----------------------------------------------------------------------------
+		// qualifier name => value
+		using qualifier_map = std::map<std::wstring, CComVariant>;
+
+		//-----------------------------------------------------------------------------
+		// all qualifiers in a set. an empty map if there is no set
+		static
+		qualifier_map
+			ReadQualifiers(const CComPtr<IWbemQualifierSet>& pQualifiers)
+		{
+			qualifier_map ret;
+			if (!pQualifiers)
+				return ret;
+			HRESULT hr = pQualifiers->BeginEnumeration(0);
+			nv2::throw_if(hr != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			for (;;)
+			{
+				CComBSTR name;
+				CComVariant val;
+				hr = pQualifiers->Next(0, &name, &val, NULL);
+				if (hr != WBEM_S_NO_ERROR || !name)
+					break;
+				ret[std::wstring(name)] = val;
+			}
+			pQualifiers->EndEnumeration();
+			return ret;
+		}
+
+		//-----------------------------------------------------------------------------
+		// one (non system) property of a class
+		struct PropertyDef
+		{
+			std::wstring name;
+			CIMTYPE type = CIM_EMPTY;
+			// i.e. key, units, MappingStrings
+			qualifier_map qualifiers;
+
+			//-------------------------------------------------------------------------
+			bool HasQualifier(LPCWSTR lpName) const
+			{
+				return qualifiers.find(lpName) != qualifiers.end();
+			}
+		};
+
+		//-----------------------------------------------------------------------------
+		// everything about a class that is the same for all its instances:
+		// property names, CIM types and qualifiers, and method signatures.
+		// built once per class and shared (see ClassCache). immutable once
+		// built so it can be shared freely between threads
+		struct ClassSchema
+		{
+			// class name
+			std::wstring name;
+			// the class object as returned by IWbemServices::GetObject. null,
+			// as is inParams, for a schema loaded from disk (see SchemaStore)
+			CComPtr<IWbemClassObject> pClass;
+			// property names in GetNames order, as returned by Object::GetProperties
+			std::vector<std::wstring> names;
+			// same order as names
+			std::vector<PropertyDef> properties;
+			// class qualifiers
+			qualifier_map qualifiers;
+			// method names and parameters
+			std::vector<MethodDef> methods;
+			// in-parameter class for each method. null if the method takes no parameters
+			std::map<std::wstring, CComPtr<IWbemClassObject>, NoCaseLess> inParams;
+
+			//-------------------------------------------------------------------------
+			// false if the class object (and so the method parameter classes) is missing
+			bool Complete() const
+			{
+				return pClass != nullptr;
+			}
+
+			//-------------------------------------------------------------------------
+			// null if there is no such method. case insensitive
+			const MethodDef* Method(LPCWSTR lpMethodName) const
+			{
+				for (auto& method : methods)
+				{
+					if (_wcsicmp(method.name.c_str(), lpMethodName) == 0)
+						return &method;
+				}
+				return nullptr;
+			}
+
+			//-------------------------------------------------------------------------
+			// returns null if the method takes no parameters. throws
+			// WBEM_E_METHOD_NOT_IMPLEMENTED if the class has no such method
+			CComPtr<IWbemClassObject> InParams(LPCWSTR lpMethodName) const
+			{
+				nv2::throw_if(Method(lpMethodName) == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_METHOD_NOT_IMPLEMENTED))));
+				auto it = inParams.find(lpMethodName);
+				return (it == inParams.end() ? CComPtr<IWbemClassObject>() : it->second);
+			}
+
+			//-------------------------------------------------------------------------
+			// null if there is no such property
+			const PropertyDef* Property(const std::wstring& propName) const
+			{
+				for (auto& prop : properties)
+				{
+					if (_wcsicmp(prop.name.c_str(), propName.c_str()) == 0)
+						return &prop;
+				}
+				return nullptr;
+			}
+
+			//-------------------------------------------------------------------------
+			// names of the properties carrying the key qualifier
+			std::vector<std::wstring> Keys() const
+			{
+				std::vector<std::wstring> ret;
+				for (auto& prop : properties)
+				{
+					if (prop.HasQualifier(_W("key")))
+						ret.push_back(prop.name);
+				}
+				return ret;
+			}
+		};
+
+		//-----------------------------------------------------------------------------
+		// parse an already fetched class object
+		static
+		std::shared_ptr<ClassSchema>
+			MakeClassSchema(const CComPtr<IWbemClassObject>& pClass, const std::wstring& className)
+		{
+			nv2::throw_if(pClass == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+			auto ret = std::make_shared<ClassSchema>();
+			ret->name = className;
+			ret->pClass = pClass;
+
+			// properties
+			ret->names = EnumNames(ret->pClass);
+			ret->properties.resize(ret->names.size());
+			for (size_t i = 0; i < ret->names.size(); i++)
+			{
+				PropertyDef& prop = ret->properties[i];
+				prop.name = ret->names[i];
+				HRESULT hR = ret->pClass->Get(prop.name.c_str(), 0, NULL, &prop.type, NULL);
+				nv2::throw_if(hR != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hR))));
+				CComPtr<IWbemQualifierSet> pQualifiers;
+				if (ret->pClass->GetPropertyQualifierSet(prop.name.c_str(), &pQualifiers) == WBEM_S_NO_ERROR)
+					prop.qualifiers = ReadQualifiers(pQualifiers);
+			}
+			{
+				CComPtr<IWbemQualifierSet> pQualifiers;
+				if (ret->pClass->GetQualifierSet(&pQualifiers) == WBEM_S_NO_ERROR)
+					ret->qualifiers = ReadQualifiers(pQualifiers);
+			}
+
+			// methods
+			long lFlags = 0;
+			HRESULT hr = ret->pClass->BeginMethodEnumeration(lFlags);
+			if (SUCCEEDED(hr))
+			{
+				for (;;)
+				{
+					//
+					CComBSTR name;
+					CComPtr<IWbemClassObject> ppInSignature;
+					CComPtr<IWbemClassObject> ppOutSignature;
+					hr = ret->pClass->NextMethod(0, &name, &ppInSignature, &ppOutSignature);
+					if (FAILED(hr)) {
+						break;
+					}
+					//
+					if (name == nullptr)
+						break;
+					//
+					MethodDef def;
+					def.name = (BSTR)name;
+					if (ppInSignature)
+						def.ipParams = EnumNames(ppInSignature);
+					if (ppOutSignature)
+						def.opParams = EnumNames(ppOutSignature);
+					//
+					ret->inParams[def.name] = ppInSignature;
+					ret->methods.push_back(def);
+				}
+				hr = ret->pClass->EndMethodEnumeration();
+			}
+			else
+			{
+				DBMSG(nv2::s_error(uw32::Win32FromHResult(hr)));
+			}
+			return ret;
+		}
+
+		//-----------------------------------------------------------------------------
+		// fetch the definition of className and parse it
+		static
+		std::shared_ptr<ClassSchema>
+			MakeClassSchema(const CComPtr<IWbemServices>& pServices, const std::wstring& className)
+		{
+			nv2::throw_if(pServices == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+			CComPtr<IWbemClassObject> pClass;
+			CallTimer timer(Op::GetObject, className.c_str());
+			HRESULT hR = pServices->GetObject(CComBSTR(className.c_str()), 0, NULL, &pClass, NULL);
+			timer.Done(hR);
+			nv2::throw_if(hR != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hR))));
+			return MakeClassSchema(pClass, className);
+		}
+
+		//-----------------------------------------------------------------------------
+		// per Services cache of class definitions keyed by class name, case
+		// insensitive as WMI is. shared by all Objects created from that Services
+		class ClassCache
+		{
+			CComPtr<IWbemServices> m_pServices;
+			std::mutex m_lock;
+			std::map<std::wstring, std::shared_ptr<const ClassSchema>, NoCaseLess> m_classes;
+
+		public:
+
+			explicit ClassCache(const CComPtr<IWbemServices>& pServices)
+				: m_pServices(pServices)
+			{
+			}
+
+			//-------------------------------------------------------------------------
+			// fetch on first use. concurrent misses may fetch twice, first one wins
+			std::shared_ptr<const ClassSchema> Get(const std::wstring& className)
+			{
+				{
+					std::lock_guard<std::mutex> lock(m_lock);
+					auto it = m_classes.find(className);
+					if (it != m_classes.end())
+						return it->second;
+				}
+				std::shared_ptr<const ClassSchema> def = MakeClassSchema(m_pServices, className);
+				std::lock_guard<std::mutex> lock(m_lock);
+				return m_classes.insert(std::make_pair(className, def)).first->second;
+			}
+
+			//-------------------------------------------------------------------------
+			// as Get, but refetch a schema that was loaded without its class object
+			std::shared_ptr<const ClassSchema> GetComplete(const std::wstring& className)
+			{
+				std::shared_ptr<const ClassSchema> ret = Get(className);
+				if (ret->Complete())
+					return ret;
+				ret = MakeClassSchema(m_pServices, className);
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_classes[className] = ret;
+				return ret;
+			}
+
+			//-------------------------------------------------------------------------
+			// seed the cache with a schema built elsewhere. an existing entry wins
+			std::shared_ptr<const ClassSchema> Put(const std::shared_ptr<const ClassSchema>& schema)
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				return m_classes.insert(std::make_pair(schema->name, schema)).first->second;
+			}
+
+			//-------------------------------------------------------------------------
+			// everything cached, i.e. to persist it
+			std::vector<std::shared_ptr<const ClassSchema>> Snapshot()
+			{
+				std::vector<std::shared_ptr<const ClassSchema>> ret;
+				std::lock_guard<std::mutex> lock(m_lock);
+				ret.reserve(m_classes.size());
+				for (auto& kv : m_classes)
+				{
+					ret.push_back(kv.second);
+				}
+				return ret;
+			}
+
+			//-------------------------------------------------------------------------
+			// drop one class, i.e. after a schema change
+			void Invalidate(const std::wstring& className)
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_classes.erase(className);
+			}
+
+			//-------------------------------------------------------------------------
+			void Clear()
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_classes.clear();
+			}
+		};
+
+		//-----------------------------------------------------------------------------
+		// IWbemObjectAccess for an object. instances handed out by WMI (and
+		// refresher objects) always implement it
+		static
+		CComPtr<IWbemObjectAccess>
+			ObjectAccess(IWbemClassObject* pObj)
+		{
+			nv2::throw_if(pObj == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+			CComPtr<IWbemObjectAccess> ret;
+			HRESULT hr = pObj->QueryInterface(&ret);
+			nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			return ret;
+		}
+
+		//-----------------------------------------------------------------------------
+		// parse a CIM_DATETIME string into a FILETIME. timestamps have the form
+		// yyyymmddHHMMSS.mmmmmmsUUU and are converted to UTC, intervals have the
+		// form ddddddddHHMMSS.mmmmmm:000 and are returned as a 100ns tick count.
+		// false if the string is malformed or uses '*' wildcards
+		// https://learn.microsoft.com/en-us/windows/win32/wmisdk/cim-datetime
+		static
+		bool
+			ParseDateTime(const wchar_t* p, size_t len, FILETIME& ft)
+		{
+			if (p == nullptr || len < 25 || p[14] != L'.')
+				return false;
+			auto field = [p](size_t offset, size_t width, uint64_t& v) -> bool
+			{
+				v = 0;
+				for (size_t i = offset; i < offset + width; i++)
+				{
+					if (p[i] < L'0' || p[i] > L'9')
+						return false;
+					v = v * 10 + (p[i] - L'0');
+				}
+				return true;
+			};
+			const uint64_t ticksPerSecond = 10000000ull;
+			uint64_t ticks = 0;
+			if (p[21] == L':')
+			{
+				uint64_t days, hh, mm, ss, us;
+				if (!field(0, 8, days) || !field(8, 2, hh) || !field(10, 2, mm) || !field(12, 2, ss) || !field(15, 6, us))
+					return false;
+				ticks = ((((days * 24 + hh) * 60 + mm) * 60 + ss) * ticksPerSecond) + us * 10;
+			}
+			else
+			{
+				if (p[21] != L'+' && p[21] != L'-')
+					return false;
+				uint64_t yy, mo, dd, hh, mm, ss, us, offset;
+				if (!field(0, 4, yy) || !field(4, 2, mo) || !field(6, 2, dd) || !field(8, 2, hh) || 
+					!field(10, 2, mm) || !field(12, 2, ss) || !field(15, 6, us) || !field(22, 3, offset))
+					return false;
+				SYSTEMTIME st = {};
+				st.wYear = (WORD)yy;
+				st.wMonth = (WORD)mo;
+				st.wDay = (WORD)dd;
+				st.wHour = (WORD)hh;
+				st.wMinute = (WORD)mm;
+				st.wSecond = (WORD)ss;
+				FILETIME local = {};
+				if (!SystemTimeToFileTime(&st, &local))
+					return false;
+				ticks = (((uint64_t)local.dwHighDateTime << 32) | local.dwLowDateTime) + us * 10;
+				// UUU is the offset of local time from UTC in minutes
+				uint64_t delta = offset * 60 * ticksPerSecond;
+				ticks = (p[21] == L'+' ? ticks - delta : ticks + delta);
+			}
+			ft.dwLowDateTime = (DWORD)(ticks & 0xFFFFFFFF);
+			ft.dwHighDateTime = (DWORD)(ticks >> 32);
+			return true;
+		}
+
+		//-----------------------------------------------------------------------------
+		// a property resolved to an IWbemObjectAccess handle. handles are valid
+		// for every instance of the class they were resolved against, so bind
+		// once and read many: no name lookup and no VARIANT per read.
+		// Read* return false if the property is NULL.
+		// https://learn.microsoft.com/en-us/windows/win32/api/wbemcli/nn-wbemcli-iwbemobjectaccess
+		class BoundProperty
+		{
+			std::wstring m_name;
+			long m_handle = 0;
+			CIMTYPE m_type = CIM_EMPTY;
+
+			//-------------------------------------------------------------------------
+			// raw bytes for the fixed size (non 32/64 bit) types
+			bool ReadRaw(IWbemObjectAccess* pAccess, void* pData, long cb) const
+			{
+				long read = 0;
+				HRESULT hr = pAccess->ReadPropertyValue(m_handle, cb, &read, (BYTE*)pData);
+				if (hr == WBEM_S_FALSE)
+					return false;
+				nv2::throw_if(hr != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				return true;
+			}
+
+		public:
+
+			BoundProperty() {}
+
+			//-------------------------------------------------------------------------
+			// from an already resolved handle
+			BoundProperty(long handle, CIMTYPE type)
+				: m_handle(handle)
+				, m_type(type)
+			{
+			}
+
+			//-------------------------------------------------------------------------
+			BoundProperty(IWbemObjectAccess* pAccess, const std::wstring& name)
+				: m_name(name)
+			{
+				nv2::throw_if(pAccess == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				HRESULT hr = pAccess->GetPropertyHandle(name.c_str(), &m_type, &m_handle);
+				nv2::throw_if(hr != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			}
+
+			//-------------------------------------------------------------------------
+			const std::wstring& Name() const
+			{
+				return m_name;
+			}
+
+			CIMTYPE Type() const
+			{
+				return m_type;
+			}
+
+			long Handle() const
+			{
+				return m_handle;
+			}
+
+			//-------------------------------------------------------------------------
+			// any integral CIM type, widened
+			bool ReadInt64(IWbemObjectAccess* pAccess, int64_t& value) const
+			{
+				HRESULT hr = WBEM_S_NO_ERROR;
+				switch (m_type)
+				{
+				case CIM_SINT64:
+				case CIM_UINT64:
+				{
+					ULONGLONG qw = 0;
+					hr = pAccess->ReadQWORD(m_handle, &qw);
+					value = (int64_t)qw;
+					break;
+				}
+				case CIM_SINT32:
+				{
+					DWORD dw = 0;
+					hr = pAccess->ReadDWORD(m_handle, &dw);
+					value = (int32_t)dw;
+					break;
+				}
+				case CIM_UINT32:
+				{
+					DWORD dw = 0;
+					hr = pAccess->ReadDWORD(m_handle, &dw);
+					value = dw;
+					break;
+				}
+				case CIM_SINT16:
+				{
+					int16_t v = 0;
+					if (!ReadRaw(pAccess, &v, sizeof(v)))
+						return false;
+					value = v;
+					break;
+				}
+				case CIM_UINT16:
+				case CIM_CHAR16:
+				{
+					uint16_t v = 0;
+					if (!ReadRaw(pAccess, &v, sizeof(v)))
+						return false;
+					value = v;
+					break;
+				}
+				case CIM_SINT8:
+				{
+					int8_t v = 0;
+					if (!ReadRaw(pAccess, &v, sizeof(v)))
+						return false;
+					value = v;
+					break;
+				}
+				case CIM_UINT8:
+				{
+					uint8_t v = 0;
+					if (!ReadRaw(pAccess, &v, sizeof(v)))
+						return false;
+					value = v;
+					break;
+				}
+				case CIM_BOOLEAN:
+				{
+					VARIANT_BOOL v = VARIANT_FALSE;
+					if (!ReadRaw(pAccess, &v, sizeof(v)))
+						return false;
+					value = (v != VARIANT_FALSE);
+					break;
+				}
+				default:
+					nv2::throw_if(true, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_TYPE_MISMATCH))));
+				}
+				if (hr == WBEM_S_FALSE)
+					return false;
+				nv2::throw_if(hr != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				return true;
+			}
+
+			//-------------------------------------------------------------------------
+			bool ReadUInt64(IWbemObjectAccess* pAccess, uint64_t& value) const
+			{
+				int64_t v = 0;
+				bool ret = ReadInt64(pAccess, v);
+				value = (uint64_t)v;
+				return ret;
+			}
+
+			//-------------------------------------------------------------------------
+			// real types directly, integral types converted
+			bool ReadDouble(IWbemObjectAccess* pAccess, double& value) const
+			{
+				if (m_type == CIM_REAL64)
+				{
+					return ReadRaw(pAccess, &value, sizeof(value));
+				}
+				if (m_type == CIM_REAL32)
+				{
+					float v = 0;
+					bool ret = ReadRaw(pAccess, &v, sizeof(v));
+					value = v;
+					return ret;
+				}
+				if (m_type == CIM_UINT64)
+				{
+					uint64_t v = 0;
+					bool ret = ReadUInt64(pAccess, v);
+					value = (double)v;
+					return ret;
+				}
+				int64_t v = 0;
+				bool ret = ReadInt64(pAccess, v);
+				value = (double)v;
+				return ret;
+			}
+
+			//-------------------------------------------------------------------------
+			// strings, datetimes and references. value's capacity is reused
+			// so steady state reads do not allocate
+			bool ReadString(IWbemObjectAccess* pAccess, std::wstring& value) const
+			{
+				if (value.capacity() < 64)
+					value.reserve(64);
+				for (;;)
+				{
+					// have the provider write straight into the string buffer
+					value.resize(value.capacity());
+					long cb = (long)((value.size() + 1) * sizeof(wchar_t));
+					long read = 0;
+					HRESULT hr = pAccess->ReadPropertyValue(m_handle, cb, &read, (BYTE*)&value[0]);
+					if (hr == WBEM_E_BUFFER_TOO_SMALL)
+					{
+						value.reserve(read / sizeof(wchar_t));
+						continue;
+					}
+					if (hr == WBEM_S_FALSE)
+					{
+						value.clear();
+						return false;
+					}
+					nv2::throw_if(hr != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+					// read includes the terminator
+					value.resize(read > 0 ? (read / sizeof(wchar_t)) - 1 : 0);
+					return true;
+				}
+			}
+
+			//-------------------------------------------------------------------------
+			// CIM_DATETIME via a stack buffer. see ParseDateTime
+			bool ReadFileTime(IWbemObjectAccess* pAccess, FILETIME& value) const
+			{
+				nv2::throw_if(m_type != CIM_DATETIME, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_TYPE_MISMATCH))));
+				wchar_t buffer[32] = {};
+				long read = 0;
+				HRESULT hr = pAccess->ReadPropertyValue(m_handle, (long)sizeof(buffer), &read, (BYTE*)buffer);
+				if (hr == WBEM_S_FALSE)
+					return false;
+				nv2::throw_if(hr != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				size_t len = (read > 0 ? (read / sizeof(wchar_t)) - 1 : 0);
+				return ParseDateTime(buffer, len, value);
+			}
+		};
+
+		//-----------------------------------------------------------------------------
+		// N properties bound against one class
+		class PropertySet
+		{
+			std::vector<BoundProperty> m_props;
+
+		public:
+
+			PropertySet() {}
+
+			//-------------------------------------------------------------------------
+			// pTemplate can be any instance of the class
+			PropertySet(IWbemObjectAccess* pTemplate, const std::vector<std::wstring>& names)
+			{
+				m_props.reserve(names.size());
+				for (auto& name : names)
+				{
+					m_props.push_back(BoundProperty(pTemplate, name));
+				}
+			}
+
+			//-------------------------------------------------------------------------
+			PropertySet(IWbemClassObject* pTemplate, const std::vector<std::wstring>& names)
+				: PropertySet(ObjectAccess(pTemplate), names)
+			{
+			}
+
+			//-------------------------------------------------------------------------
+			bool Empty() const
+			{
+				return m_props.empty();
+			}
+
+			size_t Size() const
+			{
+				return m_props.size();
+			}
+
+			const BoundProperty& operator[](size_t i) const
+			{
+				return m_props[i];
+			}
+
+			//-------------------------------------------------------------------------
+			// read every property as uint64. NULLs read as 0 and clear the
+			// corresponding bit in the return value (for up to 64 properties)
+			uint64_t ReadUInt64(IWbemObjectAccess* pAccess, uint64_t* values) const
+			{
+				uint64_t present = 0;
+				for (size_t i = 0; i < m_props.size(); i++)
+				{
+					values[i] = 0;
+					if (m_props[i].ReadUInt64(pAccess, values[i]) && i < 64)
+						present |= (1ull << i);
+				}
+				return present;
+			}
+		};
+
+		//-----------------------------------------------------------------------------
+		// a PropertySet per class, bound the first time an instance of the
+		// class turns up. deep enumerations may return subclasses, which need
+		// their own handles
+		class BoundClasses
+		{
+		public:
+
+			// keyed by __CLASS. map nodes never move, so the keys may be viewed
+			using entry_t = std::pair<const std::wstring, PropertySet>;
+
+		private:
+
+			std::vector<std::wstring> m_names;
+			std::map<std::wstring, PropertySet> m_bound;
+
+		public:
+
+			explicit BoundClasses(const std::vector<std::wstring>& names)
+				: m_names(names)
+			{
+			}
+
+			//-------------------------------------------------------------------------
+			// the class name and properties of pAccess's class
+			const entry_t& Bind(IWbemObjectAccess* pAccess)
+			{
+				CComVariant vClass;
+				HRESULT hR = pAccess->Get(_W("__CLASS"), 0, &vClass, NULL, NULL);
+				nv2::throw_if(hR != WBEM_S_NO_ERROR || vClass.vt != VT_BSTR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hR))));
+				auto found = m_bound.find(vClass.bstrVal);
+				if (found == m_bound.end())
+					found = m_bound.insert(std::make_pair(std::wstring(vClass.bstrVal), PropertySet(pAccess, m_names))).first;
+				return *found;
+			}
+		};
+
+		//-----------------------------------------------------------------------------
+		// give pProxy the security blanket of pFrom, i.e. an IWbemCallResult
+		// returned through a remote IWbemServices. in-process objects are
+		// not proxies (E_NOINTERFACE), which is fine
+		static
+		HRESULT
+			CopyBlanket(IUnknown* pFrom, IUnknown* pProxy)
+		{
+			DWORD authn = 0, authz = 0, level = 0, imp = 0, caps = 0;
+			RPC_AUTH_IDENTITY_HANDLE identity = NULL;
+			HRESULT hr = CoQueryProxyBlanket(pFrom, &authn, &authz, NULL, &level, &imp, &identity, &caps);
+			if (hr == S_OK)
+				hr = CoSetProxyBlanket(pProxy, authn, authz, COLE_DEFAULT_PRINCIPAL, level, imp, identity, caps);
+			return (hr == E_NOINTERFACE ? S_OK : hr);
+		}
+
+		//-----------------------------------------------------------------------------
+		// collect the object of a semi-synchronous (WBEM_FLAG_RETURN_IMMEDIATELY)
+		// call, giving up at deadline. returns the call's HRESULT, or
+		// WBEM_E_TIMED_OUT/WBEM_E_CALL_CANCELLED. releasing pResult abandons the call
+		static
+		HRESULT
+			WaitResult(IWbemCallResult* pResult, const Deadline& deadline, IWbemClassObject** ppObj)
+		{
+			nv2::throw_if(pResult == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+			for (;;)
+			{
+				HRESULT hr = pResult->GetResultObject(deadline.Slice(), ppObj);
+				if (hr != WBEM_S_TIMEDOUT)
+					return hr;
+				if (deadline.Expired())
+					return deadline.Status();
+			}
+		}
+
+		class AsyncCall;
+
+		//-----------------------------------------------------------------------------
+		// badly named 
+		class Object
+		{
+		// protected:
+				
+			CComPtr<IWbemClassObject> m_pObj;
+			CComPtr<IWbemServices> m_pServices;
+			// shared class definitions. may be null, in which case we fetch each time
+			std::shared_ptr<ClassCache> m_pCache;
+			// resolved on first use. so GetSchema on one Object is not thread safe
+			mutable std::shared_ptr<const ClassSchema> m_pSchema;
+
+		public:
+
+			// Creates an empty (invalid) WMIObject
+			// Object() {}
+
+			//-----------------------------------------------------------------------------
+			// Creates a WMIObject for a given IWbemClassObject instance
+			Object(const CComPtr<IWbemClassObject>& pObj, 
+					const CComPtr<IWbemServices>& pServices,
+					const std::shared_ptr<ClassCache>& pCache = nullptr)
+				: m_pObj(pObj)
+				, m_pServices(pServices)
+				, m_pCache(pCache)
+			{
+			}
+
+			//-----------------------------------------------------------------------------
+			Object(const VARIANT* pInterface, const CComPtr<IWbemServices>& pServices,
+					const std::shared_ptr<ClassCache>& pCache = nullptr)
+				: m_pCache(pCache)
+			{
+				nv2::throw_if(pInterface == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				nv2::throw_if(pInterface && pInterface->vt != VT_UNKNOWN, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_INVALIDARG))));
+
+				nv2::throw_if(!pServices, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				pInterface->punkVal->QueryInterface(&m_pObj);
+
+				m_pServices = pServices;
+			}
+
+			//-----------------------------------------------------------------------------
+			Object(IUnknown* pUnknown, const CComPtr<IWbemServices>& pServices,
+					const std::shared_ptr<ClassCache>& pCache = nullptr)
+				: m_pCache(pCache)
+			{
+				nv2::throw_if(!pUnknown, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				pUnknown->QueryInterface(&m_pObj);
+
+				m_pServices = pServices;
+			}
+
+			//-----------------------------------------------------------------------------
+			// Tests WMIObject instance for validity
+			bool Valid() const
+			{
+				return m_pObj != NULL;
+			}
+
+			//-----------------------------------------------------------------------------
+			// the underlying object
+			const CComPtr<IWbemClassObject>& Interface() const
+			{
+				return m_pObj;
+			}
+
+			//-----------------------------------------------------------------------------
+			// the services the object came from
+			const CComPtr<IWbemServices>& GetServices() const
+			{
+				return m_pServices;
+			}
+
+			const std::shared_ptr<ClassCache>& GetCache() const
+			{
+				return m_pCache;
+			}
+
+			//-----------------------------------------------------------------------------
+			// get all properties
+			std::vector<std::wstring> 
+				GetProperties() const
+			{
+				nv2::throw_if(!m_pObj, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				// without a cache a schema costs a round trip, so just ask the instance
+				if (!m_pCache && !m_pSchema)
+					return EnumNames(m_pObj);
+				std::shared_ptr<const ClassSchema> pSchema = GetSchema();
+				// a projection (SELECT a,b or a partial instance context) has
+				// only some of the class's properties
+				CComVariant count;
+				HRESULT hR = m_pObj->Get(_W("__PROPERTY_COUNT"), 0, &count, NULL, NULL);
+				if (hR == WBEM_S_NO_ERROR && count.ChangeType(VT_I4) == S_OK && (size_t)count.lVal != pSchema->names.size())
+					return EnumNames(m_pObj);
+				return pSchema->names;
+			}
+
+			//-----------------------------------------------------------------------------
+			std::wstring 
+				GetValue(const std::wstring& property) const
+			{
+				nv2::throw_if(!m_pObj, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				CallTimer timer(Op::GetValue, property.c_str());
+				CComVariant val;
+				HRESULT hResult = m_pObj->Get(property.c_str(), 0, &val, NULL, NULL);
+				if (hResult != S_OK)
+					timer.Done(hResult);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+
+				std::wstring ret;
+				if (val.vt == VT_NULL) 
+				{
+					ret = _W("NULL");
+				}
+				else if (val.vt == VT_BOOL)
+				{
+					ret = (val.bVal ? _W("true") : _W("false"));
+				}
+				else if (val.vt & VT_ARRAY)
+				{
+					ret = ArrayText(val);
+				}
+				else if (!((val.vt == VT_LPWSTR) || (val.vt == VT_BSTR)))
+				{	
+					val.ChangeType(VT_BSTR);
+					ret = val.bstrVal;
+				}
+				else
+				{
+					ret = val.bstrVal;
+				}
+				timer.Done(S_OK);
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// an array property in place, i.e. GetArray<BSTR>(L"IPAddress") or
+			// GetArray<uint8_t> for a uint8[] blob. see SafeArrayType for the T
+			// each CIM array type needs. empty if NULL
+			template <typename T>
+			SafeArrayView<T>
+				GetArray(const std::wstring& property) const
+			{
+				nv2::throw_if(!m_pObj, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				CallTimer timer(Op::GetValue, property.c_str());
+				CComVariant val;
+				HRESULT hResult = m_pObj->Get(property.c_str(), 0, &val, NULL, NULL);
+				timer.Done(hResult);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+				return SafeArrayView<T>::Take(val);
+			}
+
+			//-----------------------------------------------------------------------------
+			// an embedded object property, i.e. TargetInstance of an event
+			Object
+				GetEmbedded(const std::wstring& property) const
+			{
+				nv2::throw_if(!m_pObj, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				CComVariant val;
+				HRESULT hResult = m_pObj->Get(property.c_str(), 0, &val, NULL, NULL);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+
+				return Object(&val, m_pServices, m_pCache);
+			}
+
+			//-----------------------------------------------------------------------------
+			int
+				GetIValue(const std::wstring& property) const
+			{
+				nv2::throw_if(!m_pObj, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				CComVariant val;
+				HRESULT hResult = m_pObj->Get(property.c_str(), 0, &val, NULL, NULL);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+
+				// should be a trait
+				if (val.vt != VT_INT)
+					val.ChangeType(VT_INT);
+
+				//
+				return val.intVal;
+			}
+
+			//-----------------------------------------------------------------------------
+			// resolve property to a handle for a single read. no allocation
+			BoundProperty Bind(LPCWSTR property, CComPtr<IWbemObjectAccess>& pAccess) const
+			{
+				nv2::throw_if(!m_pObj, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				pAccess = ObjectAccess(m_pObj);
+				long handle = 0;
+				CIMTYPE type = CIM_EMPTY;
+				HRESULT hr = pAccess->GetPropertyHandle(property, &type, &handle);
+				nv2::throw_if(hr != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				return BoundProperty(handle, type);
+			}
+
+			//-----------------------------------------------------------------------------
+			// typed getters. read the native CIM type, so 64 bit values are not
+			// truncated and nothing round trips through a string.
+			// return false if the property is NULL, throw on a type mismatch
+			template <typename T>
+			bool Get(LPCWSTR property, T& value) const
+			{
+				static_assert(std::is_arithmetic<T>::value, "Get<T>: unsupported type");
+
+				CComPtr<IWbemObjectAccess> pAccess;
+				BoundProperty prop = Bind(property, pAccess);
+				bool ret = false;
+				if (std::is_floating_point<T>::value)
+				{
+					double v = 0;
+					ret = prop.ReadDouble(pAccess, v);
+					value = (T)v;
+				}
+				else if (std::is_same<T, bool>::value)
+				{
+					int64_t v = 0;
+					ret = prop.ReadInt64(pAccess, v);
+					value = (v != 0);
+				}
+				else if (std::is_unsigned<T>::value)
+				{
+					uint64_t v = 0;
+					ret = prop.ReadUInt64(pAccess, v);
+					value = (T)v;
+				}
+				else
+				{
+					int64_t v = 0;
+					ret = prop.ReadInt64(pAccess, v);
+					value = (T)v;
+				}
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// CIM_DATETIME. timestamps as UTC, intervals as a tick count
+			bool Get(LPCWSTR property, FILETIME& value) const
+			{
+				CComPtr<IWbemObjectAccess> pAccess;
+				BoundProperty prop = Bind(property, pAccess);
+				return prop.ReadFileTime(pAccess, value);
+			}
+
+			//-----------------------------------------------------------------------------
+			// string types, without coercion
+			bool Get(LPCWSTR property, std::wstring& value) const
+			{
+				CComPtr<IWbemObjectAccess> pAccess;
+				BoundProperty prop = Bind(property, pAccess);
+				return prop.ReadString(pAccess, value);
+			}
+
+			//-----------------------------------------------------------------------------
+			// view over the BSTR itself. valid for the lifetime of storage
+			bool Get(LPCWSTR property, std::wstring_view& value, CComVariant& storage) const
+			{
+				nv2::throw_if(!m_pObj, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				storage.Clear();
+				CIMTYPE type = CIM_EMPTY;
+				HRESULT hResult = m_pObj->Get(property, 0, &storage, &type, NULL);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+				if (storage.vt == VT_NULL || storage.vt == VT_EMPTY)
+				{
+					value = std::wstring_view();
+					return false;
+				}
+				nv2::throw_if(storage.vt != VT_BSTR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_TYPE_MISMATCH))));
+				value = std::wstring_view(storage.bstrVal, SysStringLen(storage.bstrVal));
+				return true;
+			}
+
+			//-----------------------------------------------------------------------------
+			// i.e. uint64_t size = disk.Get<uint64_t>(L"Size"); NULL reads as T()
+			template <typename T>
+			T Get(LPCWSTR property) const
+			{
+				T ret = T();
+				Get(property, ret);
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// the schema of this object's class, from the cache if we have one.
+			// instances from the same Services share one schema per class
+			const std::shared_ptr<const ClassSchema>& GetSchema() const
+			{
+				if (!m_pSchema)
+				{
+					std::wstring className = GetValue(L"__CLASS");
+					if (m_pCache)
+						m_pSchema = m_pCache->Get(className);
+					else
+						m_pSchema = MakeClassSchema(m_pServices, className);
+				}
+				return m_pSchema;
+			}
+
+			//-----------------------------------------------------------------------------
+			std::vector<MethodDef> GetMethods()
+			{
+				return GetSchema()->methods;
+			}
+
+			//-----------------------------------------------------------------------------
+			// simplify parameter declarations
+			using name_t = std::wstring;
+			using value_t = CComVariant;
+			using param_t = std::pair<name_t, value_t>;
 			using param_list = std::initializer_list<param_t>;
 			using param_map = std::map<name_t,value_t>;
 			using param_iterator = param_map::iterator;
 			//-----------------------------------------------------------------------------
-			// nonstandard extension
-#pragma warning ( suppress: 4239 )
-			CComVariant
-				ExecMethod(LPCWSTR lpMethodName,
-					const param_list& iparams,
-					param_map& oparams = param_map())
+			// spawn and populate an in-parameter instance for lpMethodName.
+			// returns null if the method takes no parameters
+			CComPtr<IWbemClassObject>
+				MakeInParams(LPCWSTR lpMethodName, const param_list& iparams) const
+			{
+				nv2::throw_if(m_pServices == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				nv2::throw_if(m_pObj == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				std::shared_ptr<const ClassSchema> pSchema = GetSchema();
+				if (!pSchema->Complete())
+				{
+					// loaded from disk. the parameter classes need the real thing
+					pSchema = (m_pCache ? m_pCache->GetComplete(pSchema->name) : MakeClassSchema(m_pServices, pSchema->name));
+					m_pSchema = pSchema;
+				}
+				CComPtr<IWbemClassObject> pInParamsClass = pSchema->InParams(lpMethodName);
+
+				CComPtr<IWbemClassObject> pInParamsInstance;
+				if (pInParamsClass)
+				{
+					HRESULT hR = pInParamsClass->SpawnInstance(0, &pInParamsInstance);
+					// check hR
+					DBMSG("pInParamsClass->SpawnInstance => " << nv2::s_error(uw32::Win32FromHResult(hR)));
+					//
+					for (auto& iparam : iparams)
+					{
+						hR = pInParamsInstance->Put(iparam.first.c_str(), 
+													0, 
+														&const_cast<CComVariant&>(iparam.second), 
+													iparam.second.vt);
+						// check hR
+						DBMSG(iparam.first << " => " << nv2::s_error(uw32::Win32FromHResult(hR))); 
+					}
+				}
+				return pInParamsInstance;
+			}
+
+			//-----------------------------------------------------------------------------
+			// unpack a method's out-parameter instance. returns ReturnValue,
+			// everything else goes into oparams
+			static
+			CComVariant
+				ReadOutParams(const CComPtr<IWbemClassObject>& pOutParamsInstance, param_map& oparams)
+			{
+				CComVariant ret;
+				// always get the return value
+				if (pOutParamsInstance) 
+				{
+					// there is always a return value
+					HRESULT hR = pOutParamsInstance->Get(_W("ReturnValue"), 0, &ret, NULL, NULL);
+					DBMSG("pOutParamsInstance->Get => " << nv2::s_error(uw32::Win32FromHResult(hR)));
+
+					hR = pOutParamsInstance->BeginEnumeration(WBEM_FLAG_NONSYSTEM_ONLY);
+					DBMSG("pOutParamsInstance->BeginEnumeration => " << nv2::s_error(uw32::Win32FromHResult(hR)));
+					for (;;)
+					{
+						CComBSTR name;
+						CComVariant val;
+						// name.AssignBSTR(NULL);
+						hR = pOutParamsInstance->Next(0, &name, &val, NULL, NULL);
+						if (!name)
+							break;
+						if (name == _W("ReturnValue"))	
+							continue;
+						// otherwise map it
+						oparams[std::wstring(name)] = val;
+					}
+					hR = pOutParamsInstance->EndEnumeration();
+					DBMSG("pOutParamsInstance->EndEnumeration => " << nv2::s_error(uw32::Win32FromHResult(hR)));
+				}
+				//
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// nonstandard extension
+#pragma warning ( suppress: 4239 )
+			CComVariant
+				ExecMethod(LPCWSTR lpMethodName,
+					const param_list& iparams,
+					param_map& oparams = param_map())
+			{
+				nv2::throw_if(m_pServices == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				nv2::throw_if(m_pObj == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				
+				CComPtr<IWbemClassObject> pInParamsInstance = MakeInParams(lpMethodName, iparams);
+
+				// synchronous call	
+				long lFlags = 0;
+				IWbemContext* pCtx = NULL;
+				CComPtr<IWbemClassObject> pOutParamsInstance;
+
+				// https://learn.microsoft.com/en-us/windows/win32/wmisdk/describing-a-class-object-path
+				std::wstring relPath = GetValue(L"__RELPATH");
+				CallTimer timer(Op::ExecMethod, lpMethodName);
+				HRESULT hR = m_pServices->ExecMethod(CComBSTR(relPath.c_str()), 
+					CComBSTR(lpMethodName), 
+					lFlags,		// synchronous
+					pCtx,	// 
+					pInParamsInstance, 
+					&pOutParamsInstance, 
+					NULL);
+				timer.Done(hR);
+				DBMSG("m_pServices->ExecMethod => " << nv2::s_error(uw32::Win32FromHResult(hR)));
+
+				return ReadOutParams(pOutParamsInstance, oparams);
+			}
+
+			//-----------------------------------------------------------------------------
+			// as above but gives up at deadline, throwing WBEM_E_TIMED_OUT (or
+			// WBEM_E_CALL_CANCELLED). the method may still complete server side
+#pragma warning ( suppress: 4239 )
+			CComVariant
+				ExecMethod(LPCWSTR lpMethodName,
+					const param_list& iparams,
+					const Deadline& deadline,
+					param_map& oparams = param_map())
+			{
+				nv2::throw_if(m_pServices == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				nv2::throw_if(m_pObj == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				CComPtr<IWbemClassObject> pInParamsInstance = MakeInParams(lpMethodName, iparams);
+				std::wstring relPath = GetValue(L"__RELPATH");
+
+				CComPtr<IWbemCallResult> pResult;
+				CComPtr<IWbemClassObject> pOutParamsInstance;
+				CallTimer timer(Op::ExecMethod, lpMethodName);
+				HRESULT hR = m_pServices->ExecMethod(CComBSTR(relPath.c_str()),
+					CComBSTR(lpMethodName),
+					WBEM_FLAG_RETURN_IMMEDIATELY,	// semi-synchronous
+					NULL,
+					pInParamsInstance,
+					NULL,
+					&pResult);
+				if (hR == WBEM_S_NO_ERROR)
+					hR = CopyBlanket(m_pServices, pResult);
+				if (hR == WBEM_S_NO_ERROR)
+					hR = WaitResult(pResult, deadline, &pOutParamsInstance);
+				timer.Done(hR);
+				DBMSG("m_pServices->ExecMethod => " << nv2::s_error(uw32::Win32FromHResult(hR)));
+				nv2::throw_if(hR != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hR))));
+
+				return ReadOutParams(pOutParamsInstance, oparams);
+			}
+
+			//-----------------------------------------------------------------------------
+			// asynchronous call. the out-parameter instance is delivered as a
+			// single object batch. see AsyncCall and ReadOutParams
+			std::shared_ptr<AsyncCall>
+				ExecMethodAsync(LPCWSTR lpMethodName,
+					const param_list& iparams,
+					std::function<void(std::vector<Object>&)> onBatch = nullptr,
+					std::function<void(HRESULT)> onComplete = nullptr);
+
+			//-----------------------------------------------------------------------------
+			// as above with an already populated in-parameter instance (or null)
+			std::shared_ptr<AsyncCall>
+				ExecMethodAsync(LPCWSTR lpMethodName,
+					IWbemClassObject* pInParamsInstance,
+					std::function<void(std::vector<Object>&)> onBatch = nullptr,
+					std::function<void(HRESULT)> onComplete = nullptr);
+
+			//-----------------------------------------------------------------------------
+			// the objects associated with this one, optionally only those of
+			// resultClass, where this object plays role, through assocClass.
+			// see AssociatorsQuery. one query per call: for many objects of
+			// one class use Services::AssociatorsBatch
+			std::vector<Object>
+				Associators(const std::wstring& resultClass = _W(""),
+					const std::wstring& role = _W(""),
+					const std::wstring& assocClass = _W("")) const;
+
+			//-----------------------------------------------------------------------------
+			// the association instances referring to this object
+			std::vector<Object>
+				References(const std::wstring& resultClass = _W(""),
+					const std::wstring& role = _W("")) const;
+		};	// WMIObject
+
+		//---------------------------------------------------------------------
+		// Lazy, forward only sequence of instances. Wraps a semi-synchronous
+		// IEnumWbemClassObject (WBEM_FLAG_FORWARD_ONLY|WBEM_FLAG_RETURN_IMMEDIATELY)
+		// and pulls objects in batches so the caller can work on the first batch
+		// while the provider is still producing the rest.
+		// https://learn.microsoft.com/en-us/windows/win32/wmisdk/making-a-semisynchronous-call
+		class InstanceStream
+		{
+			CComPtr<IEnumWbemClassObject> m_pEnum;
+			CComPtr<IWbemServices> m_pServices;
+			std::shared_ptr<ClassCache> m_pCache;
+			// we own one reference on each of the first m_count entries
+			std::vector<IWbemClassObject*> m_batch;
+			ULONG m_count = 0;
+			ULONG m_pos = 0;
+			long m_timeout = WBEM_INFINITE;
+			bool m_done = false;
+			// class or query, for instrumentation
+			std::wstring m_target;
+			// overrides m_timeout when Bounded
+			Deadline m_deadline;
+			// why the stream ended early, see Status()
+			HRESULT m_status = WBEM_S_NO_ERROR;
+
+			//-----------------------------------------------------------------
+			void Clear()
+			{
+				for (ULONG i = 0; i < m_count; i++)
+				{
+					if (m_batch[i])
+						m_batch[i]->Release();
+					m_batch[i] = nullptr;
+				}
+				m_count = 0;
+				m_pos = 0;
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			// single pass input iterator. *it yields an Object
+			class iterator
+			{
+				InstanceStream* m_pStream = nullptr;
+
+			public:
+
+				using iterator_category = std::input_iterator_tag;
+				using value_type = Object;
+				using difference_type = std::ptrdiff_t;
+				using pointer = void;
+				using reference = Object;
+
+				iterator() {}
+				explicit iterator(InstanceStream* pStream) : m_pStream(pStream)
+				{
+					if (m_pStream && !m_pStream->Advance())
+						m_pStream = nullptr;
+				}
+
+				Object operator*() const
+				{
+					return Object(CComPtr<IWbemClassObject>(m_pStream->Current()), m_pStream->m_pServices, m_pStream->m_pCache);
+				}
+
+				iterator& operator++()
+				{
+					if (m_pStream && !m_pStream->Advance())
+						m_pStream = nullptr;
+					return *this;
+				}
+
+				bool operator==(const iterator& other) const
+				{
+					return m_pStream == other.m_pStream;
+				}
+
+				bool operator!=(const iterator& other) const
+				{
+					return m_pStream != other.m_pStream;
+				}
+			};
+
+			//-----------------------------------------------------------------
+			InstanceStream(const CComPtr<IEnumWbemClassObject>& pEnum,
+							const CComPtr<IWbemServices>& pServices,
+							ULONG batchSize = 64,
+							const std::shared_ptr<ClassCache>& pCache = nullptr,
+							const std::wstring& target = std::wstring())
+				: m_pEnum(pEnum)
+				, m_pServices(pServices)
+				, m_pCache(pCache)
+				, m_batch(batchSize ? batchSize : 1, nullptr)
+				, m_target(target)
+			{
+				nv2::throw_if(m_pEnum == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+			}
+
+			InstanceStream(const InstanceStream&) = delete;
+			InstanceStream& operator=(const InstanceStream&) = delete;
+
+			InstanceStream(InstanceStream&& other)
+				: m_pEnum(std::move(other.m_pEnum))
+				, m_pServices(std::move(other.m_pServices))
+				, m_pCache(std::move(other.m_pCache))
+				, m_batch(std::move(other.m_batch))
+				, m_count(other.m_count)
+				, m_pos(other.m_pos)
+				, m_timeout(other.m_timeout)
+				, m_done(other.m_done)
+				, m_target(std::move(other.m_target))
+				, m_deadline(other.m_deadline)
+				, m_status(other.m_status)
+			{
+				other.m_count = 0;
+				other.m_pos = 0;
+				other.m_done = true;
+			}
+
+			~InstanceStream()
+			{
+				Clear();
+			}
+
+			//-----------------------------------------------------------------
+			// timeout (ms) passed to each IEnumWbemClassObject::Next call
+			void SetTimeout(long timeout)
+			{
+				m_timeout = timeout;
+			}
+
+			//-----------------------------------------------------------------
+			// stop the stream once deadline expires or its token is cancelled.
+			// the stream then ends, without throwing, after what has already
+			// arrived and Status() says why
+			void SetDeadline(const Deadline& deadline)
+			{
+				m_deadline = deadline;
+			}
+
+			//-----------------------------------------------------------------
+			// WBEM_S_NO_ERROR unless the deadline cut the stream short, in
+			// which case WBEM_E_TIMED_OUT or WBEM_E_CALL_CANCELLED
+			HRESULT Status() const
+			{
+				return m_status;
+			}
+
+			//-----------------------------------------------------------------
+			// true once the enumeration has ended
+			bool Done() const
+			{
+				return m_done;
+			}
+
+			//-----------------------------------------------------------------
+			// fetch the next batch from the provider. blocks until the batch is
+			// full or the enumeration ends. when a Next call times out, with
+			// SetTimeout or a deadline, the partial (maybe empty) batch is
+			// returned and the stream carries on, so 0 is only the end once
+			// Done(). returns the number of objects fetched
+			ULONG NextBatch()
+			{
+				Clear();
+				if (m_done)
+					return 0;
+				ULONG returned = 0;
+				HRESULT hr = WBEM_S_NO_ERROR;
+				for (;;)
+				{
+					if (m_deadline.Bounded() && m_deadline.Expired())
+					{
+						m_status = m_deadline.Status();
+						m_done = true;
+						return 0;
+					}
+					CallTimer timer(Op::Next, m_target.c_str());
+					hr = m_pEnum->Next(m_deadline.Bounded() ? m_deadline.Slice() : m_timeout, (ULONG)m_batch.size(), m_batch.data(), &returned);
+					timer.Done(hr, returned);
+					if (hr != WBEM_S_TIMEDOUT || returned || !m_deadline.Bounded())
+						break;
+				}
+				m_count = returned;
+				// WBEM_S_FALSE => fewer than requested, i.e. end of enumeration
+				if (hr == WBEM_S_FALSE || (hr == WBEM_S_NO_ERROR && returned == 0))
+					m_done = true;
+				else if (hr != WBEM_S_TIMEDOUT)
+					nv2::throw_if(hr != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				return m_count;
+			}
+
+			//-----------------------------------------------------------------
+			// release the current batch now rather than on the next fetch,
+			// i.e. once its values have been copied out
+			void ReleaseBatch()
+			{
+				Clear();
+			}
+
+			//-----------------------------------------------------------------
+			// step to the next object, fetching a new batch when necessary.
+			// false when the enumeration is exhausted. an empty batch after a
+			// timeout is skipped
+			bool Advance()
+			{
+				if (m_pos + 1 < m_count)
+				{
+					m_pos++;
+					return true;
+				}
+				while (NextBatch() == 0)
+				{
+					if (m_done)
+						return false;
+				}
+				return true;
+			}
+
+			//-----------------------------------------------------------------
+			// the current object. no reference is added. valid until Advance()
+			IWbemClassObject* Current() const
+			{
+				nv2::throw_if(m_pos >= m_count, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				return m_batch[m_pos];
+			}
+
+			//-----------------------------------------------------------------
+			// the objects in the current batch, valid until the next fetch
+			IWbemClassObject* const* BatchBegin() const
+			{
+				return m_batch.data();
+			}
+
+			IWbemClassObject* const* BatchEnd() const
+			{
+				return m_batch.data() + m_count;
+			}
+
+			//-----------------------------------------------------------------
+			const CComPtr<IWbemServices>& GetServices() const
+			{
+				return m_pServices;
+			}
+
+			//-----------------------------------------------------------------
+			const std::shared_ptr<ClassCache>& GetCache() const
+			{
+				return m_pCache;
+			}
+
+			//-----------------------------------------------------------------
+			// bind properties against the current object. the handles are
+			// good for the rest of the stream when it is a single class
+			PropertySet Bind(const std::vector<std::wstring>& names) const
+			{
+				return PropertySet(Current(), names);
+			}
+
+			//-----------------------------------------------------------------
+			iterator begin()
+			{
+				return iterator(this);
+			}
+
+			iterator end()
+			{
+				return iterator();
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// wait for h, up to timeout ms. on an STA thread messages are pumped
+		// meanwhile so COM calls into the apartment, i.e. a sink's Indicate
+		// and SetStatus, are still delivered. true if h was signalled
+		static
+		bool
+			WaitPumping(HANDLE h, DWORD timeout)
+		{
+			DWORD index = 0;
+			HRESULT hr = CoWaitForMultipleHandles(0, timeout, 1, &h, &index);
+			return hr == S_OK;
+		}
+
+		//---------------------------------------------------------------------
+		// IWbemObjectSink implementation for the *Async calls. Objects are
+		// delivered in batches to onBatch (on a WMI/RPC thread) or, if no
+		// callback is supplied, accumulated for collection via AsyncCall.
+		// https://learn.microsoft.com/en-us/windows/win32/wmisdk/making-an-asynchronous-call-with-c--
+		class ObjectSink : public IWbemObjectSink
+		{
+		public:
+
+			using batch_fn = std::function<void(std::vector<Object>&)>;
+			using complete_fn = std::function<void(HRESULT)>;
+
+		private:
+
+			LONG m_ref = 0;
+			CComPtr<IWbemServices> m_pServices;
+			std::shared_ptr<ClassCache> m_pCache;
+			batch_fn m_onBatch;
+			complete_fn m_onComplete;
+			// held while a callback runs. recursive so a callback may
+			// destroy its own AsyncCall
+			std::recursive_mutex m_callbackLock;
+			// set by Detach. the callbacks are then never run again
+			bool m_detached = false;
+			// aggregated free threaded marshaler, so in process callers on
+			// any thread reach the sink directly rather than through the
+			// creating apartment
+			CComPtr<IUnknown> m_pMarshaler;
+			// manual reset, signalled on completion. see AsyncCall::Wait
+			HANDLE m_hDone = NULL;
+			std::mutex m_lock;
+			std::vector<Object> m_results;
+			bool m_done = false;
+			HRESULT m_status = WBEM_S_NO_ERROR;
+			std::promise<HRESULT> m_promise;
+			std::shared_future<HRESULT> m_future;
+
+			//-----------------------------------------------------------------
+			ObjectSink(const CComPtr<IWbemServices>& pServices,
+						batch_fn onBatch,
+						complete_fn onComplete,
+						const std::shared_ptr<ClassCache>& pCache)
+				: m_pServices(pServices)
+				, m_pCache(pCache)
+				, m_onBatch(std::move(onBatch))
+				, m_onComplete(std::move(onComplete))
+				, m_future(m_promise.get_future().share())
+			{
+				m_hDone = CreateEventW(NULL, TRUE, FALSE, NULL);
+				nv2::throw_if(m_hDone == NULL, (nv2::acc(LFL) << nv2::s_error(GetLastError())));
+			}
+
+			virtual ~ObjectSink()
+			{
+				CloseHandle(m_hDone);
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			static CComPtr<ObjectSink> Create(const CComPtr<IWbemServices>& pServices,
+											batch_fn onBatch = nullptr,
+											complete_fn onComplete = nullptr,
+											const std::shared_ptr<ClassCache>& pCache = nullptr)
+			{
+				CComPtr<ObjectSink> ret(new ObjectSink(pServices, std::move(onBatch), std::move(onComplete), pCache));
+				HRESULT hr = CoCreateFreeThreadedMarshaler(static_cast<IWbemObjectSink*>(ret.p), &ret->m_pMarshaler);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				return ret;
+			}
+
+			//-----------------------------------------------------------------
+			// stop calling onBatch and onComplete, waiting for one in progress
+			// on another thread. called by ~AsyncCall: WMI may still call
+			// SetStatus after the handle, and whatever the callbacks
+			// captured, have gone
+			void Detach()
+			{
+				std::lock_guard<std::recursive_mutex> guard(m_callbackLock);
+				m_detached = true;
+			}
+
+			//-----------------------------------------------------------------
+			// IUnknown
+			ULONG STDMETHODCALLTYPE AddRef() override
+			{
+				return InterlockedIncrement(&m_ref);
+			}
+
+			ULONG STDMETHODCALLTYPE Release() override
+			{
+				LONG ref = InterlockedDecrement(&m_ref);
+				if (ref == 0)
+					delete this;
+				return ref;
+			}
+
+			HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppv) override
+			{
+				if (ppv == nullptr)
+					return E_POINTER;
+				if (riid == IID_IUnknown || riid == IID_IWbemObjectSink)
+				{
+					*ppv = static_cast<IWbemObjectSink*>(this);
+					AddRef();
+					return S_OK;
+				}
+				if (riid == IID_IMarshal && m_pMarshaler)
+					return m_pMarshaler->QueryInterface(riid, ppv);
+				*ppv = nullptr;
+				return E_NOINTERFACE;
+			}
+
+			//-----------------------------------------------------------------
+			// IWbemObjectSink. never let an exception escape into COM
+			HRESULT STDMETHODCALLTYPE Indicate(long lObjectCount, IWbemClassObject** apObjArray) override
+			{
+				try
+				{
+					std::vector<Object> batch;
+					batch.reserve(lObjectCount);
+					for (long i = 0; i < lObjectCount; i++)
+					{
+						batch.push_back(Object(CComPtr<IWbemClassObject>(apObjArray[i]), m_pServices, m_pCache));
+					}
+					std::lock_guard<std::recursive_mutex> guard(m_callbackLock);
+					if (m_onBatch && !m_detached)
+					{
+						m_onBatch(batch);
+					}
+					else if (!m_onBatch)
+					{
+						std::lock_guard<std::mutex> lock(m_lock);
+						m_results.insert(m_results.end(), batch.begin(), batch.end());
+					}
+				}
+				catch (...)
+				{
+					DBMSG("ObjectSink::Indicate => exception");
+				}
+				return WBEM_S_NO_ERROR;
+			}
+
+			HRESULT STDMETHODCALLTYPE SetStatus(long lFlags, HRESULT hResult, BSTR, IWbemClassObject*) override
+			{
+				if (lFlags != WBEM_STATUS_COMPLETE)
+					return WBEM_S_NO_ERROR;
+				{
+					std::lock_guard<std::mutex> lock(m_lock);
+					if (m_done)
+						return WBEM_S_NO_ERROR;
+					m_done = true;
+					m_status = hResult;
+				}
+				DBMSG("ObjectSink::SetStatus => " << nv2::s_error(uw32::Win32FromHResult(hResult)));
+				try
+				{
+					std::lock_guard<std::recursive_mutex> guard(m_callbackLock);
+					if (m_onComplete && !m_detached)
+						m_onComplete(hResult);
+				}
+				catch (...)
+				{
+					DBMSG("ObjectSink::SetStatus => exception");
+				}
+				m_promise.set_value(hResult);
+				SetEvent(m_hDone);
+				return WBEM_S_NO_ERROR;
+			}
+
+			//-----------------------------------------------------------------
+			std::shared_future<HRESULT> Future() const
+			{
+				return m_future;
+			}
+
+			HANDLE Signal() const
+			{
+				return m_hDone;
+			}
+
+			//-----------------------------------------------------------------
+			bool Done()
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				return m_done;
+			}
+
+			//-----------------------------------------------------------------
+			// take whatever has been accumulated so far
+			std::vector<Object> TakeResults()
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				std::vector<Object> ret;
+				ret.swap(m_results);
+				return ret;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// route sink callbacks through an unsecured apartment so WMI can call
+		// back without the client loosening process wide security.
+		// falls back to the raw sink if that is not available
+		static
+		CComPtr<IWbemObjectSink>
+			MakeSinkStub(IWbemObjectSink* pSink)
+		{
+			CComPtr<IWbemObjectSink> ret;
+			CComPtr<IUnsecuredApartment> pUnsecApp;
+			HRESULT hr = pUnsecApp.CoCreateInstance(CLSID_UnsecuredApartment, NULL, CLSCTX_LOCAL_SERVER);
+			if (hr == S_OK)
+			{
+				CComPtr<IUnknown> pStubUnk;
+				hr = pUnsecApp->CreateObjectStub(pSink, &pStubUnk);
+				if (hr == S_OK)
+					hr = pStubUnk.QueryInterface(&ret);
+			}
+			if (hr != S_OK)
+			{
+				DBMSG("MakeSinkStub: unsecured apartment => " << nv2::s_error(uw32::Win32FromHResult(hr)));
+				ret = pSink;
+			}
+			return ret;
+		}
+
+		//---------------------------------------------------------------------
+		// handle to an outstanding asynchronous call. destroying the handle
+		// before completion cancels the call and detaches the callbacks.
+		// Wait pumps messages, so it also works from STA threads, where
+		// callbacks are delivered through the thread's message queue
+		class AsyncCall
+		{
+			CComPtr<IWbemServices> m_pServices;
+			CComPtr<ObjectSink> m_pSink;
+			// what we actually hand to WMI. may be an unsecured apartment stub
+			CComPtr<IWbemObjectSink> m_pStub;
+			bool m_started = false;
+
+		public:
+
+			//-----------------------------------------------------------------
+			AsyncCall(const CComPtr<IWbemServices>& pServices,
+						ObjectSink::batch_fn onBatch = nullptr,
+						ObjectSink::complete_fn onComplete = nullptr,
+						const std::shared_ptr<ClassCache>& pCache = nullptr)
+				: m_pServices(pServices)
+			{
+				nv2::throw_if(m_pServices == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				m_pSink = ObjectSink::Create(m_pServices, std::move(onBatch), std::move(onComplete), pCache);
+				m_pStub = MakeSinkStub(m_pSink);
+			}
+
+			AsyncCall(const AsyncCall&) = delete;
+			AsyncCall& operator=(const AsyncCall&) = delete;
+
+			~AsyncCall()
+			{
+				// nothing may run once we have gone, including the callbacks
+				// for the SetStatus that the cancel provokes
+				m_pSink->Detach();
+				if (m_started && !m_pSink->Done())
+				{
+					// no throwing from here
+					HRESULT hr = m_pServices->CancelAsyncCall(m_pStub);
+					DBMSG("~AsyncCall: CancelAsyncCall => " << nv2::s_error(uw32::Win32FromHResult(hr)));
+				}
+			}
+
+			//-----------------------------------------------------------------
+			// the sink to pass to IWbemServices::*Async
+			IWbemObjectSink* Sink() const
+			{
+				return m_pStub;
+			}
+
+			//-----------------------------------------------------------------
+			// record the result of the *Async call itself
+			void Started(HRESULT hr)
+			{
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				m_started = true;
+			}
+
+			//-----------------------------------------------------------------
+			// completes with the final status passed to SetStatus
+			std::shared_future<HRESULT> Future() const
+			{
+				return m_pSink->Future();
+			}
+
+			//-----------------------------------------------------------------
+			bool Done() const
+			{
+				return m_pSink->Done();
+			}
+
+			//-----------------------------------------------------------------
+			// wait for completion. returns the final status or WBEM_S_TIMEDOUT.
+			// pumps messages on STA threads, see WaitPumping
+			HRESULT Wait(DWORD timeout = INFINITE) const
+			{
+				if (!WaitPumping(m_pSink->Signal(), timeout))
+					return WBEM_S_TIMEDOUT;
+				return m_pSink->Future().get();
+			}
+
+			//-----------------------------------------------------------------
+			// wait for completion or the deadline, whichever is first. on expiry
+			// the call is cancelled and WBEM_E_TIMED_OUT or WBEM_E_CALL_CANCELLED
+			// returned. whatever arrived before that is still in Results()
+			HRESULT Wait(const Deadline& deadline)
+			{
+				for (;;)
+				{
+					long slice = deadline.Slice();
+					if (WaitPumping(m_pSink->Signal(), slice == WBEM_INFINITE ? 1000 : (DWORD)slice))
+						break;
+					if (deadline.Expired())
+					{
+						if (m_started && !m_pSink->Done())
+						{
+							HRESULT hr = m_pServices->CancelAsyncCall(m_pStub);
+							DBMSG("AsyncCall::Wait: CancelAsyncCall => " << nv2::s_error(uw32::Win32FromHResult(hr)));
+						}
+						return deadline.Status();
+					}
+				}
+				return m_pSink->Future().get();
+			}
+
+			//-----------------------------------------------------------------
+			// objects accumulated so far (when no batch callback was given)
+			std::vector<Object> Results()
+			{
+				return m_pSink->TakeResults();
+			}
+
+			//-----------------------------------------------------------------
+			// request cancellation. SetStatus will still be called
+			void Cancel()
+			{
+				if (!m_started || m_pSink->Done())
+					return;
+				HRESULT hr = m_pServices->CancelAsyncCall(m_pStub);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			}
+		};
+
+		//-----------------------------------------------------------------------------
+		inline
+		std::shared_ptr<AsyncCall>
+			Object::ExecMethodAsync(LPCWSTR lpMethodName,
+				const param_list& iparams,
+				std::function<void(std::vector<Object>&)> onBatch,
+				std::function<void(HRESULT)> onComplete)
+		{
+			return ExecMethodAsync(lpMethodName,
+				MakeInParams(lpMethodName, iparams),
+				std::move(onBatch),
+				std::move(onComplete));
+		}
+
+		//-----------------------------------------------------------------------------
+		inline
+		std::shared_ptr<AsyncCall>
+			Object::ExecMethodAsync(LPCWSTR lpMethodName,
+				IWbemClassObject* pInParamsInstance,
+				std::function<void(std::vector<Object>&)> onBatch,
+				std::function<void(HRESULT)> onComplete)
+		{
+			nv2::throw_if(m_pServices == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+			std::wstring relPath = GetValue(L"__RELPATH");
+
+			auto ret = std::make_shared<AsyncCall>(m_pServices, std::move(onBatch), std::move(onComplete), m_pCache);
+			CallTimer timer(Op::ExecMethodAsync, lpMethodName);
+			HRESULT hR = m_pServices->ExecMethodAsync(CComBSTR(relPath.c_str()),
+				CComBSTR(lpMethodName),
+				0,
+				NULL,
+				pInParamsInstance,
+				ret->Sink());
+			timer.Done(hR);
+			DBMSG("m_pServices->ExecMethodAsync => " << nv2::s_error(uw32::Win32FromHResult(hR)));
+			ret->Started(hR);
+			return ret;
+		}
+
+		//-----------------------------------------------------------------------------
+		// ASSOCIATORS OF {path} WHERE AssocClass = a ResultClass = r Role = x.
+		// empty filters are left out. WQL takes the names unquoted
+		// https://learn.microsoft.com/en-us/windows/win32/wmisdk/associators-of-statement
+		static
+		std::wstring
+			AssociatorsQuery(const std::wstring& path,
+							const std::wstring& resultClass = _W(""),
+							const std::wstring& role = _W(""),
+							const std::wstring& assocClass = _W(""))
+		{
+			std::wstring ret = _W("ASSOCIATORS OF {") + path + _W("}");
+			if (resultClass.empty() && role.empty() && assocClass.empty())
+				return ret;
+			ret += _W(" WHERE");
+			if (!assocClass.empty())
+				ret += _W(" AssocClass = ") + assocClass;
+			if (!resultClass.empty())
+				ret += _W(" ResultClass = ") + resultClass;
+			if (!role.empty())
+				ret += _W(" Role = ") + role;
+			return ret;
+		}
+
+		//-----------------------------------------------------------------------------
+		// REFERENCES OF {path} WHERE ResultClass = r Role = x
+		// https://learn.microsoft.com/en-us/windows/win32/wmisdk/references-of-statement
+		static
+		std::wstring
+			ReferencesQuery(const std::wstring& path,
+							const std::wstring& resultClass = _W(""),
+							const std::wstring& role = _W(""))
+		{
+			std::wstring ret = _W("REFERENCES OF {") + path + _W("}");
+			if (resultClass.empty() && role.empty())
+				return ret;
+			ret += _W(" WHERE");
+			if (!resultClass.empty())
+				ret += _W(" ResultClass = ") + resultClass;
+			if (!role.empty())
+				ret += _W(" Role = ") + role;
+			return ret;
+		}
+
+		//-----------------------------------------------------------------------------
+		// run query against pServices and collect the results
+		static
+		std::vector<Object>
+			QueryObjects(const CComPtr<IWbemServices>& pServices, const std::wstring& query, const std::shared_ptr<ClassCache>& pCache)
+		{
+			nv2::throw_if(pServices == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+			CComPtr<IEnumWbemClassObject> pEnum;
+			CallTimer timer(Op::ExecQuery, query.c_str());
+			HRESULT hR = pServices->ExecQuery(CComBSTR(L"WQL"), CComBSTR(query.c_str()), WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY, NULL, &pEnum);
+			timer.Done(hR);
+			nv2::throw_if(hR != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hR))));
+			hR = CopyBlanket(pServices, pEnum);
+			nv2::throw_if(hR != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hR))));
+
+			std::vector<Object> ret;
+			InstanceStream stream(pEnum, pServices, 64, pCache, query);
+			for (Object obj : stream)
+			{
+				ret.push_back(obj);
+			}
+			return ret;
+		}
+
+		//-----------------------------------------------------------------------------
+		inline
+		std::vector<Object>
+			Object::Associators(const std::wstring& resultClass, const std::wstring& role, const std::wstring& assocClass) const
+		{
+			return QueryObjects(m_pServices, AssociatorsQuery(GetValue(L"__RELPATH"), resultClass, role, assocClass), m_pCache);
+		}
+
+		//-----------------------------------------------------------------------------
+		inline
+		std::vector<Object>
+			Object::References(const std::wstring& resultClass, const std::wstring& role) const
+		{
+			return QueryObjects(m_pServices, ReferencesQuery(GetValue(L"__RELPATH"), resultClass, role), m_pCache);
+		}
+
+		//---------------------------------------------------------------------
+		// outcome of one instance in ExecMethodBatch
+		struct MethodResult
+		{
+			// the instance the method was executed against
+			std::wstring relPath;
+			// failure to start the call or the final status from SetStatus
+			HRESULT status = WBEM_S_NO_ERROR;
+			// ReturnValue from the out-parameters
+			CComVariant returnValue;
+			// all other out-parameters
+			Object::param_map oparams;
+		};
+
+		//---------------------------------------------------------------------
+		// execute lpMethodName against every Object in [first, last), keeping
+		// at most maxInFlight calls outstanding. the in-parameter instance is
+		// built once per class and cloned for each call. results are in input
+		// order. per instance failures are reported in MethodResult::status,
+		// nothing is thrown once the calls have started. once deadline expires
+		// the outstanding calls are cancelled and they, and any not yet
+		// started, get deadline.Status(). waits pump messages, so this may
+		// run on an STA thread
+		template <typename It>
+		std::vector<MethodResult>
+			ExecMethodBatch(It first, It last,
+				LPCWSTR lpMethodName,
+				const Object::param_list& iparams,
+				size_t maxInFlight = 16,
+				const Deadline& deadline = Deadline())
+		{
+			if (maxInFlight == 0)
+				maxInFlight = 1;
+
+			// completions arrive on WMI threads. shared so that a late
+			// SetStatus from a cancelled call never touches a dead frame
+			struct State
+			{
+				std::mutex lock;
+				std::vector<size_t> done;
+				// auto reset, set as each call completes
+				HANDLE hReady = NULL;
+
+				State()
+				{
+					hReady = CreateEventW(NULL, FALSE, FALSE, NULL);
+					nv2::throw_if(hReady == NULL, (nv2::acc(LFL) << nv2::s_error(GetLastError())));
+				}
+
+				~State()
+				{
+					CloseHandle(hReady);
+				}
+			};
+			auto pState = std::make_shared<State>();
+
+			std::vector<Object> objects(first, last);
+			std::vector<MethodResult> ret(objects.size());
+			std::vector<std::shared_ptr<AsyncCall>> calls(objects.size());
+			// in-parameter template per class
+			std::map<std::wstring, CComPtr<IWbemClassObject>> templates;
+
+			size_t next = 0;
+			size_t running = 0;
+			// collect a completed call
+			auto finish = [&](size_t i)
+			{
+				MethodResult& result = ret[i];
+				result.status = calls[i]->Wait();
+				std::vector<Object> out = calls[i]->Results();
+				if (!out.empty())
+					result.returnValue = Object::ReadOutParams(out.front().Interface(), result.oparams);
+				calls[i].reset();
+				running--;
+			};
+			while (next < objects.size() || running)
+			{
+				// nothing more is started once the deadline has gone
+				if (deadline.Expired())
+					break;
+
+				// top up
+				while (running < maxInFlight && next < objects.size())
+				{
+					size_t i = next++;
+					MethodResult& result = ret[i];
+					// the failures we can name are recorded as they happen
+					result.status = WBEM_E_FAILED;
+					try
+					{
+						Object& obj = objects[i];
+						result.relPath = obj.GetValue(L"__RELPATH");
+
+						if (obj.GetSchema()->Method(lpMethodName) == nullptr)
+						{
+							result.status = WBEM_E_METHOD_NOT_IMPLEMENTED;
+							continue;
+						}
+
+						std::wstring className = obj.GetValue(L"__CLASS");
+						auto it = templates.find(className);
+						if (it == templates.end())
+							it = templates.insert(std::make_pair(className, obj.MakeInParams(lpMethodName, iparams))).first;
+
+						CComPtr<IWbemClassObject> pInParamsInstance;
+						if (it->second)
+						{
+							HRESULT hR = it->second->Clone(&pInParamsInstance);
+							if (hR != WBEM_S_NO_ERROR)
+							{
+								result.status = hR;
+								continue;
+							}
+						}
+
+						auto pCall = std::make_shared<AsyncCall>(obj.GetServices(), nullptr,
+							[pState, i](HRESULT)
+							{
+								std::lock_guard<std::mutex> lock(pState->lock);
+								pState->done.push_back(i);
+								SetEvent(pState->hReady);
+							},
+							obj.GetCache());
+						CallTimer timer(Op::ExecMethodAsync, lpMethodName);
+						HRESULT hR = obj.GetServices()->ExecMethodAsync(CComBSTR(result.relPath.c_str()),
+							CComBSTR(lpMethodName),
+							0,
+							NULL,
+							pInParamsInstance,
+							pCall->Sink());
+						timer.Done(hR);
+						if (hR != S_OK)
+						{
+							result.status = hR;
+							continue;
+						}
+						pCall->Started(hR);
+						calls[i] = pCall;
+						result.status = WBEM_S_NO_ERROR;
+						running++;
+					}
+					catch (const DWORD& ex)
+					{
+						DBMSG("ExecMethodBatch: " << result.relPath << " => not started");
+						result.status = HRESULT_FROM_WIN32(ex);
+					}
+					catch (const std::exception& ex)
+					{
+						// no HRESULT to be had, WBEM_E_FAILED stands
+						DBMSG("ExecMethodBatch: " << result.relPath << " => not started: " << ex.what());
+					}
+					catch (...)
+					{
+						DBMSG("ExecMethodBatch: " << result.relPath << " => not started");
+					}
+				}
+				if (!running)
+					break;
+
+				// collect whatever has completed
+				std::vector<size_t> done;
+				for (;;)
+				{
+					{
+						std::lock_guard<std::mutex> lock(pState->lock);
+						done.swap(pState->done);
+					}
+					if (!done.empty() || deadline.Expired())
+						break;
+					long slice = deadline.Slice();
+					WaitPumping(pState->hReady, slice == WBEM_INFINITE ? INFINITE : (DWORD)slice);
+				}
+				for (size_t i : done)
+				{
+					finish(i);
+				}
+			}
+
+			if (deadline.Expired())
+			{
+				// keep what completed in time, then destroying the handles
+				// cancels and detaches the rest
+				std::vector<size_t> done;
+				{
+					std::lock_guard<std::mutex> lock(pState->lock);
+					done.swap(pState->done);
+				}
+				for (size_t i : done)
+				{
+					finish(i);
+				}
+				HRESULT hr = deadline.Status();
+				for (size_t i = 0; i < objects.size(); i++)
+				{
+					if (calls[i])
+					{
+						ret[i].status = hr;
+						calls[i].reset();
+					}
+				}
+				for (size_t i = next; i < objects.size(); i++)
+				{
+					ret[i].status = hr;
+					try
+					{
+						ret[i].relPath = objects[i].GetValue(L"__RELPATH");
+					}
+					catch (...)
+					{
+					}
+				}
+			}
+			return ret;
+		}
+
+		//---------------------------------------------------------------------
+		template <typename T>
+		std::vector<MethodResult>
+			ExecMethodBatch(const T& objects,
+				LPCWSTR lpMethodName,
+				const Object::param_list& iparams,
+				size_t maxInFlight = 16,
+				const Deadline& deadline = Deadline())
+		{
+			return ExecMethodBatch(std::begin(objects), std::end(objects), lpMethodName, iparams, maxInFlight, deadline);
+		}
+
+		//---------------------------------------------------------------------
+		// an empty IWbemContext
+		static
+		CComPtr<IWbemContext>
+			MakeContext()
+		{
+			CComPtr<IWbemContext> ret;
+			HRESULT hr = ret.CoCreateInstance(CLSID_WbemContext, NULL, CLSCTX_INPROC_SERVER);
+			nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			return ret;
+		}
+
+		//---------------------------------------------------------------------
+		// context asking providers for partial instances containing only
+		// properties. providers that do not support it simply ignore it.
+		// null for an empty list: an empty __GET_EXT_PROPERTIES asks for
+		// no properties at all
+		// https://learn.microsoft.com/en-us/windows/win32/wmisdk/improving-enumeration-performance
+		static
+		CComPtr<IWbemContext>
+			MakePartialContext(const std::vector<std::wstring>& properties)
+		{
+			if (properties.empty())
+				return CComPtr<IWbemContext>();
+			CComPtr<IWbemContext> ret = MakeContext();
+
+			SAFEARRAY* psa = SafeArrayCreateVector(VT_BSTR, 0, (ULONG)properties.size());
+			nv2::throw_if(psa == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_OUTOFMEMORY))));
+			// owns psa from here on
+			CComVariant vProps;
+			vProps.vt = VT_ARRAY | VT_BSTR;
+			vProps.parray = psa;
+			for (LONG i = 0; i < (LONG)properties.size(); i++)
+			{
+				CComBSTR name(properties[i].c_str());
+				HRESULT hr = SafeArrayPutElement(psa, &i, (BSTR)name);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			}
+
+			CComVariant vTrue(true);
+			HRESULT hr = ret->SetValue(L"__GET_EXTENSIONS", 0, &vTrue);
+			nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			hr = ret->SetValue(L"__GET_EXT_CLIENT_REQUEST", 0, &vTrue);
+			nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			hr = ret->SetValue(L"__GET_EXT_PROPERTIES", 0, &vProps);
+			nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			return ret;
+		}
+
+		//---------------------------------------------------------------------
+		// SELECT a,b,c FROM className. an empty list selects *
+		static
+		std::wstring
+			SelectQuery(const std::wstring& className, const std::vector<std::wstring>& properties)
+		{
+			std::wstring ret = _W("SELECT ");
+			if (properties.empty())
+			{
+				ret += _W("*");
+			}
+			for (size_t i = 0; i < properties.size(); i++)
+			{
+				if (i)
+					ret += _W(",");
+				ret += properties[i];
+			}
+			ret += _W(" FROM ");
+			ret += className;
+			return ret;
+		}
+
+		//---------------------------------------------------------------------
+		// value as a quoted WQL string literal. backslashes and quotes are
+		// escaped, so an arbitrary value cannot end the literal early
+		static
+		std::wstring
+			WqlString(std::wstring_view value)
+		{
+			std::wstring ret;
+			ret.reserve(value.size() + 2);
+			ret += _W("'");
+			for (wchar_t c : value)
+			{
+				if (c == L'\\' || c == L'\'' || c == L'"')
+					ret += L'\\';
+				ret += c;
+			}
+			ret += _W("'");
+			return ret;
+		}
+
+		//---------------------------------------------------------------------
+		// value matched literally by LIKE: % _ [ are wrapped in [], i.e.
+		// WqlString(WqlLikeLiteral(L"50%") + L"%") is '50[%]%'
+		static
+		std::wstring
+			WqlLikeLiteral(std::wstring_view value)
+		{
+			std::wstring ret;
+			ret.reserve(value.size());
+			for (wchar_t c : value)
+			{
+				if (c == L'%' || c == L'_' || c == L'[')
+				{
+					ret += L'[';
+					ret += c;
+					ret += L']';
+				}
+				else
+				{
+					ret += c;
+				}
+			}
+			return ret;
+		}
+
+		//---------------------------------------------------------------------
+		// a typed literal in both the forms WMI takes: wql for queries
+		// (strings in single quotes) and path for object paths (strings in
+		// double quotes). see WqlString
+		struct WqlValue
+		{
+			std::wstring wql;
+			std::wstring path;
+
+			WqlValue(std::wstring_view value)
+				: wql(WqlString(value))
+			{
+				path.reserve(value.size() + 2);
+				path += L'"';
+				for (wchar_t c : value)
+				{
+					if (c == L'\\' || c == L'"')
+						path += L'\\';
+					path += c;
+				}
+				path += L'"';
+			}
+
+			WqlValue(LPCWSTR value)
+				: WqlValue(std::wstring_view(value ? value : _W("")))
+			{
+			}
+
+			WqlValue(const std::wstring& value)
+				: WqlValue(std::wstring_view(value))
+			{
+			}
+
+			WqlValue(bool value)
+				: wql(value ? _W("TRUE") : _W("FALSE"))
+				, path(wql)
+			{
+			}
+
+			// WQL has no literal for NaN or infinity. throws ERROR_INVALID_PARAMETER
+			WqlValue(double value)
+			{
+				nv2::throw_if(!std::isfinite(value), (nv2::acc(LFL) << nv2::s_error(ERROR_INVALID_PARAMETER)));
+				wchar_t buffer[32];
+				swprintf_s(buffer, _W("%.17g"), value);
+				wql = path = buffer;
+			}
+
+			template <typename T, typename = typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
+			WqlValue(T value)
+				: wql(std::to_wstring(value))
+				, path(wql)
+			{
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// A WQL WHERE clause built from typed comparisons, so values are
+		// always escaped. Combine with && || and !, i.e.
+		// Where::Eq(L"DriveType", 3) && Where::Gt(L"FreeSpace", 1ull << 30)
+		// A clause that is only ANDed equalities also remembers them, which
+		// lets Services::Find turn a lookup by key into a direct GetObject
+		class Where
+		{
+			std::wstring m_text;
+			// property => path literal, while only ANDed Eq's
+			std::vector<std::pair<std::wstring, std::wstring>> m_equals;
+			bool m_equalities = true;
+			// a single comparison, no parentheses needed
+			bool m_atomic = true;
+
+			//-----------------------------------------------------------------
+			explicit Where(const std::wstring& text, bool equalities = false)
+				: m_text(text)
+				, m_equalities(equalities)
+			{
+			}
+
+			std::wstring Operand() const
+			{
+				return m_atomic ? m_text : _W("(") + m_text + _W(")");
+			}
+
+			static Where Compare(const std::wstring& property, LPCWSTR op, const WqlValue& value)
+			{
+				return Where(property + _W(" ") + op + _W(" ") + value.wql);
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			// matches everything
+			Where() {}
+
+			//-----------------------------------------------------------------
+			static Where Eq(const std::wstring& property, const WqlValue& value)
+			{
+				Where ret(property + _W(" = ") + value.wql, true);
+				ret.m_equals.push_back(std::make_pair(property, value.path));
+				return ret;
+			}
+
+			static Where Ne(const std::wstring& property, const WqlValue& value)
+			{
+				return Compare(property, _W("<>"), value);
+			}
+
+			static Where Lt(const std::wstring& property, const WqlValue& value)
+			{
+				return Compare(property, _W("<"), value);
+			}
+
+			static Where Le(const std::wstring& property, const WqlValue& value)
+			{
+				return Compare(property, _W("<="), value);
+			}
+
+			static Where Gt(const std::wstring& property, const WqlValue& value)
+			{
+				return Compare(property, _W(">"), value);
+			}
+
+			static Where Ge(const std::wstring& property, const WqlValue& value)
+			{
+				return Compare(property, _W(">="), value);
+			}
+
+			//-----------------------------------------------------------------
+			// pattern keeps its wildcards. see WqlLikeLiteral to match literally
+			static Where Like(const std::wstring& property, std::wstring_view pattern)
+			{
+				return Where(property + _W(" LIKE ") + WqlString(pattern));
+			}
+
+			static Where IsNull(const std::wstring& property)
+			{
+				return Where(property + _W(" IS NULL"));
+			}
+
+			static Where NotNull(const std::wstring& property)
+			{
+				return Where(property + _W(" IS NOT NULL"));
+			}
+
+			//-----------------------------------------------------------------
+			// ISA, for embedded objects, i.e. TargetInstance ISA 'Win32_Process'
+			static Where Isa(const std::wstring& property, const std::wstring& className)
+			{
+				return Where(property + _W(" ISA ") + WqlString(className));
+			}
+
+			//-----------------------------------------------------------------
+			Where operator&&(const Where& other) const
+			{
+				if (Empty())
+					return other;
+				if (other.Empty())
+					return *this;
+				Where ret(Operand() + _W(" AND ") + other.Operand(), m_equalities && other.m_equalities);
+				ret.m_atomic = false;
+				if (ret.m_equalities)
+				{
+					ret.m_equals = m_equals;
+					ret.m_equals.insert(ret.m_equals.end(), other.m_equals.begin(), other.m_equals.end());
+				}
+				return ret;
+			}
+
+			Where operator||(const Where& other) const
+			{
+				if (Empty() || other.Empty())
+					return Where();
+				Where ret(Operand() + _W(" OR ") + other.Operand());
+				ret.m_atomic = false;
+				return ret;
+			}
+
+			Where operator!() const
+			{
+				nv2::throw_if(Empty(), (nv2::acc(LFL) << nv2::s_error(ERROR_INVALID_PARAMETER)));
+				return Where(_W("NOT (") + m_text + _W(")"));
+			}
+
+			//-----------------------------------------------------------------
+			bool Empty() const
+			{
+				return m_text.empty();
+			}
+
+			// without the WHERE
+			const std::wstring& Text() const
+			{
+				return m_text;
+			}
+
+			//-----------------------------------------------------------------
+			// property => object path literal, if the clause is nothing but
+			// ANDed equalities. empty otherwise
+			const std::vector<std::pair<std::wstring, std::wstring>>& Equalities() const
+			{
+				static const std::vector<std::pair<std::wstring, std::wstring>> none;
+				return m_equalities ? m_equals : none;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// A WQL query built once and executed many times. The query text
+		// may contain ? placeholders (outside of string literals) which are
+		// bound to escaped WQL literals. The BSTRs are rebuilt only when a
+		// binding changes, and the context (i.e. a partial instance context
+		// from Select) is created once and reused by every execution.
+		// Execute with Services::Enumerate or Services::GetInstances.
+		// not thread safe: one per thread, or bind and execute under a lock
+		class PreparedQuery
+		{
+			// the text between placeholders. always one more than m_params
+			std::vector<std::wstring> m_fragments;
+			std::vector<std::wstring> m_params;
+			CComBSTR m_language;
+			CComBSTR m_query;
+			std::wstring m_text;
+			CComPtr<IWbemContext> m_pCtx;
+			long m_flags = WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY;
+			bool m_dirty = true;
+
+			//-----------------------------------------------------------------
+			void Set(size_t index, std::wstring literal)
+			{
+				nv2::throw_if(index >= m_params.size(), (nv2::acc(LFL) << nv2::s_error(ERROR_INVALID_INDEX)));
+				if (m_params[index] != literal)
+				{
+					m_params[index] = std::move(literal);
+					m_dirty = true;
+				}
+			}
+
+			//-----------------------------------------------------------------
+			void Render()
+			{
+				if (!m_dirty)
+					return;
+				m_text.clear();
+				for (size_t i = 0; i < m_params.size(); i++)
+				{
+					m_text += m_fragments[i];
+					m_text += m_params[i];
+				}
+				m_text += m_fragments.back();
+				m_query = m_text.c_str();
+				m_dirty = false;
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			// unbound placeholders execute as NULL
+			explicit PreparedQuery(const std::wstring& query, const CComPtr<IWbemContext>& pCtx = nullptr)
+				: m_language(_W("WQL"))
+				, m_pCtx(pCtx)
+			{
+				m_fragments.push_back(std::wstring());
+				wchar_t quote = 0;
+				for (size_t i = 0; i < query.size(); i++)
+				{
+					wchar_t c = query[i];
+					if (quote)
+					{
+						m_fragments.back() += c;
+						if (c == L'\\' && i + 1 < query.size())
+							m_fragments.back() += query[++i];
+						else if (c == quote)
+							quote = 0;
+					}
+					else if (c == L'?')
+					{
+						m_params.push_back(_W("NULL"));
+						m_fragments.push_back(std::wstring());
+					}
+					else
+					{
+						if (c == L'\'' || c == L'"')
+							quote = c;
+						m_fragments.back() += c;
+					}
+				}
+			}
+
+			//-----------------------------------------------------------------
+			// SELECT properties FROM className [WHERE where], with a partial
+			// instance context so only the named properties are marshalled
+			static
+			PreparedQuery
+				Select(const std::wstring& className,
+						const std::vector<std::wstring>& properties,
+						const std::wstring& where = _W(""))
+			{
+				std::wstring query = SelectQuery(className, properties);
+				if (!where.empty())
+				{
+					query += _W(" WHERE ");
+					query += where;
+				}
+				return PreparedQuery(query, properties.empty() ? nullptr : MakePartialContext(properties));
+			}
+
+			//-----------------------------------------------------------------
+			// number of ? placeholders
+			size_t Parameters() const
+			{
+				return m_params.size();
+			}
+
+			//-----------------------------------------------------------------
+			// bind placeholder index (0 based) to a value. strings are quoted
+			// and escaped, see WqlString
+			PreparedQuery& Bind(size_t index, std::wstring_view value)
+			{
+				Set(index, WqlString(value));
+				return *this;
+			}
+
+			PreparedQuery& Bind(size_t index, LPCWSTR value)
+			{
+				if (value == nullptr)
+					return BindNull(index);
+				return Bind(index, std::wstring_view(value));
+			}
+
+			PreparedQuery& Bind(size_t index, const std::wstring& value)
+			{
+				return Bind(index, std::wstring_view(value));
+			}
+
+			PreparedQuery& Bind(size_t index, bool value)
+			{
+				Set(index, WqlValue(value).wql);
+				return *this;
+			}
+
+			PreparedQuery& Bind(size_t index, double value)
+			{
+				Set(index, WqlValue(value).wql);
+				return *this;
+			}
+
+			template <typename T, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+			PreparedQuery& Bind(size_t index, T value)
+			{
+				Set(index, WqlValue(value).wql);
+				return *this;
+			}
+
+			//-----------------------------------------------------------------
+			// a LIKE pattern. value is matched literally, pattern supplies the
+			// wildcards around it, i.e. BindLike(0, name, L"%", L"%") for contains
+			PreparedQuery& BindLike(size_t index, std::wstring_view value, LPCWSTR prefix = _W(""), LPCWSTR suffix = _W("%"))
+			{
+				Set(index, WqlString(prefix + WqlLikeLiteral(value) + suffix));
+				return *this;
+			}
+
+			PreparedQuery& BindNull(size_t index)
+			{
+				Set(index, _W("NULL"));
+				return *this;
+			}
+
+			//-----------------------------------------------------------------
+			// IWbemServices::ExecQuery flags
+			PreparedQuery& Flags(long flags)
+			{
+				m_flags = flags;
+				return *this;
+			}
+
+			long Flags() const
+			{
+				return m_flags;
+			}
+
+			//-----------------------------------------------------------------
+			// the query as it will be sent
+			const std::wstring& Text()
+			{
+				Render();
+				return m_text;
+			}
+
+			//-----------------------------------------------------------------
+			// for ExecQuery/ExecQueryAsync
+			BSTR Language() const
+			{
+				return m_language;
+			}
+
+			BSTR Query()
+			{
+				Render();
+				return m_query;
+			}
+
+			IWbemContext* Context() const
+			{
+				return m_pCtx;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// credentials for remote connections. user may be DOMAIN\user or
+		// user@domain. authority is passed to ConnectServer, i.e.
+		// ntlmdomain:DOMAIN or kerberos:DOMAIN\server. all empty => the
+		// identity of the calling thread
+		struct Credentials
+		{
+			std::wstring user;
+			std::wstring password;
+			std::wstring authority;
+		};
+
+		//---------------------------------------------------------------------
+		// COAUTHIDENTITY built from Credentials. holds the strings it points to
+		class AuthIdentity
+		{
+			std::wstring m_user;
+			std::wstring m_domain;
+			std::wstring m_password;
+			COAUTHIDENTITY m_identity = {};
+
+		public:
+
+			explicit AuthIdentity(const Credentials& creds)
+				: m_user(creds.user)
+				, m_password(creds.password)
+			{
+				// DOMAIN\user => split. user@domain is passed through as is
+				size_t pos = m_user.find(L'\\');
+				if (pos != std::wstring::npos)
+				{
+					m_domain = m_user.substr(0, pos);
+					m_user = m_user.substr(pos + 1);
+				}
+				m_identity.User = (unsigned short*)&m_user[0];
+				m_identity.UserLength = (ULONG)m_user.size();
+				m_identity.Domain = (unsigned short*)(m_domain.empty() ? nullptr : &m_domain[0]);
+				m_identity.DomainLength = (ULONG)m_domain.size();
+				m_identity.Password = (unsigned short*)&m_password[0];
+				m_identity.PasswordLength = (ULONG)m_password.size();
+				m_identity.Flags = SEC_WINNT_AUTH_IDENTITY_UNICODE;
+			}
+
+			AuthIdentity(const AuthIdentity&) = delete;
+			AuthIdentity& operator=(const AuthIdentity&) = delete;
+
+			~AuthIdentity()
+			{
+				// do not leave the password lying around
+				std::fill(m_password.begin(), m_password.end(), L'\0');
+			}
+
+			COAUTHIDENTITY* Get()
+			{
+				return &m_identity;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		static
+		bool
+			IsLocalHost(const std::wstring& host)
+		{
+			return host.empty() || host == _W(".") || _wcsicmp(host.c_str(), _W("localhost")) == 0;
+		}
+
+		//---------------------------------------------------------------------
+		// Multi producer, single consumer queue (Vyukov). Producers never
+		// block on each other or on the consumer: a push is one allocation
+		// and one atomic exchange. Only one thread may pop.
+		template <typename T>
+		class MpscQueue
+		{
+			struct Node
+			{
+				std::atomic<Node*> next{ nullptr };
+				T value;
+
+				Node() {}
+				explicit Node(T v) : value(std::move(v)) {}
+			};
+
+			// producers push at the head, the consumer pops from the tail.
+			// the tail is always a stub whose value has been consumed
+			std::atomic<Node*> m_head;
+			Node* m_tail = nullptr;
+			std::atomic<std::ptrdiff_t> m_size{ 0 };
+
+		public:
+
+			MpscQueue()
+			{
+				m_tail = new Node();
+				m_head.store(m_tail);
+			}
+
+			MpscQueue(const MpscQueue&) = delete;
+			MpscQueue& operator=(const MpscQueue&) = delete;
+
+			~MpscQueue()
+			{
+				T value;
+				while (Pop(value))
+				{
+				}
+				delete m_tail;
+			}
+
+			//-----------------------------------------------------------------
+			// any thread
+			void Push(T value)
+			{
+				Node* node = new Node(std::move(value));
+				Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+				prev->next.store(node, std::memory_order_release);
+				m_size.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			//-----------------------------------------------------------------
+			// consumer thread only. false if empty (or a push is mid flight)
+			bool Pop(T& value)
+			{
+				Node* tail = m_tail;
+				Node* next = tail->next.load(std::memory_order_acquire);
+				if (next == nullptr)
+					return false;
+				value = std::move(next->value);
+				next->value = T();
+				m_tail = next;
+				delete tail;
+				m_size.fetch_sub(1, std::memory_order_relaxed);
+				return true;
+			}
+
+			//-----------------------------------------------------------------
+			// consumer thread only. appends up to max items, returns the count
+			size_t PopBatch(std::vector<T>& values, size_t max)
+			{
+				size_t ret = 0;
+				T value;
+				while (ret < max && Pop(value))
+				{
+					values.push_back(std::move(value));
+					ret++;
+				}
+				return ret;
+			}
+
+			//-----------------------------------------------------------------
+			// approximate
+			size_t Size() const
+			{
+				std::ptrdiff_t ret = m_size.load(std::memory_order_relaxed);
+				return (ret > 0 ? (size_t)ret : 0);
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// kinds of event a Subscription may deliver
+		enum class EventKind
+		{
+			Creation,		// __InstanceCreationEvent
+			Deletion,		// __InstanceDeletionEvent
+			Modification,	// __InstanceModificationEvent
+			Extrinsic		// anything else, i.e. Win32_VolumeChangeEvent
+		};
+
+		//---------------------------------------------------------------------
+		static
+		LPCWSTR
+			EventClass(EventKind kind)
+		{
+			switch (kind)
+			{
+			case EventKind::Creation:
+				return _W("__InstanceCreationEvent");
+			case EventKind::Deletion:
+				return _W("__InstanceDeletionEvent");
+			case EventKind::Modification:
+				return _W("__InstanceModificationEvent");
+			default:
+				break;
+			}
+			return _W("__ExtrinsicEvent");
+		}
+
+		//---------------------------------------------------------------------
+		// SELECT * FROM __InstanceCreationEvent WITHIN 1 WHERE TargetInstance ISA 'Win32_Process'
+		// where, if given, is ANDed on, i.e. L"TargetInstance.Name = 'notepad.exe'"
+		// intrinsic events only: extrinsic events have no TargetInstance and
+		// take no WITHIN, so subscribe to their class with a plain query
+		static
+		std::wstring
+			InstanceEventQuery(EventKind kind,
+								const std::wstring& className,
+								unsigned within = 1,
+								const std::wstring& where = _W(""))
+		{
+			nv2::throw_if(kind == EventKind::Extrinsic, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_INVALID_PARAMETER))));
+			std::wstring ret = _W("SELECT * FROM ");
+			ret += EventClass(kind);
+			ret += _W(" WITHIN ");
+			ret += std::to_wstring(within);
+			ret += _W(" WHERE TargetInstance ISA ");
+			ret += WqlString(className);
+			if (!where.empty())
+			{
+				ret += _W(" AND ");
+				ret += where;
+			}
+			return ret;
+		}
+
+		//---------------------------------------------------------------------
+		static
+		EventKind
+			GetEventKind(const Object& event)
+		{
+			std::wstring className = event.GetValue(_W("__CLASS"));
+			for (EventKind kind : { EventKind::Creation, EventKind::Deletion, EventKind::Modification })
+			{
+				if (className == EventClass(kind) || event.Interface()->InheritsFrom(EventClass(kind)) == WBEM_S_NO_ERROR)
+					return kind;
+			}
+			return EventKind::Extrinsic;
+		}
+
+		//---------------------------------------------------------------------
+		// sink for ExecNotificationQueryAsync. Indicate only queues the event
+		// objects and signals the consumer, so WMI's thread never waits on
+		// whatever the consumer is doing
+		class EventSink : public IWbemObjectSink
+		{
+			LONG m_ref = 0;
+			MpscQueue<CComPtr<IWbemClassObject>> m_queue;
+			// auto reset. signalled on each Indicate and on completion
+			HANDLE m_hEvent = NULL;
+			std::atomic<bool> m_done{ false };
+			std::atomic<HRESULT> m_status{ WBEM_S_NO_ERROR };
+
+			EventSink()
+			{
+				m_hEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+				nv2::throw_if(m_hEvent == NULL, (nv2::acc(LFL) << nv2::s_error(GetLastError())));
+			}
+
+			virtual ~EventSink()
+			{
+				CloseHandle(m_hEvent);
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			static CComPtr<EventSink> Create()
+			{
+				return CComPtr<EventSink>(new EventSink());
+			}
+
+			//-----------------------------------------------------------------
+			// IUnknown
+			ULONG STDMETHODCALLTYPE AddRef() override
+			{
+				return InterlockedIncrement(&m_ref);
+			}
+
+			ULONG STDMETHODCALLTYPE Release() override
+			{
+				LONG ref = InterlockedDecrement(&m_ref);
+				if (ref == 0)
+					delete this;
+				return ref;
+			}
+
+			HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppv) override
+			{
+				if (ppv == nullptr)
+					return E_POINTER;
+				if (riid == IID_IUnknown || riid == IID_IWbemObjectSink)
+				{
+					*ppv = static_cast<IWbemObjectSink*>(this);
+					AddRef();
+					return S_OK;
+				}
+				*ppv = nullptr;
+				return E_NOINTERFACE;
+			}
+
+			//-----------------------------------------------------------------
+			// IWbemObjectSink
+			HRESULT STDMETHODCALLTYPE Indicate(long lObjectCount, IWbemClassObject** apObjArray) override
+			{
+				try
+				{
+					for (long i = 0; i < lObjectCount; i++)
+					{
+						m_queue.Push(CComPtr<IWbemClassObject>(apObjArray[i]));
+					}
+					SetEvent(m_hEvent);
+				}
+				catch (...)
+				{
+					DBMSG("EventSink::Indicate => exception");
+				}
+				return WBEM_S_NO_ERROR;
+			}
+
+			HRESULT STDMETHODCALLTYPE SetStatus(long lFlags, HRESULT hResult, BSTR, IWbemClassObject*) override
+			{
+				if (lFlags == WBEM_STATUS_COMPLETE)
+				{
+					// subscriptions only complete on error or cancellation
+					DBMSG("EventSink::SetStatus => " << nv2::s_error(uw32::Win32FromHResult(hResult)));
+					m_status = hResult;
+					m_done = true;
+					SetEvent(m_hEvent);
+				}
+				return WBEM_S_NO_ERROR;
+			}
+
+			//-----------------------------------------------------------------
+			// consumer side
+			MpscQueue<CComPtr<IWbemClassObject>>& Queue()
+			{
+				return m_queue;
+			}
+
+			HANDLE Signal() const
+			{
+				return m_hEvent;
+			}
+
+			bool Done() const
+			{
+				return m_done;
+			}
+
+			HRESULT Status() const
+			{
+				return m_status;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// a live event subscription. events are queued as they arrive and
+		// collected in batches by a single consumer thread via Dequeue.
+		// destroying the subscription cancels it. Dequeue pumps messages
+		// while it waits, so the consumer may be an STA thread
+		class Subscription
+		{
+			CComPtr<IWbemServices> m_pServices;
+			std::shared_ptr<ClassCache> m_pCache;
+			CComPtr<EventSink> m_pSink;
+			CComPtr<IWbemObjectSink> m_pStub;
+			bool m_started = false;
+			// reused between Dequeue calls
+			std::vector<CComPtr<IWbemClassObject>> m_batch;
+
+		public:
+
+			//-----------------------------------------------------------------
+			Subscription(const CComPtr<IWbemServices>& pServices, const std::shared_ptr<ClassCache>& pCache = nullptr)
+				: m_pServices(pServices)
+				, m_pCache(pCache)
+			{
+				nv2::throw_if(m_pServices == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+				m_pSink = EventSink::Create();
+				m_pStub = MakeSinkStub(m_pSink);
+			}
+
+			Subscription(const Subscription&) = delete;
+			Subscription& operator=(const Subscription&) = delete;
+
+			~Subscription()
+			{
+				if (m_started && !m_pSink->Done())
+				{
+					HRESULT hr = m_pServices->CancelAsyncCall(m_pStub);
+					DBMSG("~Subscription: CancelAsyncCall => " << nv2::s_error(uw32::Win32FromHResult(hr)));
+				}
+			}
+
+			//-----------------------------------------------------------------
+			// the sink to pass to ExecNotificationQueryAsync
+			IWbemObjectSink* Sink() const
+			{
+				return m_pStub;
+			}
+
+			//-----------------------------------------------------------------
+			void Started(HRESULT hr)
+			{
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				m_started = true;
+			}
+
+			//-----------------------------------------------------------------
+			// append up to max queued events to events, waiting up to timeout
+			// ms for the first one. returns the number appended. consumer
+			// thread only
+			size_t Dequeue(std::vector<Object>& events, size_t max = 256, DWORD timeout = INFINITE)
+			{
+				for (;;)
+				{
+					m_batch.clear();
+					size_t count = m_pSink->Queue().PopBatch(m_batch, max);
+					if (count)
+					{
+						events.reserve(events.size() + count);
+						for (auto& p : m_batch)
+						{
+							events.push_back(Object(p, m_pServices, m_pCache));
+						}
+						m_batch.clear();
+						return count;
+					}
+					if (m_pSink->Done() || timeout == 0)
+						return 0;
+					if (!WaitPumping(m_pSink->Signal(), timeout))
+						return 0;
+				}
+			}
+
+			//-----------------------------------------------------------------
+			// events waiting to be dequeued (approximate)
+			size_t Pending() const
+			{
+				return m_pSink->Queue().Size();
+			}
+
+			//-----------------------------------------------------------------
+			// true once WMI has ended the subscription. see Status()
+			bool Done() const
+			{
+				return m_pSink->Done();
+			}
+
+			HRESULT Status() const
+			{
+				return m_pSink->Status();
+			}
+
+			//-----------------------------------------------------------------
+			void Cancel()
+			{
+				if (!m_started || m_pSink->Done())
+					return;
+				HRESULT hr = m_pServices->CancelAsyncCall(m_pStub);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// Opt in cache of query results for classes that rarely change, i.e.
+		// Win32_OperatingSystem or Win32_BIOS. A class is only cached once it
+		// has a TTL (see SetTTL/SetDefaultTTL). Keyed by connection path and
+		// query (which includes the projection). Lookups take a shared lock,
+		// so concurrent readers do not contend; writers are the misses.
+		// Cached objects are shared, so use them from MTA threads. see
+		// Services::EnableResultCache and ResultInvalidator
+		class ResultCache
+		{
+		public:
+
+			using clock = std::chrono::steady_clock;
+			using objects_t = std::shared_ptr<const std::vector<Object>>;
+
+		private:
+
+			struct Entry
+			{
+				objects_t objects;
+				clock::time_point expires;
+				// lower case, for Invalidate
+				std::wstring className;
+			};
+
+			mutable std::shared_mutex m_lock;
+			std::unordered_map<std::wstring, Entry> m_entries;
+			std::map<std::wstring, std::chrono::milliseconds> m_ttls;
+			std::chrono::milliseconds m_defaultTTL{ 0 };
+			std::atomic<uint64_t> m_hits{ 0 };
+			std::atomic<uint64_t> m_misses{ 0 };
+
+			//-----------------------------------------------------------------
+			static std::wstring Lower(const std::wstring& value)
+			{
+				std::wstring ret = value;
+				for (auto& c : ret)
+					c = towlower(c);
+				return ret;
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			// results for className are kept for ttl. 0 => not cached
+			void SetTTL(const std::wstring& className, std::chrono::milliseconds ttl)
+			{
+				std::unique_lock<std::shared_mutex> guard(m_lock);
+				m_ttls[Lower(className)] = ttl;
+			}
+
+			//-----------------------------------------------------------------
+			// for classes without their own TTL. 0 (the default) => not cached
+			void SetDefaultTTL(std::chrono::milliseconds ttl)
+			{
+				std::unique_lock<std::shared_mutex> guard(m_lock);
+				m_defaultTTL = ttl;
+			}
+
+			//-----------------------------------------------------------------
+			std::chrono::milliseconds TTL(const std::wstring& className) const
+			{
+				std::shared_lock<std::shared_mutex> guard(m_lock);
+				auto it = m_ttls.find(Lower(className));
+				return (it == m_ttls.end() ? m_defaultTTL : it->second);
+			}
+
+			//-----------------------------------------------------------------
+			// null if absent or expired
+			objects_t Find(const std::wstring& key) const
+			{
+				{
+					std::shared_lock<std::shared_mutex> guard(m_lock);
+					auto it = m_entries.find(key);
+					if (it != m_entries.end() && it->second.expires > clock::now())
+					{
+						m_hits++;
+						return it->second.objects;
+					}
+				}
+				m_misses++;
+				return nullptr;
+			}
+
+			//-----------------------------------------------------------------
+			// no-op if className has no TTL
+			void Put(const std::wstring& key, const std::wstring& className, const objects_t& objects)
+			{
+				std::chrono::milliseconds ttl = TTL(className);
+				if (ttl.count() <= 0)
+					return;
+				Entry entry;
+				entry.objects = objects;
+				entry.expires = clock::now() + ttl;
+				entry.className = Lower(className);
+				std::unique_lock<std::shared_mutex> guard(m_lock);
+				m_entries[key] = std::move(entry);
+			}
+
+			//-----------------------------------------------------------------
+			// drop every result for className. returns the number dropped
+			size_t Invalidate(const std::wstring& className)
+			{
+				std::wstring lower = Lower(className);
+				size_t ret = 0;
+				std::unique_lock<std::shared_mutex> guard(m_lock);
+				for (auto it = m_entries.begin(); it != m_entries.end();)
+				{
+					if (it->second.className == lower)
+					{
+						it = m_entries.erase(it);
+						ret++;
+					}
+					else
+					{
+						++it;
+					}
+				}
+				return ret;
+			}
+
+			//-----------------------------------------------------------------
+			// drop expired entries. they are otherwise only replaced
+			void Prune()
+			{
+				clock::time_point now = clock::now();
+				std::unique_lock<std::shared_mutex> guard(m_lock);
+				for (auto it = m_entries.begin(); it != m_entries.end();)
+				{
+					if (it->second.expires <= now)
+						it = m_entries.erase(it);
+					else
+						++it;
+				}
+			}
+
+			//-----------------------------------------------------------------
+			void Clear()
+			{
+				std::unique_lock<std::shared_mutex> guard(m_lock);
+				m_entries.clear();
+			}
+
+			//-----------------------------------------------------------------
+			size_t Size() const
+			{
+				std::shared_lock<std::shared_mutex> guard(m_lock);
+				return m_entries.size();
+			}
+
+			uint64_t Hits() const
+			{
+				return m_hits;
+			}
+
+			uint64_t Misses() const
+			{
+				return m_misses;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// an object path without its server and namespace, i.e.
+		// Win32_LogicalDisk.DeviceID="C:" for
+		// \\host\ROOT\CIMV2:Win32_LogicalDisk.DeviceID="C:". key values may
+		// contain ':' so only a colon ahead of the first key value ends the
+		// prefix. namespaces may contain '.', i.e. ROOT\Microsoft.Windows
+		static
+		std::wstring_view
+			PathRelative(std::wstring_view path)
+		{
+			size_t colon = path.find(L':');
+			if (colon == std::wstring_view::npos)
+				return path;
+			bool server = (path.size() > 1 && (path[0] == L'\\' || path[0] == L'/') && path[1] == path[0]);
+			if (server || colon < path.find_first_of(_W("=\"")))
+				return path.substr(colon + 1);
+			return path;
+		}
+
+		//---------------------------------------------------------------------
+		// the class part of an object path, i.e. Win32_LogicalDisk
+		static
+		std::wstring
+			PathClass(const std::wstring& path)
+		{
+			std::wstring_view rel = PathRelative(path);
+			return std::wstring(rel.substr(0, rel.find_first_of(_W(".="))));
+		}
+
+		//---------------------------------------------------------------------
+		// relative path, lower case. matches an object's __RELPATH with the
+		// references to it held by association instances
+		static
+		std::wstring
+			PathKey(const std::wstring& path)
+		{
+			std::wstring ret(PathRelative(path));
+			for (auto& c : ret)
+				c = towlower(c);
+			return ret;
+		}
+
+		//---------------------------------------------------------------------
+		// what a call with a Deadline collected before it returned. status
+		// is WBEM_S_NO_ERROR if complete, otherwise WBEM_E_TIMED_OUT or
+		// WBEM_E_CALL_CANCELLED and objects holds the partial results
+		struct QueryResult
+		{
+			std::vector<Object> objects;
+			HRESULT status = WBEM_S_NO_ERROR;
+
+			bool Complete() const
+			{
+				return status == WBEM_S_NO_ERROR;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// CoInitializeSecurity succeeds at most once per process, so every
+		// connection comes through here. a failure, i.e. COM not initialized
+		// on the calling thread, is not remembered: the next caller retries
+		inline
+		HRESULT
+			InitializeSecurity()
+		{
+			static std::mutex lock;
+			static bool done = false;
+			std::lock_guard<std::mutex> guard(lock);
+			if (done)
+				return S_OK;
+			HRESULT hResult = CoInitializeSecurity(NULL,
+				-1,                          // COM authentication
+				NULL,                        // Authentication services
+				NULL,                        // Reserved
+				RPC_C_AUTHN_LEVEL_DEFAULT,   // Default authentication 
+				RPC_C_IMP_LEVEL_IMPERSONATE, // Default Impersonation  
+				NULL,                        // Authentication info
+				EOAC_NONE,                   // Additional capabilities 
+				NULL                         // Reserved
+			);
+			// RPC_E_TOO_LATE => the host process (or another library) already
+			// initialized security. nothing we can change, so carry on
+			if (hResult != S_OK && hResult != RPC_E_TOO_LATE)
+				return hResult;
+			done = true;
+			return S_OK;
+		}
+
+		class ConnectionManager;
+
+		//---------------------------------------------------------------------
+		// Represents a root WMI Services object
+		class Services
+		{
+		private:
+
+			CComPtr<IWbemServices> m_pService;
+			// class definitions shared by all objects we hand out
+			std::shared_ptr<ClassCache> m_pCache;
+			// explicit credentials. must outlive every proxy they are set on
+			std::shared_ptr<AuthIdentity> m_pAuth;
+			bool m_remote = false;
+			// as passed to ConnectServer, i.e. \\host\ROOT\CIMV2
+			std::wstring m_path;
+			// null unless EnableResultCache
+			std::shared_ptr<ResultCache> m_pResults;
+
+			//-----------------------------------------------------------------
+			// ResultCache key. enumerations pass their query text, GetObject
+			// an object path prefixed "get|", so a class object and the
+			// instance list of the same class never share an entry
+			std::wstring ResultKey(const std::wstring& query) const
+			{
+				return m_path + _W("|") + query;
+			}
+
+			//-----------------------------------------------------------------
+			// apply the blanket matching our credentials to a proxy. see
+			// https://learn.microsoft.com/en-us/windows/win32/wmisdk/setting-the-security-on-iwbemservices-and-other-proxies
+			static
+			HRESULT
+				SetBlanket(IUnknown* pProxy, const std::shared_ptr<AuthIdentity>& pAuth, bool remote)
+			{
+				if (!remote)
+				{
+					return CoSetProxyBlanket(pProxy, RPC_C_AUTHN_WINNT, RPC_C_AUTHZ_NONE, NULL, RPC_C_AUTHN_LEVEL_CALL, RPC_C_IMP_LEVEL_IMPERSONATE, NULL, EOAC_NONE);
+				}
+				return CoSetProxyBlanket(pProxy, 
+					RPC_C_AUTHN_DEFAULT, 
+					RPC_C_AUTHZ_DEFAULT, 
+					COLE_DEFAULT_PRINCIPAL, 
+					RPC_C_AUTHN_LEVEL_PKT_PRIVACY, 
+					RPC_C_IMP_LEVEL_IMPERSONATE, 
+					pAuth ? pAuth->Get() : NULL,
+					EOAC_NONE);
+			}
+
+			//-----------------------------------------------------------------
+			void Connect(const std::wstring& host, const std::wstring& ns, const Credentials& creds)
+			{
+				HRESULT hResult = InitializeSecurity();
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+
+				CComPtr<IWbemLocator> pLocator;
+				hResult = pLocator.CoCreateInstance(CLSID_WbemLocator);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+
+				Connect(pLocator, host, ns, creds);
+			}
+
+			//-----------------------------------------------------------------
+			void Connect(IWbemLocator* pLocator, const std::wstring& host, const std::wstring& ns, const Credentials& creds)
+			{
+				// WMI refuses credentials for local connections
+				m_remote = !IsLocalHost(host);
+				std::wstring path = ns;
+				if (m_remote)
+				{
+					path = _W("\\\\") + host + _W("\\") + ns;
+					if (!creds.user.empty())
+						m_pAuth = std::make_shared<AuthIdentity>(creds);
+				}
+				CComBSTR user(m_pAuth ? creds.user.c_str() : NULL);
+				CComBSTR password(m_pAuth ? creds.password.c_str() : NULL);
+				CComBSTR authority((m_remote && !creds.authority.empty()) ? creds.authority.c_str() : NULL);
+				// bound connection setup to ~2 minutes rather than hanging on dead hosts
+				long lFlags = (m_remote ? WBEM_FLAG_CONNECT_USE_MAX_WAIT : 0);
+
+				CallTimer timer(Op::Connect, path.c_str());
+				HRESULT hResult = pLocator->ConnectServer(CComBSTR(path.c_str()), user, password, NULL, lFlags, authority, NULL, &m_pService);
+				timer.Done(hResult);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+
+				hResult = SetBlanket(m_pService, m_pAuth, m_remote);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+
+				m_path = path;
+				m_pCache = std::make_shared<ClassCache>(m_pService);
+			}
+
+			//-----------------------------------------------------------------
+			// local namespace via an existing locator. see ConnectionManager
+			Services(IWbemLocator* pLocator, const std::wstring& ns)
+			{
+				Connect(pLocator, _W(""), ns, Credentials());
+			}
+
+			friend class ConnectionManager;
+
+		public:
+
+			//-----------------------------------------------------------------
+			Services(LPCWSTR lpResourcePath = L"ROOT\\CIMV2")
+			{
+				Connect(_W(""), lpResourcePath, Credentials());
+			}
+
+			//-----------------------------------------------------------------
+			// a handle on the process wide connection to local namespace ns,
+			// made on first use. see ConnectionManager
+			static Services Shared(const std::wstring& ns = L"ROOT\\CIMV2");
+
+			//-----------------------------------------------------------------
+			// namespace ns on a (possibly remote) host. empty credentials use
+			// the identity of the caller. i.e.
+			// Services srv(L"server01", L"ROOT\\CIMV2", { L"DOMAIN\\user", L"secret" });
+			Services(const std::wstring& host, const std::wstring& ns, const Credentials& creds = Credentials())
+			{
+				Connect(host, ns, creds);
+			}
+
+			//-----------------------------------------------------------------
+			// apply our security blanket to a proxy obtained from this
+			// connection. only needed for remote explicit credential connections
+			HRESULT Secure(IUnknown* pProxy) const
+			{
+				if (!m_pAuth)
+					return S_OK;
+				return SetBlanket(pProxy, m_pAuth, m_remote);
+			}
+
+			//-----------------------------------------------------------------
+			bool Remote() const
+			{
+				return m_remote;
+			}
+
+			//-----------------------------------------------------------------
+			// cheap round trip to test the connection. i.e. after a failure
+			HRESULT Ping() const
+			{
+				if (m_pService == NULL)
+					return E_POINTER;
+				CComPtr<IWbemClassObject> pObj;
+				return m_pService->GetObject(CComBSTR(L"__NAMESPACE"), 0, NULL, &pObj, NULL);
+			}
+
+			//---------------------------------------------------------------------
+			// Tests WMIServices for validity
+			bool Valid() const
+			{
+				return m_pService != NULL;
+			}
+
+			//---------------------------------------------------------------------
+			// the underlying service pointer. needed by the refresher et al.
+			const CComPtr<IWbemServices>& Interface() const
+			{
+				return m_pService;
+			}
+
+			//---------------------------------------------------------------------
+			// the class definition cache shared by objects from this Services
+			const std::shared_ptr<ClassCache>& Cache() const
+			{
+				return m_pCache;
+			}
+
+			//---------------------------------------------------------------------
+			// the namespace path connected to
+			const std::wstring& Path() const
+			{
+				return m_path;
+			}
+
+			//---------------------------------------------------------------------
+			// serve GetInstances and GetObject from pResults for the classes
+			// it has a TTL for. may be shared between connections, entries
+			// are per Path(). null turns caching off again
+			void EnableResultCache(const std::shared_ptr<ResultCache>& pResults = std::make_shared<ResultCache>())
+			{
+				m_pResults = pResults;
+			}
+
+			const std::shared_ptr<ResultCache>& Results() const
+			{
+				return m_pResults;
+			}
+
+			//-----------------------------------------------------------------------------
+			// Lazily enumerate all instances of a class. Objects are fetched
+			// batchSize at a time as the stream is consumed.
+			InstanceStream
+				Enumerate(LPCWSTR lpClassName, ULONG batchSize = 64, IWbemContext* pCtx = NULL) const
+			{
+				long Flags = WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY;
+
+				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				CComPtr<IEnumWbemClassObject> pEnum;
+				CallTimer timer(Op::CreateInstanceEnum, lpClassName);
+				HRESULT hResult = m_pService->CreateInstanceEnum(CComBSTR(lpClassName), Flags, pCtx, &pEnum);
+				timer.Done(hResult);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+				hResult = Secure(pEnum);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+
+				return InstanceStream(pEnum, m_pService, batchSize, m_pCache, lpClassName);
+			}
+
+			//-----------------------------------------------------------------------------
+			InstanceStream
+				Enumerate(const std::wstring& className, ULONG batchSize = 64) const
+			{
+				return Enumerate(className.c_str(), batchSize);
+			}
+
+			//-----------------------------------------------------------------------------
+			// Lazily enumerate the results of a WQL query
+			InstanceStream
+				EnumerateQuery(LPCWSTR lpQuery, ULONG batchSize = 64, IWbemContext* pCtx = NULL) const
+			{
+				long Flags = WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY;
+
+				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				CComPtr<IEnumWbemClassObject> pEnum;
+				CallTimer timer(Op::ExecQuery, lpQuery);
+				HRESULT hResult = m_pService->ExecQuery(CComBSTR(L"WQL"), CComBSTR(lpQuery), Flags, pCtx, &pEnum);
+				timer.Done(hResult);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+				hResult = Secure(pEnum);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+
+				return InstanceStream(pEnum, m_pService, batchSize, m_pCache, lpQuery);
+			}
+
+			//-----------------------------------------------------------------------------
+			InstanceStream
+				EnumerateQuery(const std::wstring& query, ULONG batchSize = 64) const
+			{
+				return EnumerateQuery(query.c_str(), batchSize);
+			}
+
+			//-----------------------------------------------------------------------------
+			// Lazily enumerate a projection of a class. only the named properties
+			// (plus system properties) are returned. include the key properties
+			// if __RELPATH is needed, i.e. for ExecMethod
+			InstanceStream
+				Enumerate(const std::wstring& className, 
+							const std::vector<std::wstring>& properties,
+							ULONG batchSize = 64) const
+			{
+				CComPtr<IWbemContext> pCtx = MakePartialContext(properties);
+				return EnumerateQuery(SelectQuery(className, properties).c_str(), batchSize, pCtx);
+			}
+
+			//-----------------------------------------------------------------------------
+			// Lazily enumerate a prepared query with its current bindings
+			InstanceStream
+				Enumerate(PreparedQuery& query, ULONG batchSize = 64) const
+			{
+				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				BSTR bstrQuery = query.Query();
+				CComPtr<IEnumWbemClassObject> pEnum;
+				CallTimer timer(Op::ExecQuery, bstrQuery);
+				HRESULT hResult = m_pService->ExecQuery(query.Language(), bstrQuery, query.Flags(), query.Context(), &pEnum);
+				timer.Done(hResult);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+				hResult = Secure(pEnum);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+
+				return InstanceStream(pEnum, m_pService, batchSize, m_pCache, query.Text());
+			}
+
+			//-----------------------------------------------------------------------------
+			// Asynchronous CreateInstanceEnum. batches are delivered to onBatch
+			// or accumulated in the returned AsyncCall
+			std::shared_ptr<AsyncCall>
+				GetInstancesAsync(LPCWSTR lpClassName,
+					ObjectSink::batch_fn onBatch = nullptr,
+					ObjectSink::complete_fn onComplete = nullptr) const
 			{
-				nv2::throw_if(m_pServices == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
-				nv2::throw_if(m_pObj == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
-				
-				CComPtr<IWbemClassObject> pClassDefinition;
-				std::wstring className = GetValue(L"__CLASS");
-				HRESULT hR = m_pServices->GetObject(CComBSTR(className.c_str()), 0, NULL, &pClassDefinition, NULL);
-				nv2::throw_if(hR != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hR))));
+				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				auto ret = std::make_shared<AsyncCall>(m_pService, std::move(onBatch), std::move(onComplete), m_pCache);
+				HRESULT hResult = m_pService->CreateInstanceEnumAsync(CComBSTR(lpClassName), 0, NULL, ret->Sink());
+				ret->Started(hResult);
+				return ret;
+			}
 
-				CComPtr<IWbemClassObject> pInParamsClass;
-				hR = pClassDefinition->GetMethod(lpMethodName, 0, &pInParamsClass, NULL);
+			//-----------------------------------------------------------------------------
+			// Asynchronous WQL query
+			std::shared_ptr<AsyncCall>
+				ExecQueryAsync(LPCWSTR lpQuery,
+					ObjectSink::batch_fn onBatch = nullptr,
+					ObjectSink::complete_fn onComplete = nullptr) const
+			{
+				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
 
-				//if (pInParamsClass) {
-				CComPtr<IWbemClassObject> pInParamsInstance;
-				hR = pInParamsClass->SpawnInstance(0, &pInParamsInstance);
-				// check hR
-				DBMSG("pInParamsClass->SpawnInstance => " << nv2::s_error(uw32::Win32FromHResult(hR)));
-				//
-				for (auto& iparam : iparams)
+				auto ret = std::make_shared<AsyncCall>(m_pService, std::move(onBatch), std::move(onComplete), m_pCache);
+				HRESULT hResult = m_pService->ExecQueryAsync(CComBSTR(L"WQL"), CComBSTR(lpQuery), 0, NULL, ret->Sink());
+				ret->Started(hResult);
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// Asynchronous prepared query. the flags of query are not used:
+			// async calls are always forward only
+			std::shared_ptr<AsyncCall>
+				ExecQueryAsync(PreparedQuery& query,
+					ObjectSink::batch_fn onBatch = nullptr,
+					ObjectSink::complete_fn onComplete = nullptr) const
+			{
+				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				auto ret = std::make_shared<AsyncCall>(m_pService, std::move(onBatch), std::move(onComplete), m_pCache);
+				HRESULT hResult = m_pService->ExecQueryAsync(query.Language(), query.Query(), 0, query.Context(), ret->Sink());
+				ret->Started(hResult);
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// Subscribe to events. any notification query, intrinsic or extrinsic, i.e.
+			// SELECT * FROM Win32_VolumeChangeEvent
+			std::unique_ptr<Subscription>
+				Subscribe(const std::wstring& query) const
+			{
+				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				std::unique_ptr<Subscription> ret(new Subscription(m_pService, m_pCache));
+				HRESULT hResult = m_pService->ExecNotificationQueryAsync(CComBSTR(L"WQL"), CComBSTR(query.c_str()), 0, NULL, ret->Sink());
+				ret->Started(hResult);
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// Subscribe to creation/deletion/modification of instances of className,
+			// polled every within seconds. see InstanceEventQuery
+			std::unique_ptr<Subscription>
+				Subscribe(EventKind kind, const std::wstring& className, unsigned within = 1, const std::wstring& where = _W("")) const
+			{
+				return Subscribe(InstanceEventQuery(kind, className, within, where));
+			}
+
+			//-----------------------------------------------------------------------------
+			// Returns a set of all instances of a given object.
+			std::vector<Object>
+				GetInstances(LPCWSTR lpClassName) const
+			{
+				std::wstring key;
+				if (m_pResults)
 				{
-					hR = pInParamsInstance->Put(iparam.first.c_str(), 
-												0, 
-													&const_cast<CComVariant&>(iparam.second), 
-												iparam.second.vt);
-					// check hR
-					DBMSG(iparam.first << " => " << nv2::s_error(uw32::Win32FromHResult(hR))); 
+					key = ResultKey(SelectQuery(lpClassName, {}));
+					if (ResultCache::objects_t pCached = m_pResults->Find(key))
+						return *pCached;
+				}
+				std::vector<Object> ret;
+				InstanceStream stream = Enumerate(lpClassName);
+				for (Object obj : stream)
+				{
+					ret.push_back(obj);
 				}
+				if (m_pResults)
+					m_pResults->Put(key, lpClassName, std::make_shared<const std::vector<Object>>(ret));
+				return ret;
+			}
 
-				// synchronous call	
-				long lFlags = 0;
-				IWbemContext* pCtx = NULL;
-				CComPtr<IWbemClassObject> pOutParamsInstance;
+			//-----------------------------------------------------------------------------
+			std::vector<Object>
+				GetInstances(const std::wstring& className) const
+			{
+				return GetInstances(className.c_str());
+			}
 
-				// https://learn.microsoft.com/en-us/windows/win32/wmisdk/describing-a-class-object-path
-				std::wstring relPath = GetValue(L"__RELPATH");
-				hR = m_pServices->ExecMethod(CComBSTR(relPath.c_str()), 
-					CComBSTR(lpMethodName), 
-					lFlags,		// synchronous
-					pCtx,	// 
-					pInParamsInstance, 
-					&pOutParamsInstance, 
-					NULL);
-				DBMSG("m_pServices->ExecMethod => " << nv2::s_error(uw32::Win32FromHResult(hR)));
+			//-----------------------------------------------------------------------------
+			// Returns all instances with only the named properties populated
+			std::vector<Object>
+				GetInstances(const std::wstring& className, const std::vector<std::wstring>& properties) const
+			{
+				std::wstring key;
+				if (m_pResults)
+				{
+					key = ResultKey(SelectQuery(className, properties));
+					if (ResultCache::objects_t pCached = m_pResults->Find(key))
+						return *pCached;
+				}
+				std::vector<Object> ret;
+				InstanceStream stream = Enumerate(className, properties);
+				for (Object obj : stream)
+				{
+					ret.push_back(obj);
+				}
+				if (m_pResults)
+					m_pResults->Put(key, className, std::make_shared<const std::vector<Object>>(ret));
+				return ret;
+			}
 
-				CComVariant ret;
-				// always get the return value
-				if (pOutParamsInstance) 
+			//-----------------------------------------------------------------------------
+			// Returns every result of a prepared query
+			std::vector<Object>
+				GetInstances(PreparedQuery& query) const
+			{
+				std::vector<Object> ret;
+				InstanceStream stream = Enumerate(query);
+				for (Object obj : stream)
 				{
-					// there is always a return value
-					hR = pOutParamsInstance->Get(_W("ReturnValue"), 0, &ret, NULL, NULL);
-					DBMSG("pOutParamsInstance->Get => " << nv2::s_error(uw32::Win32FromHResult(hR)));
+					ret.push_back(obj);
+				}
+				return ret;
+			}
 
-					hR = pOutParamsInstance->BeginEnumeration(WBEM_FLAG_NONSYSTEM_ONLY);
-					DBMSG("pOutParamsInstance->BeginEnumeration => " << nv2::s_error(uw32::Win32FromHResult(hR)));
-					for (;;)
-					{
-						CComBSTR name;
-						CComVariant val;
-						// name.AssignBSTR(NULL);
-						hR = pOutParamsInstance->Next(0, &name, &val, NULL, NULL);
-						if (!name)
-							break;
-						if (name == _W("ReturnValue"))	
-							continue;
-						// otherwise map it
-						oparams[std::wstring(name)] = val;
-					}
-					hR = pOutParamsInstance->EndEnumeration();
-					DBMSG("pOutParamsInstance->EndEnumeration => " << nv2::s_error(uw32::Win32FromHResult(hR)));
+			//-----------------------------------------------------------------------------
+			// drain stream until it ends or deadline expires
+			static
+			QueryResult
+				Collect(InstanceStream& stream, const Deadline& deadline)
+			{
+				QueryResult ret;
+				stream.SetDeadline(deadline);
+				for (Object obj : stream)
+				{
+					ret.objects.push_back(obj);
 				}
-				//
+				ret.status = stream.Status();
 				return ret;
 			}
-		};	// WMIObject
 
-		//---------------------------------------------------------------------
-		// Represents a root WMI Services object
-		class Services
-		{
-		private:
+			//-----------------------------------------------------------------------------
+			// GetInstances, bounded. a slow provider returns what it produced
+			// before the deadline, see QueryResult
+			QueryResult
+				GetInstances(LPCWSTR lpClassName, const Deadline& deadline) const
+			{
+				InstanceStream stream = Enumerate(lpClassName);
+				return Collect(stream, deadline);
+			}
 
-			CComPtr<IWbemServices> m_pService;
+			//-----------------------------------------------------------------------------
+			QueryResult
+				GetInstances(const std::wstring& className, const std::vector<std::wstring>& properties, const Deadline& deadline) const
+			{
+				InstanceStream stream = Enumerate(className, properties);
+				return Collect(stream, deadline);
+			}
 
-		public:
+			//-----------------------------------------------------------------------------
+			QueryResult
+				GetInstances(PreparedQuery& query, const Deadline& deadline) const
+			{
+				InstanceStream stream = Enumerate(query);
+				return Collect(stream, deadline);
+			}
 
-			//-----------------------------------------------------------------
-			Services(LPCWSTR lpResourcePath = L"ROOT\\CIMV2") throw()
+			//-----------------------------------------------------------------------------
+			// Returns a WMI Object representing a given WMI object, or a class
+			Object 
+			GetObject(LPCWSTR lpObjectName)
 			{
-				HRESULT hResult = CoInitializeSecurity(NULL,
-					-1,                          // COM authentication
-					NULL,                        // Authentication services
-					NULL,                        // Reserved
-					RPC_C_AUTHN_LEVEL_DEFAULT,   // Default authentication 
-					RPC_C_IMP_LEVEL_IMPERSONATE, // Default Impersonation  
-					NULL,                        // Authentication info
-					EOAC_NONE,                   // Additional capabilities 
-					NULL                         // Reserved
-				);
+				int Flags = 0;
+				IWbemContext* pCtx = NULL;
+				//
+				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
 
-				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+				std::wstring key;
+				if (m_pResults)
+				{
+					key = ResultKey(_W("get|") + std::wstring(lpObjectName));
+					ResultCache::objects_t pCached = m_pResults->Find(key);
+					if (pCached && !pCached->empty())
+						return pCached->front();
+				}
 
-				CComPtr<IWbemLocator> pLocator;
-				hResult = pLocator.CoCreateInstance(CLSID_WbemLocator);
+				CComPtr<IWbemClassObject> pObj;
+
+				CallTimer timer(Op::GetObject, lpObjectName);
+				HRESULT hResult = m_pService->GetObject(CComBSTR(lpObjectName), Flags, pCtx, &pObj, NULL);
+				timer.Done(hResult);
 				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
 
-				hResult = pLocator->ConnectServer(CComBSTR(lpResourcePath), NULL, NULL, NULL, 0, NULL, NULL, &m_pService);
+				Object ret(pObj, m_pService, m_pCache);
+				if (m_pResults)
+					m_pResults->Put(key, PathClass(lpObjectName), std::make_shared<const std::vector<Object>>(1, ret));
+				return ret;
+			}		
+
+			//-----------------------------------------------------------------------------
+			//
+			Object
+				GetObject(const std::wstring& objectName)
+			{
+				Object ret = GetObject(objectName.c_str());
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// GetObject, semi-synchronously. throws WBEM_E_TIMED_OUT (or
+			// WBEM_E_CALL_CANCELLED) if deadline expires first
+			Object
+				GetObject(const std::wstring& objectName, const Deadline& deadline)
+			{
+				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				CComPtr<IWbemCallResult> pResult;
+				CComPtr<IWbemClassObject> pObj;
+				CallTimer timer(Op::GetObject, objectName.c_str());
+				HRESULT hResult = m_pService->GetObject(CComBSTR(objectName.c_str()), WBEM_FLAG_RETURN_IMMEDIATELY, NULL, NULL, &pResult);
+				if (hResult == WBEM_S_NO_ERROR)
+					hResult = Secure(pResult);
+				if (hResult == WBEM_S_NO_ERROR)
+					hResult = WaitResult(pResult, deadline, &pObj);
+				timer.Done(hResult);
 				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
 
-				hResult = CoSetProxyBlanket(m_pService, RPC_C_AUTHN_WINNT, RPC_C_AUTHZ_NONE, NULL, RPC_C_AUTHN_LEVEL_CALL, RPC_C_IMP_LEVEL_IMPERSONATE, NULL, EOAC_NONE);
+				return Object(pObj, m_pService, m_pCache);
+			}
+
+			//-----------------------------------------------------------------------------
+			// partial instance fetch. see MakePartialContext
+			Object
+				GetObject(const std::wstring& objectName, const std::vector<std::wstring>& properties)
+			{
+				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				CComPtr<IWbemContext> pCtx = MakePartialContext(properties);
+				CComPtr<IWbemClassObject> pObj;
+				CallTimer timer(Op::GetObject, objectName.c_str());
+				HRESULT hResult = m_pService->GetObject(CComBSTR(objectName.c_str()), 0, pCtx, &pObj, NULL);
+				timer.Done(hResult);
 				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
-			
+
+				return Object(pObj, m_pService, m_pCache);
+			}
+
+			//-----------------------------------------------------------------------------
+			// the object path for className when where pins every one of its
+			// key properties, i.e. Win32_LogicalDisk.DeviceID="G:". empty if
+			// it does not (or the class has no keys)
+			std::wstring
+				KeyPath(const std::wstring& className, const Where& where) const
+			{
+				const auto& equals = where.Equalities();
+				if (equals.empty())
+					return std::wstring();
+				std::vector<std::wstring> keys = m_pCache->Get(className)->Keys();
+				if (keys.size() != equals.size())
+					return std::wstring();
+				std::wstring ret = className;
+				for (size_t i = 0; i < keys.size(); i++)
+				{
+					auto it = std::find_if(equals.begin(), equals.end(),
+						[&](const std::pair<std::wstring, std::wstring>& eq) { return _wcsicmp(eq.first.c_str(), keys[i].c_str()) == 0; });
+					if (it == equals.end())
+						return std::wstring();
+					ret += (i ? _W(",") : _W("."));
+					ret += keys[i];
+					ret += _W("=");
+					ret += it->second;
+				}
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// instances of className matching where, filtered by the provider
+			// rather than here. a lookup by key (see KeyPath) is a single
+			// GetObject of that instance instead of a query
+			std::vector<Object>
+				Find(const std::wstring& className,
+						const Where& where,
+						const std::vector<std::wstring>& properties = std::vector<std::wstring>()) const
+			{
+				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				std::vector<Object> ret;
+				CComPtr<IWbemContext> pCtx = (properties.empty() ? nullptr : MakePartialContext(properties));
+				std::wstring path = KeyPath(className, where);
+				if (!path.empty())
+				{
+					CComPtr<IWbemClassObject> pObj;
+					CallTimer timer(Op::GetObject, path.c_str());
+					HRESULT hResult = m_pService->GetObject(CComBSTR(path.c_str()), 0, pCtx, &pObj, NULL);
+					timer.Done(hResult);
+					if (hResult == WBEM_E_NOT_FOUND)
+						return ret;
+					nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+					ret.push_back(Object(pObj, m_pService, m_pCache));
+					return ret;
+				}
+
+				std::wstring query = SelectQuery(className, properties);
+				if (!where.Empty())
+				{
+					query += _W(" WHERE ");
+					query += where.Text();
+				}
+				InstanceStream stream = EnumerateQuery(query.c_str(), 64, pCtx);
+				for (Object obj : stream)
+				{
+					ret.push_back(obj);
+				}
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// objects associated with the object at path. see AssociatorsQuery
+			std::vector<Object>
+				Associators(const std::wstring& path,
+							const std::wstring& resultClass = _W(""),
+							const std::wstring& role = _W(""),
+							const std::wstring& assocClass = _W("")) const
+			{
+				std::vector<Object> ret;
+				InstanceStream stream = EnumerateQuery(AssociatorsQuery(path, resultClass, role, assocClass));
+				for (Object obj : stream)
+				{
+					ret.push_back(obj);
+				}
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// association instances referring to the object at path
+			std::vector<Object>
+				References(const std::wstring& path,
+							const std::wstring& resultClass = _W(""),
+							const std::wstring& role = _W("")) const
+			{
+				std::vector<Object> ret;
+				InstanceStream stream = EnumerateQuery(ReferencesQuery(path, resultClass, role));
+				for (Object obj : stream)
+				{
+					ret.push_back(obj);
+				}
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// References for many sources in one query: enumerates assocClass
+			// once and joins on sourceRole client side. keyed by PathKey of
+			// each source's __RELPATH; every source has an entry, maybe empty
+			std::unordered_map<std::wstring, std::vector<Object>>
+				ReferencesBatch(const std::vector<Object>& sources,
+								const std::wstring& assocClass,
+								const std::wstring& sourceRole) const
+			{
+				std::unordered_map<std::wstring, std::vector<Object>> ret;
+				for (auto& source : sources)
+				{
+					ret[PathKey(source.GetValue(_W("__RELPATH")))];
+				}
+				if (ret.empty())
+					return ret;
+				InstanceStream stream = Enumerate(assocClass, 256);
+				for (Object assoc : stream)
+				{
+					auto it = ret.find(PathKey(assoc.GetValue(sourceRole)));
+					if (it != ret.end())
+						it->second.push_back(assoc);
+				}
+				return ret;
+			}
+
+			//-----------------------------------------------------------------------------
+			// Associators for many sources with a bounded number of queries
+			// instead of one per source: assocClass is enumerated once (just
+			// its two references), then each class found at resultRole (or
+			// resultClass if given) once, and the two are joined in hash maps.
+			// i.e. disks to partitions:
+			// AssociatorsBatch(disks, L"Win32_DiskDriveToDiskPartition", L"Antecedent", L"Dependent")
+			// keyed as ReferencesBatch
+			std::unordered_map<std::wstring, std::vector<Object>>
+				AssociatorsBatch(const std::vector<Object>& sources,
+								const std::wstring& assocClass,
+								const std::wstring& sourceRole,
+								const std::wstring& resultRole,
+								const std::wstring& resultClass = _W("")) const
+			{
+				std::unordered_map<std::wstring, std::vector<Object>> ret;
+				// source key => result keys
+				std::unordered_map<std::wstring, std::vector<std::wstring>> links;
+				for (auto& source : sources)
+				{
+					std::wstring key = PathKey(source.GetValue(_W("__RELPATH")));
+					ret[key];
+					links[key];
+				}
+				if (ret.empty())
+					return ret;
+
+				std::set<std::wstring> classes;
+				InstanceStream assocs = Enumerate(assocClass, { sourceRole, resultRole }, 256);
+				for (Object assoc : assocs)
+				{
+					auto it = links.find(PathKey(assoc.GetValue(sourceRole)));
+					if (it == links.end())
+						continue;
+					std::wstring target = assoc.GetValue(resultRole);
+					it->second.push_back(PathKey(target));
+					classes.insert(resultClass.empty() ? PathClass(target) : resultClass);
+				}
+
+				std::unordered_map<std::wstring, Object> results;
+				for (auto& className : classes)
+				{
+					InstanceStream stream = Enumerate(className, 256);
+					for (Object obj : stream)
+					{
+						results.emplace(PathKey(obj.GetValue(_W("__RELPATH"))), obj);
+					}
+				}
+
+				for (auto& link : links)
+				{
+					std::vector<Object>& objects = ret[link.first];
+					for (auto& target : link.second)
+					{
+						auto it = results.find(target);
+						if (it != results.end())
+							objects.push_back(it->second);
+					}
+				}
+				return ret;
 			}
 
-			//---------------------------------------------------------------------
-			// Tests WMIServices for validity
-			bool Valid() const
+			//-----------------------------------------------------------------------------
+			// every class in the namespace, optionally LIKE filter. the filter
+			// is a LIKE pattern (i.e. Win32_%) but is escaped as a literal so
+			// a quote cannot break out of it
+			static
+			std::wstring
+				MetaClassQuery(const std::wstring& filter)
 			{
-				return m_pService != NULL;
+				std::wstring query = _W("SELECT * FROM meta_class");
+				if (!filter.empty()) {
+					query += _W(" where __CLASS LIKE ");
+					query += WqlString(filter);
+				}
+				return query;
 			}
 
 			//-----------------------------------------------------------------------------
-			// Returns a set of all instances of a given object.
+			// the class objects themselves. meta_class returns them in full,
+			// so this saves a GetObject per class over GetClassNames
 			std::vector<Object>
-				GetInstances(LPCWSTR lpClassName) const
+				GetClasses(const std::wstring& filter = _W(""), ULONG batchSize = 64) const
 			{
-				int Flags = 0;
-				IWbemContext* pCtx = NULL;
-
-				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
-
-				CComPtr<IEnumWbemClassObject> pEnum;
-				HRESULT hResult = m_pService->CreateInstanceEnum(CComBSTR(lpClassName), Flags, pCtx, &pEnum);
-				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
-
 				std::vector<Object> ret;
-				// ObjectCollection(pEnum, m_pService);
-				while (pEnum)
+				InstanceStream stream = EnumerateQuery(MetaClassQuery(filter).c_str(), batchSize);
+				for (Object obj : stream)
 				{
-					ULONG returned = 0;
-					CComPtr<IWbemClassObject> pObject;
-					hResult = pEnum->Next(0, 1, &pObject, &returned);
-					if (returned == 0)
-						break;
-					nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
-					//
-					Object obj(pObject, m_pService);
-					//
 					ret.push_back(obj);
 				}
 				return ret;
 			}
 
 			//-----------------------------------------------------------------------------
-			std::vector<Object>
-				GetInstances(const std::wstring& className) const
-			{
-				return GetInstances(className.c_str());
-			}
-
-			//-----------------------------------------------------------------------------
-			// Returns a WMI Object representing a given WMI object, or a class
-			Object 
-			GetObject(LPCWSTR lpObjectName)
+			// GetClasses, then parse each class (properties, qualifiers and
+			// methods) on up to threads MTA workers (0 => one per core). the
+			// schemas also seed Cache(). no further round trips are made
+			std::vector<std::shared_ptr<const ClassSchema>>
+				GetSchemas(const std::wstring& filter = _W(""), unsigned threads = 0) const
 			{
-				int Flags = 0;
-				IWbemContext* pCtx = NULL;
-				//
-				nv2::throw_if(m_pService == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
-
-				CComPtr<IWbemClassObject> pObj;
+				std::vector<Object> classes = GetClasses(filter);
+				std::vector<std::shared_ptr<const ClassSchema>> ret(classes.size());
 
-				HRESULT hResult = m_pService->GetObject(CComBSTR(lpObjectName), Flags, pCtx, &pObj, NULL);
-				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
-					
-				return Object(pObj, m_pService);
-			}		
+				std::atomic<size_t> next{ 0 };
+				std::mutex lock;
+				std::exception_ptr error;
+				// keep the first failure and stop everyone
+				auto fail = [&]()
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					if (!error)
+						error = std::current_exception();
+					next = classes.size();
+				};
+				auto work = [&]()
+				{
+					for (size_t i = next++; i < classes.size(); i = next++)
+					{
+						std::wstring className = classes[i].GetValue(_W("__CLASS"));
+						ret[i] = m_pCache->Put(MakeClassSchema(classes[i].Interface(), className));
+					}
+				};
 
-			//-----------------------------------------------------------------------------
-			//
-			Object
-				GetObject(const std::wstring& objectName)
-			{
-				Object ret = GetObject(objectName.c_str());
+				if (threads == 0)
+					threads = (std::max)(1u, std::thread::hardware_concurrency());
+				threads = (unsigned)std::min<size_t>(threads, classes.size());
+				if (threads <= 1)
+				{
+					work();
+				}
+				else
+				{
+					// class objects are in-process and free threaded. workers
+					// only read them, each one its own objects
+					std::vector<std::thread> workers;
+					for (unsigned t = 0; t < threads; t++)
+					{
+						workers.emplace_back([&]()
+						{
+							try
+							{
+								ComInit ci(COINIT_MULTITHREADED);
+								work();
+							}
+							catch (...)
+							{
+								fail();
+							}
+						});
+					}
+					for (auto& worker : workers)
+					{
+						worker.join();
+					}
+				}
+				if (error)
+					std::rethrow_exception(error);
 				return ret;
 			}
 
 			//-----------------------------------------------------------------------------
-			// enumerate all class names in this namespace
+			// enumerate all class names in this namespace. if deadline expires
+			// the names so far are returned and *pStatus set (see QueryResult),
+			// or, with no pStatus, WBEM_E_TIMED_OUT/WBEM_E_CALL_CANCELLED thrown
 			std::set<std::wstring> 
-				GetClassNames(const std::wstring& filter = _W(""))
+				GetClassNames(const std::wstring& filter = _W(""), const Deadline& deadline = Deadline(), HRESULT* pStatus = nullptr)
 			{
 				//
-				std::wstring query = _W("SELECT * FROM meta_class");
-				if (!filter.empty()) {
-					query += _W(" where __CLASS LIKE ");
-					query += _W("'");
-					query += filter;
-					query += _W("'");
-				}
+				std::wstring query = MetaClassQuery(filter);
 				std::set<std::wstring> ret;
+				CallTimer timer(Op::GetClassNames, filter.c_str());
 				CComPtr<IEnumWbemClassObject> enumerator;
-				HRESULT hres = m_pService->ExecQuery(bstr_t("WQL"),
-					bstr_t(query.c_str()),
+				HRESULT hres = m_pService->ExecQuery(CComBSTR(L"WQL"),
+					CComBSTR(query.c_str()),
 					WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY,
 					NULL,
 					&enumerator);
+				if (hres != S_OK)
+					timer.Done(hres);
+				nv2::throw_if(hres != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hres))));
+				hres = Secure(enumerator);
 				nv2::throw_if(hres != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hres))));
 
+				if (pStatus)
+					*pStatus = WBEM_S_NO_ERROR;
 				while (enumerator) 
 				{
 					ULONG uReturn = 0;
 					CComPtr<IWbemClassObject> pClass;
 					//
-					hres = enumerator->Next(WBEM_INFINITE, 1, &pClass, &uReturn);
+					hres = enumerator->Next(deadline.Slice(), 1, &pClass, &uReturn);
+					if (hres == WBEM_S_TIMEDOUT && !deadline.Expired())
+					{
+						continue;
+					}
+					if (hres == WBEM_S_TIMEDOUT)
+					{
+						timer.Done(deadline.Status(), (ULONG)ret.size());
+						nv2::throw_if(pStatus == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(deadline.Status()))));
+						*pStatus = deadline.Status();
+						return ret;
+					}
 					if (uReturn == 0) 
 					{
 						break;
@@ -566,8 +4937,452 @@ namespace nv2
 					// CComVariant vtDesc;
 				}
 				//
+				timer.Done(S_OK, (ULONG)ret.size());
+				return ret;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// drops ResultCache entries when instances of the watched classes are
+		// created, deleted or modified. WMI polls for intrinsic events on
+		// most classes, every within seconds, so keep the list short. Apply
+		// from one consumer thread, i.e. the collection loop
+		class ResultInvalidator
+		{
+			std::shared_ptr<ResultCache> m_pResults;
+			std::vector<std::wstring> m_classes;
+			std::unique_ptr<Subscription> m_pSubscription;
+			std::vector<Object> m_events;
+
+		public:
+
+			//-----------------------------------------------------------------
+			// services must have a result cache
+			ResultInvalidator(const Services& services, const std::vector<std::wstring>& classes, unsigned within = 5)
+				: m_pResults(services.Results())
+				, m_classes(classes)
+			{
+				nv2::throw_if(m_pResults == nullptr || m_classes.empty(), (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_INVALIDARG))));
+				std::wstring query = _W("SELECT * FROM __InstanceOperationEvent WITHIN ") + std::to_wstring(within) + _W(" WHERE ");
+				for (size_t i = 0; i < m_classes.size(); i++)
+				{
+					if (i)
+						query += _W(" OR ");
+					query += _W("TargetInstance ISA ") + WqlString(m_classes[i]);
+				}
+				m_pSubscription = services.Subscribe(query);
+			}
+
+			//-----------------------------------------------------------------
+			// invalidate the class (as registered, so base class queries are
+			// covered too) of every queued event. returns the number of events
+			size_t Apply()
+			{
+				m_events.clear();
+				size_t ret = m_pSubscription->Dequeue(m_events, 256, 0);
+				for (auto& ev : m_events)
+				{
+					Object target = ev.GetEmbedded(_W("TargetInstance"));
+					for (auto& className : m_classes)
+					{
+						if (target.Interface()->InheritsFrom(className.c_str()) == WBEM_S_NO_ERROR || _wcsicmp(target.GetValue(_W("__CLASS")).c_str(), className.c_str()) == 0)
+							m_pResults->Invalidate(className);
+					}
+				}
+				m_events.clear();
+				return ret;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// process wide, lazily made connections to local namespaces. the
+		// first Get for a namespace pays for the locator and ConnectServer,
+		// later ones copy the cached Services: a few AddRefs, no round trip.
+		// proxies belong to the apartment they were obtained in, so MTA
+		// threads share one set while each STA thread has its own, dropped
+		// when the thread exits. a thread that uninitializes COM before it
+		// exits should Release() first
+		class ConnectionManager
+		{
+			struct Apartment
+			{
+				CComPtr<IWbemLocator> pLocator;
+				// keyed by upper cased namespace
+				std::map<std::wstring, Services> connections;
+			};
+
+			//-----------------------------------------------------------------
+			// an STA thread's connections. if COM has already gone from the
+			// thread when it exits the proxies are leaked, not released
+			struct ThreadApartment
+			{
+				Apartment apt;
+
+				~ThreadApartment()
+				{
+					if (apt.connections.empty() && apt.pLocator == NULL)
+						return;
+					APTTYPE type = APTTYPE_CURRENT;
+					APTTYPEQUALIFIER qualifier = APTTYPEQUALIFIER_NONE;
+					if (CoGetApartmentType(&type, &qualifier) != S_OK)
+						new Apartment(std::move(apt));
+				}
+			};
+
+			std::mutex m_lock;
+			// shared by every MTA thread
+			Apartment m_mta;
+
+			ConnectionManager() {}
+
+			//-----------------------------------------------------------------
+			static bool InMTA()
+			{
+				APTTYPE type = APTTYPE_CURRENT;
+				APTTYPEQUALIFIER qualifier = APTTYPEQUALIFIER_NONE;
+				HRESULT hr = CoGetApartmentType(&type, &qualifier);
+				// includes the implicit MTA
+				return (hr == S_OK && type == APTTYPE_MTA);
+			}
+
+			//-----------------------------------------------------------------
+			// the calling STA thread's connections. no lock needed
+			static Apartment& ThisThread()
+			{
+				thread_local ThreadApartment t;
+				return t.apt;
+			}
+
+			//-----------------------------------------------------------------
+			static CComPtr<IWbemLocator> MakeLocator()
+			{
+				HRESULT hResult = InitializeSecurity();
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+				CComPtr<IWbemLocator> ret;
+				hResult = ret.CoCreateInstance(CLSID_WbemLocator);
+				nv2::throw_if(hResult != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hResult))));
+				return ret;
+			}
+
+			//-----------------------------------------------------------------
+			static std::wstring Key(const std::wstring& ns)
+			{
+				std::wstring ret = ns;
+				for (auto& c : ret)
+					c = towupper(c);
 				return ret;
 			}
+
+		public:
+
+			ConnectionManager(const ConnectionManager&) = delete;
+			ConnectionManager& operator=(const ConnectionManager&) = delete;
+
+			//-----------------------------------------------------------------
+			// never destroyed: releasing proxies from a static destructor,
+			// after COM has gone, faults
+			static ConnectionManager& Instance()
+			{
+				static ConnectionManager* pInstance = new ConnectionManager();
+				return *pInstance;
+			}
+
+			//-----------------------------------------------------------------
+			// cached connection or a new one. the connect happens outside the
+			// lock so one slow namespace does not stall the others
+			Services Get(const std::wstring& ns = L"ROOT\\CIMV2")
+			{
+				std::wstring key = Key(ns);
+				if (!InMTA())
+				{
+					Apartment& apt = ThisThread();
+					auto it = apt.connections.find(key);
+					if (it != apt.connections.end())
+						return it->second;
+					if (apt.pLocator == NULL)
+						apt.pLocator = MakeLocator();
+					return apt.connections.insert(std::make_pair(key, Services(apt.pLocator, ns))).first->second;
+				}
+				CComPtr<IWbemLocator> pLocator;
+				{
+					std::lock_guard<std::mutex> lock(m_lock);
+					auto it = m_mta.connections.find(key);
+					if (it != m_mta.connections.end())
+						return it->second;
+					pLocator = m_mta.pLocator;
+				}
+				if (pLocator == NULL)
+					pLocator = MakeLocator();
+				Services srv(pLocator, ns);
+				std::lock_guard<std::mutex> lock(m_lock);
+				if (m_mta.pLocator == NULL)
+					m_mta.pLocator = pLocator;
+				// if another thread got there first use theirs
+				return m_mta.connections.insert(std::make_pair(key, srv)).first->second;
+			}
+
+			//-----------------------------------------------------------------
+			// drop the calling apartment's connection to ns so the next Get
+			// reconnects, i.e. after RPC_S_SERVER_UNAVAILABLE when winmgmt
+			// restarted. handles already given out keep the old proxy
+			void Evict(const std::wstring& ns)
+			{
+				if (!InMTA())
+				{
+					ThisThread().connections.erase(Key(ns));
+					return;
+				}
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_mta.connections.erase(Key(ns));
+			}
+
+			//-----------------------------------------------------------------
+			// drop everything held for the calling apartment
+			void Release()
+			{
+				Apartment apt;
+				if (!InMTA())
+				{
+					apt = std::move(ThisThread());
+					ThisThread() = Apartment();
+					return;
+				}
+				{
+					std::lock_guard<std::mutex> lock(m_lock);
+					apt = std::move(m_mta);
+					m_mta = Apartment();
+				}
+				// proxies released here, outside the lock
+			}
+
+			//-----------------------------------------------------------------
+			// namespaces connected for the MTA and, on an STA thread, for
+			// the calling thread
+			size_t Size()
+			{
+				size_t ret = (InMTA() ? 0 : ThisThread().connections.size());
+				std::lock_guard<std::mutex> lock(m_lock);
+				return ret + m_mta.connections.size();
+			}
+		};
+
+		//---------------------------------------------------------------------
+		inline
+		Services
+			Services::Shared(const std::wstring& ns)
+		{
+			return ConnectionManager::Instance().Get(ns);
+		}
+
+		//---------------------------------------------------------------------
+		// High performance sampling via IWbemRefresher. Objects and enumerators
+		// are registered once and then updated in place on each Refresh() call,
+		// avoiding the CreateInstanceEnum round trip of Services::GetInstances.
+		// Intended for Win32_PerfFormattedData_* and Win32_PerfRawData_* classes.
+		// https://learn.microsoft.com/en-us/windows/win32/wmisdk/accessing-performance-data-in-c--
+		class Refresher
+		{
+		public:
+
+			//-----------------------------------------------------------------
+			// a refreshable enumerator. the instance set is re-read after each
+			// Refresh(). the buffer of IWbemObjectAccess pointers is reused.
+			class Enumerator
+			{
+				friend class Refresher;
+
+				CComPtr<IWbemHiPerfEnum> m_pEnum;
+				CComPtr<IWbemServices> m_pServices;
+				std::shared_ptr<ClassCache> m_pCache;
+				long m_id = 0;
+				// we own one reference on each of the first m_count entries
+				std::vector<IWbemObjectAccess*> m_objects;
+				ULONG m_count = 0;
+
+				//-------------------------------------------------------------
+				void Clear()
+				{
+					for (ULONG i = 0; i < m_count; i++)
+					{
+						m_objects[i]->Release();
+						m_objects[i] = nullptr;
+					}
+					m_count = 0;
+				}
+
+			public:
+
+				Enumerator(const CComPtr<IWbemHiPerfEnum>& pEnum,
+							const CComPtr<IWbemServices>& pServices,
+							long id,
+							const std::shared_ptr<ClassCache>& pCache = nullptr)
+					: m_pEnum(pEnum)
+					, m_pServices(pServices)
+					, m_pCache(pCache)
+					, m_id(id)
+				{
+				}
+
+				Enumerator(const Enumerator&) = delete;
+				Enumerator& operator=(const Enumerator&) = delete;
+
+				~Enumerator()
+				{
+					Clear();
+				}
+
+				//-------------------------------------------------------------
+				// registration id as returned by IWbemConfigureRefresher::AddEnum
+				long Id() const
+				{
+					return m_id;
+				}
+
+				//-------------------------------------------------------------
+				// fetch the current instance set. call after Refresher::Refresh()
+				ULONG Update()
+				{
+					nv2::throw_if(m_pEnum == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+					Clear();
+					ULONG returned = 0;
+					HRESULT hr = m_pEnum->GetObjects(0L,
+													(ULONG)m_objects.size(),
+													m_objects.data(),
+													&returned);
+					if (hr == WBEM_E_BUFFER_TOO_SMALL)
+					{
+						// returned holds the required size. no objects were copied.
+						m_objects.resize(returned);
+						hr = m_pEnum->GetObjects(0L,
+												(ULONG)m_objects.size(),
+												m_objects.data(),
+												&returned);
+					}
+					nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+					m_count = returned;
+					return m_count;
+				}
+
+				//-------------------------------------------------------------
+				ULONG Size() const
+				{
+					return m_count;
+				}
+
+				//-------------------------------------------------------------
+				// raw access for hot loops. valid until the next Update()
+				IWbemObjectAccess* const* begin() const
+				{
+					return m_objects.data();
+				}
+
+				IWbemObjectAccess* const* end() const
+				{
+					return m_objects.data() + m_count;
+				}
+
+				//-------------------------------------------------------------
+				// bind properties against the enumerated class. needs at least
+				// one instance, i.e. call after the first Refresh()/Update()
+				PropertySet Bind(const std::vector<std::wstring>& names) const
+				{
+					nv2::throw_if(m_count == 0, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_NOT_FOUND))));
+					return PropertySet(m_objects[0], names);
+				}
+
+				//-------------------------------------------------------------
+				// wrap instance i. the Object holds its own reference
+				Object operator[](ULONG i) const
+				{
+					nv2::throw_if(i >= m_count, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_INVALIDARG))));
+					return Object(CComPtr<IWbemClassObject>(m_objects[i]), m_pServices, m_pCache);
+				}
+			};
+
+		private:
+
+			CComPtr<IWbemServices> m_pServices;
+			std::shared_ptr<ClassCache> m_pCache;
+			CComPtr<IWbemRefresher> m_pRefresher;
+			CComPtr<IWbemConfigureRefresher> m_pConfig;
+
+		public:
+
+			//-----------------------------------------------------------------
+			explicit Refresher(const Services& services)
+				: m_pServices(services.Interface())
+				, m_pCache(services.Cache())
+			{
+				nv2::throw_if(m_pServices == NULL, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+
+				HRESULT hr = m_pRefresher.CoCreateInstance(CLSID_WbemRefresher, NULL, CLSCTX_INPROC_SERVER);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+
+				hr = m_pRefresher.QueryInterface(&m_pConfig);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			}
+
+			//-----------------------------------------------------------------
+			// register a single instance by object path, i.e.
+			// Win32_PerfFormattedData_PerfOS_Processor.Name="_Total"
+			// the returned Object is updated in place by each Refresh()
+			Object AddObject(LPCWSTR lpObjectPath, long* pId = nullptr)
+			{
+				CComPtr<IWbemClassObject> pObj;
+				long id = 0;
+				HRESULT hr = m_pConfig->AddObjectByPath(m_pServices, lpObjectPath, 0L, NULL, &pObj, &id);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				if (pId)
+					*pId = id;
+				return Object(pObj, m_pServices, m_pCache);
+			}
+
+			//-----------------------------------------------------------------
+			Object AddObject(const std::wstring& objectPath, long* pId = nullptr)
+			{
+				return AddObject(objectPath.c_str(), pId);
+			}
+
+			//-----------------------------------------------------------------
+			// register all instances of a class
+			std::shared_ptr<Enumerator> AddEnum(LPCWSTR lpClassName)
+			{
+				CComPtr<IWbemHiPerfEnum> pEnum;
+				long id = 0;
+				HRESULT hr = m_pConfig->AddEnum(m_pServices, lpClassName, 0L, NULL, &pEnum, &id);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				return std::make_shared<Enumerator>(pEnum, m_pServices, id, m_pCache);
+			}
+
+			//-----------------------------------------------------------------
+			std::shared_ptr<Enumerator> AddEnum(const std::wstring& className)
+			{
+				return AddEnum(className.c_str());
+			}
+
+			//-----------------------------------------------------------------
+			// unregister an object or enumerator
+			void Remove(long id)
+			{
+				HRESULT hr = m_pConfig->Remove(id, 0L);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			}
+
+			//-----------------------------------------------------------------
+			void Remove(const Enumerator& e)
+			{
+				Remove(e.Id());
+			}
+
+			//-----------------------------------------------------------------
+			// update every registered object and enumerator in one call.
+			// NB: formatted data classes need two samples to produce values.
+			void Refresh()
+			{
+				HRESULT hr = m_pRefresher->Refresh(WBEM_FLAG_REFRESH_AUTO_RECONNECT);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+			}
 		};
 
 		//-------------------------------------------
@@ -0,0 +1,312 @@
+/*
+
+	C++ WMI COM classes
+
+	Visit https://github.com/g40
+
+	Copyright (c) Jerry Evans, 2016-2024
+
+	All rights reserved.
+
+	The MIT License (MIT)
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+
+
+#pragma once
+
+#include <unordered_map>
+
+#include "nv2_wmi.h"
+
+namespace nv2
+{
+	namespace wmi
+	{
+		//---------------------------------------------------------------------
+		// 64 bit FNV-1a
+		static const uint64_t HashSeed = 0xcbf29ce484222325ull;
+
+		static
+		uint64_t
+			HashBytes(const void* pData, size_t cb, uint64_t hash = HashSeed)
+		{
+			const uint8_t* p = (const uint8_t*)pData;
+			for (size_t i = 0; i < cb; i++)
+			{
+				hash ^= p[i];
+				hash *= 0x100000001b3ull;
+			}
+			return hash;
+		}
+
+		//---------------------------------------------------------------------
+		static
+		uint64_t
+			HashObjectText(IUnknown* pUnknown, uint64_t hash)
+		{
+			CComPtr<IWbemClassObject> pObj;
+			if (pUnknown == nullptr || pUnknown->QueryInterface(&pObj) != S_OK)
+				return hash;
+			CComBSTR text;
+			if (pObj->GetObjectText(0, &text) != WBEM_S_NO_ERROR)
+				return hash;
+			return HashBytes((BSTR)text, text.ByteLength(), hash);
+		}
+
+		//---------------------------------------------------------------------
+		// content hash of a property value. embedded objects hash their
+		// MOF text, arrays their elements
+		static
+		uint64_t
+			HashVariant(const VARIANT& val, uint64_t hash = HashSeed)
+		{
+			hash = HashBytes(&val.vt, sizeof(val.vt), hash);
+			if (val.vt & VT_ARRAY)
+			{
+				SAFEARRAY* psa = val.parray;
+				if (psa == nullptr)
+					return hash;
+				// WMI arrays are one dimensional
+				LONG lower = 0, upper = -1;
+				SafeArrayGetLBound(psa, 1, &lower);
+				SafeArrayGetUBound(psa, 1, &upper);
+				size_t count = (upper >= lower ? (size_t)(upper - lower + 1) : 0);
+				void* pData = nullptr;
+				HRESULT hr = SafeArrayAccessData(psa, &pData);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				VARTYPE vt = (VARTYPE)(val.vt & VT_TYPEMASK);
+				if (vt == VT_BSTR)
+				{
+					BSTR* p = (BSTR*)pData;
+					for (size_t i = 0; i < count; i++)
+					{
+						hash = HashBytes(p[i], SysStringByteLen(p[i]), hash);
+						// so {"ab", "c"} != {"a", "bc"}
+						hash = HashBytes("", 1, hash);
+					}
+				}
+				else if (vt == VT_UNKNOWN)
+				{
+					IUnknown** p = (IUnknown**)pData;
+					for (size_t i = 0; i < count; i++)
+					{
+						hash = HashObjectText(p[i], hash);
+					}
+				}
+				else
+				{
+					hash = HashBytes(pData, count * SafeArrayGetElemsize(psa), hash);
+				}
+				SafeArrayUnaccessData(psa);
+				return hash;
+			}
+			switch (val.vt)
+			{
+			case VT_EMPTY:
+			case VT_NULL:
+				return hash;
+			case VT_BSTR:
+				return HashBytes(val.bstrVal, SysStringByteLen(val.bstrVal), hash);
+			case VT_UNKNOWN:
+				return HashObjectText(val.punkVal, hash);
+			case VT_BOOL:
+				return HashBytes(&val.boolVal, sizeof(val.boolVal), hash);
+			case VT_I1:
+			case VT_UI1:
+				return HashBytes(&val.bVal, sizeof(val.bVal), hash);
+			case VT_I2:
+			case VT_UI2:
+				return HashBytes(&val.iVal, sizeof(val.iVal), hash);
+			case VT_R4:
+				return HashBytes(&val.fltVal, sizeof(val.fltVal), hash);
+			case VT_I4:
+			case VT_UI4:
+			case VT_INT:
+			case VT_UINT:
+				return HashBytes(&val.lVal, sizeof(val.lVal), hash);
+			default:
+				break;
+			}
+			// VT_R8, VT_I8, VT_UI8, VT_DATE
+			return HashBytes(&val.llVal, sizeof(val.llVal), hash);
+		}
+
+		//---------------------------------------------------------------------
+		// one entry of a delta
+		struct InstanceDelta
+		{
+			enum class Change
+			{
+				Added,
+				Removed,
+				Changed
+			};
+
+			Change change = Change::Added;
+			std::wstring relPath;
+			// Added: every property. Changed: the properties that differ.
+			// Removed: empty
+			std::map<std::wstring, CComVariant> values;
+		};
+
+		//---------------------------------------------------------------------
+		// Periodic collection that only reports churn. The previous result is
+		// kept as per property content hashes keyed by __RELPATH; each Poll
+		// enumerates the class again and returns the instances that were
+		// added, removed or changed since the last Poll, with only the
+		// changed properties. the first Poll reports everything as Added.
+		// not thread safe
+		class DeltaEnumerator
+		{
+			struct Entry
+			{
+				// hash of hashes, for the common nothing changed case
+				uint64_t hash = 0;
+				// one per property, in the order of names
+				std::vector<uint64_t> hashes;
+				// the class's property names. shared with the schema
+				std::shared_ptr<const ClassSchema> pSchema;
+				// set by each Poll
+				uint64_t generation = 0;
+			};
+
+			std::wstring m_className;
+			std::vector<std::wstring> m_properties;
+			ULONG m_batchSize;
+			std::unordered_map<std::wstring, Entry> m_entries;
+			uint64_t m_generation = 0;
+
+		public:
+
+			//-----------------------------------------------------------------
+			// properties empty => all. otherwise the key properties are
+			// fetched as well so __RELPATH is available
+			DeltaEnumerator(const std::wstring& className,
+							const std::vector<std::wstring>& properties = std::vector<std::wstring>(),
+							ULONG batchSize = 256)
+				: m_className(className)
+				, m_properties(properties)
+				, m_batchSize(batchSize)
+			{
+			}
+
+			//-----------------------------------------------------------------
+			// enumerate className and diff against the previous Poll
+			std::vector<InstanceDelta> Poll(const Services& services)
+			{
+				std::vector<InstanceDelta> ret;
+				uint64_t generation = ++m_generation;
+
+				// the projection, with keys. computed per Poll in case the class changed
+				std::vector<std::wstring> properties = m_properties;
+				if (!properties.empty())
+				{
+					nv2::throw_if(services.Cache() == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+					for (auto& key : services.Cache()->Get(m_className)->Keys())
+					{
+						// names are case insensitive, i.e. deviceid is DeviceID
+						auto same = [&key](const std::wstring& prop) { return _wcsicmp(prop.c_str(), key.c_str()) == 0; };
+						if (std::find_if(properties.begin(), properties.end(), same) == properties.end())
+							properties.push_back(key);
+					}
+				}
+
+				InstanceStream stream = (properties.empty() ? services.Enumerate(m_className, m_batchSize)
+																: services.Enumerate(m_className, properties, m_batchSize));
+				std::vector<uint64_t> hashes;
+				std::vector<CComVariant> values;
+				for (Object obj : stream)
+				{
+					std::wstring relPath = obj.GetValue(_W("__RELPATH"));
+					Entry& entry = m_entries[relPath];
+					bool added = (entry.generation == 0);
+					if (added)
+						entry.pSchema = obj.GetSchema();
+					entry.generation = generation;
+
+					// projected instances only carry the projection
+					const std::vector<std::wstring>& names = (properties.empty() ? entry.pSchema->names : properties);
+					hashes.resize(names.size());
+					values.resize(names.size());
+					uint64_t hash = HashSeed;
+					for (size_t i = 0; i < names.size(); i++)
+					{
+						values[i].Clear();
+						HRESULT hR = obj.Interface()->Get(names[i].c_str(), 0, &values[i], NULL, NULL);
+						nv2::throw_if(hR != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hR))));
+						hashes[i] = HashVariant(values[i]);
+						hash = HashBytes(&hashes[i], sizeof(hashes[i]), hash);
+					}
+
+					if (!added && hash == entry.hash && hashes.size() == entry.hashes.size())
+						continue;
+
+					InstanceDelta delta;
+					delta.change = (added ? InstanceDelta::Change::Added : InstanceDelta::Change::Changed);
+					delta.relPath = relPath;
+					for (size_t i = 0; i < names.size(); i++)
+					{
+						if (added || i >= entry.hashes.size() || hashes[i] != entry.hashes[i])
+							delta.values[names[i]] = values[i];
+					}
+					entry.hash = hash;
+					entry.hashes = hashes;
+					ret.push_back(std::move(delta));
+				}
+
+				// anything not seen this time has gone
+				for (auto it = m_entries.begin(); it != m_entries.end(); )
+				{
+					if (it->second.generation != generation)
+					{
+						InstanceDelta delta;
+						delta.change = InstanceDelta::Change::Removed;
+						delta.relPath = it->first;
+						ret.push_back(std::move(delta));
+						it = m_entries.erase(it);
+					}
+					else
+					{
+						++it;
+					}
+				}
+				return ret;
+			}
+
+			//-----------------------------------------------------------------
+			// forget the previous result. the next Poll reports everything as Added
+			void Reset()
+			{
+				m_entries.clear();
+			}
+
+			//-----------------------------------------------------------------
+			// instances in the previous result
+			size_t Size() const
+			{
+				return m_entries.size();
+			}
+		};
+	}
+}
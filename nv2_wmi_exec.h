@@ -0,0 +1,287 @@
+/*
+
+	C++ WMI COM classes
+
+	Visit https://github.com/g40
+
+	Copyright (c) Jerry Evans, 2016-2024
+
+	All rights reserved.
+
+	The MIT License (MIT)
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+#include "nv2_wmi.h"
+
+namespace nv2
+{
+	namespace wmi
+	{
+		//---------------------------------------------------------------------
+		// Pool of MTA worker threads for parallel collection. Each worker
+		// initializes COM as multithreaded and lazily opens its own
+		// Services proxy per namespace, so jobs never share a proxy across
+		// apartments. Jobs are spread round robin over per-worker queues and
+		// idle workers steal from the others.
+		class Executor
+		{
+		public:
+
+			// open a connection to a namespace on the calling (worker) thread
+			using connect_fn = std::function<std::unique_ptr<Services>(const std::wstring&)>;
+
+		private:
+
+			// null Services => the worker could not connect
+			using task_t = std::function<void(Services*)>;
+
+			struct Job
+			{
+				std::wstring ns;
+				task_t task;
+			};
+
+			struct Queue
+			{
+				std::mutex lock;
+				std::deque<Job> jobs;
+			};
+
+			connect_fn m_connect;
+			std::vector<std::unique_ptr<Queue>> m_queues;
+			std::vector<std::thread> m_threads;
+			std::atomic<size_t> m_next{ 0 };
+			// sleeping workers, submitted and not yet finished jobs
+			std::mutex m_waitLock;
+			std::condition_variable m_wake;
+			std::condition_variable m_idle;
+			size_t m_queued = 0;
+			size_t m_inflight = 0;
+			bool m_stop = false;
+
+			//-----------------------------------------------------------------
+			// own queue from the back, then steal from the front of the others
+			bool TryPop(size_t index, Job& job)
+			{
+				for (size_t i = 0; i < m_queues.size(); i++)
+				{
+					Queue& q = *m_queues[(index + i) % m_queues.size()];
+					std::lock_guard<std::mutex> lock(q.lock);
+					if (q.jobs.empty())
+						continue;
+					if (i == 0)
+					{
+						job = std::move(q.jobs.back());
+						q.jobs.pop_back();
+					}
+					else
+					{
+						job = std::move(q.jobs.front());
+						q.jobs.pop_front();
+					}
+					std::lock_guard<std::mutex> wlock(m_waitLock);
+					m_queued--;
+					return true;
+				}
+				return false;
+			}
+
+			//-----------------------------------------------------------------
+			// false once stopped and drained
+			bool Pop(size_t index, Job& job)
+			{
+				for (;;)
+				{
+					if (TryPop(index, job))
+						return true;
+					std::unique_lock<std::mutex> lock(m_waitLock);
+					m_wake.wait(lock, [this] { return m_stop || m_queued > 0; });
+					if (m_stop && m_queued == 0)
+						return false;
+				}
+			}
+
+			//-----------------------------------------------------------------
+			void Finished()
+			{
+				std::lock_guard<std::mutex> lock(m_waitLock);
+				if (--m_inflight == 0)
+					m_idle.notify_all();
+			}
+
+			//-----------------------------------------------------------------
+			void Run(size_t index)
+			{
+				std::unique_ptr<ComInit> ci;
+				try
+				{
+					ci.reset(new ComInit(COINIT_MULTITHREADED));
+				}
+				catch (...)
+				{
+					DBMSG("Executor: worker " << index << " ComInit failed");
+				}
+				// one connection per namespace, owned by this thread
+				std::map<std::wstring, std::unique_ptr<Services>> connections;
+				Job job;
+				while (Pop(index, job))
+				{
+					Services* pServices = nullptr;
+					if (ci)
+					{
+						auto it = connections.find(job.ns);
+						if (it == connections.end())
+						{
+							std::unique_ptr<Services> srv;
+							try
+							{
+								srv = m_connect(job.ns);
+							}
+							catch (...)
+							{
+								DBMSG("Executor: worker " << index << " failed to connect to " << job.ns);
+							}
+							// only cache successful connections
+							if (srv)
+								it = connections.insert(std::make_pair(job.ns, std::move(srv))).first;
+						}
+						if (it != connections.end())
+							pServices = it->second.get();
+					}
+					// exceptions are captured by the packaged_task
+					job.task(pServices);
+					job.task = nullptr;
+					Finished();
+				}
+				// release proxies before CoUninitialize
+				connections.clear();
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			static std::unique_ptr<Services> DefaultConnect(const std::wstring& ns)
+			{
+				return std::unique_ptr<Services>(new Services(ns.c_str()));
+			}
+
+			//-----------------------------------------------------------------
+			explicit Executor(size_t threads = std::thread::hardware_concurrency(),
+								connect_fn connect = DefaultConnect)
+				: m_connect(std::move(connect))
+			{
+				if (threads == 0)
+					threads = 1;
+				for (size_t i = 0; i < threads; i++)
+				{
+					m_queues.push_back(std::unique_ptr<Queue>(new Queue()));
+				}
+				for (size_t i = 0; i < threads; i++)
+				{
+					m_threads.push_back(std::thread(&Executor::Run, this, i));
+				}
+			}
+
+			Executor(const Executor&) = delete;
+			Executor& operator=(const Executor&) = delete;
+
+			//-----------------------------------------------------------------
+			// outstanding jobs are run before the workers exit
+			~Executor()
+			{
+				{
+					std::lock_guard<std::mutex> lock(m_waitLock);
+					m_stop = true;
+				}
+				m_wake.notify_all();
+				for (auto& t : m_threads)
+				{
+					t.join();
+				}
+			}
+
+			//-----------------------------------------------------------------
+			size_t Size() const
+			{
+				return m_threads.size();
+			}
+
+			//-----------------------------------------------------------------
+			// schedule f(Services&) against namespace ns, i.e.
+			// auto f = pool.Submit(L"ROOT\\CIMV2", [](nv2::wmi::Services& srv) { return srv.GetInstances(L"Win32_Service"); });
+			template <typename F>
+			auto Submit(const std::wstring& ns, F f) -> std::future<decltype(f(std::declval<Services&>()))>
+			{
+				using result_t = decltype(f(std::declval<Services&>()));
+				auto task = std::make_shared<std::packaged_task<result_t(Services*)>>(
+					[f](Services* pServices) -> result_t
+					{
+						nv2::throw_if(pServices == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(RPC_E_DISCONNECTED))));
+						return f(*pServices);
+					});
+				std::future<result_t> ret = task->get_future();
+
+				Job job;
+				job.ns = ns;
+				job.task = [task](Services* pServices) { (*task)(pServices); };
+
+				// count first so a fast worker cannot finish the job before it is counted
+				{
+					std::lock_guard<std::mutex> lock(m_waitLock);
+					m_queued++;
+					m_inflight++;
+				}
+				Queue& q = *m_queues[m_next++ % m_queues.size()];
+				{
+					std::lock_guard<std::mutex> lock(q.lock);
+					q.jobs.push_back(std::move(job));
+				}
+				m_wake.notify_one();
+				return ret;
+			}
+
+			//-----------------------------------------------------------------
+			// against ROOT\CIMV2
+			template <typename F>
+			auto Submit(F f) -> std::future<decltype(f(std::declval<Services&>()))>
+			{
+				return Submit(_W("ROOT\\CIMV2"), std::move(f));
+			}
+
+			//-----------------------------------------------------------------
+			// block until every submitted job has finished
+			void Wait()
+			{
+				std::unique_lock<std::mutex> lock(m_waitLock);
+				m_idle.wait(lock, [this] { return m_inflight == 0; });
+			}
+		};
+	}
+}
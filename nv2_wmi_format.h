@@ -0,0 +1,508 @@
+/*
+
+	C++ WMI COM classes
+
+	Visit https://github.com/g40
+
+	Copyright (c) Jerry Evans, 2016-2024
+
+	All rights reserved.
+
+	The MIT License (MIT)
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+
+
+#pragma once
+
+#include <charconv>
+#include <cmath>
+
+#include "nv2_wmi.h"
+
+namespace nv2
+{
+	namespace wmi
+	{
+		//---------------------------------------------------------------------
+		// output formats for Encoder
+		enum class Format
+		{
+			Text,		// name => value, one property per line
+			Json,		// one array of objects
+			NdJson,		// one object per line
+			Csv			// RFC 4180, header row from the first object
+		};
+
+		//---------------------------------------------------------------------
+		// case insensitive. false if name is not a format
+		static
+		bool
+			ParseFormat(const std::wstring& name, Format& format)
+		{
+			static const std::pair<LPCWSTR, Format> formats[] = {
+				{ _W("text"), Format::Text },
+				{ _W("json"), Format::Json },
+				{ _W("ndjson"), Format::NdJson },
+				{ _W("csv"), Format::Csv },
+			};
+			for (auto& f : formats)
+			{
+				if (_wcsicmp(name.c_str(), f.first) == 0)
+				{
+					format = f.second;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		//---------------------------------------------------------------------
+		// append UTF-16 as UTF-8, JSON escaped if json. unpaired surrogates
+		// become U+FFFD
+		static
+		void
+			AppendUtf8(std::string& out, const wchar_t* p, size_t cch, bool json)
+		{
+			for (size_t i = 0; i < cch; i++)
+			{
+				uint32_t c = p[i];
+				if (c < 0x80)
+				{
+					if (json && (c == '"' || c == '\\'))
+					{
+						out += '\\';
+						out += (char)c;
+					}
+					else if (json && c < 0x20)
+					{
+						static const char hex[] = "0123456789abcdef";
+						switch (c)
+						{
+						case '\n': out += "\\n"; break;
+						case '\r': out += "\\r"; break;
+						case '\t': out += "\\t"; break;
+						default:
+							out += "\\u00";
+							out += hex[c >> 4];
+							out += hex[c & 0xf];
+							break;
+						}
+					}
+					else
+					{
+						out += (char)c;
+					}
+					continue;
+				}
+				if (c >= 0xD800 && c <= 0xDBFF && i + 1 < cch && p[i + 1] >= 0xDC00 && p[i + 1] <= 0xDFFF)
+				{
+					c = 0x10000 + ((c - 0xD800) << 10) + (p[++i] - 0xDC00);
+				}
+				else if (c >= 0xD800 && c <= 0xDFFF)
+				{
+					c = 0xFFFD;
+				}
+				if (c < 0x800)
+				{
+					out += (char)(0xC0 | (c >> 6));
+					out += (char)(0x80 | (c & 0x3F));
+				}
+				else if (c < 0x10000)
+				{
+					out += (char)(0xE0 | (c >> 12));
+					out += (char)(0x80 | ((c >> 6) & 0x3F));
+					out += (char)(0x80 | (c & 0x3F));
+				}
+				else
+				{
+					out += (char)(0xF0 | (c >> 18));
+					out += (char)(0x80 | ((c >> 12) & 0x3F));
+					out += (char)(0x80 | ((c >> 6) & 0x3F));
+					out += (char)(0x80 | (c & 0x3F));
+				}
+			}
+		}
+
+		//---------------------------------------------------------------------
+		// Writes instances as UTF-8 straight from their VARIANTs: no
+		// GetValue string round trip and no flush per property. Output
+		// collects in one growable buffer, reused throughout, and is
+		// written with WriteFile each time it passes flushAt bytes.
+		// 64 bit integers (which WMI hands out as strings) are written as
+		// numbers, arrays as JSON arrays (a;b;c in text and CSV) and
+		// embedded objects as nested JSON objects
+		class Encoder
+		{
+			Format m_format;
+			HANDLE m_hOut;
+			std::vector<std::wstring> m_properties;
+			size_t m_flushAt;
+			std::string m_out;
+			// one CSV field before quoting
+			std::string m_field;
+			size_t m_count = 0;
+			bool m_ended = false;
+
+			//-----------------------------------------------------------------
+			template <typename T>
+			static void Number(std::string& out, T value)
+			{
+				char buffer[32];
+				auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+				out.append(buffer, result.ptr);
+			}
+
+			//-----------------------------------------------------------------
+			// JSON has no NaN or infinity, so those are written as null
+			template <typename T>
+			static void Real(std::string& out, T value, bool json)
+			{
+				if (json && !std::isfinite(value))
+					out += "null";
+				else
+					Number(out, value);
+			}
+
+			//-----------------------------------------------------------------
+			// WMI returns (u)int64 as BSTR. write it bare if it is a number
+			static bool IsInteger(const wchar_t* p, size_t cch)
+			{
+				if (cch && *p == L'-')
+				{
+					p++;
+					cch--;
+				}
+				if (cch == 0)
+					return false;
+				for (size_t i = 0; i < cch; i++)
+				{
+					if (p[i] < L'0' || p[i] > L'9')
+						return false;
+				}
+				return true;
+			}
+
+			//-----------------------------------------------------------------
+			void String(std::string& out, const wchar_t* p, size_t cch, CIMTYPE type, bool json)
+			{
+				CIMTYPE base = (type & ~CIM_FLAG_ARRAY);
+				if (json && (base == CIM_SINT64 || base == CIM_UINT64) && IsInteger(p, cch))
+				{
+					AppendUtf8(out, p, cch, false);
+					return;
+				}
+				if (json)
+					out += '"';
+				AppendUtf8(out, p, cch, json);
+				if (json)
+					out += '"';
+			}
+
+			//-----------------------------------------------------------------
+			// one scalar of type vt at pData
+			void Scalar(std::string& out, VARTYPE vt, const void* pData, CIMTYPE type, bool json)
+			{
+				switch (vt)
+				{
+				case VT_BOOL:
+					out += (*(const VARIANT_BOOL*)pData ? "true" : "false");
+					break;
+				case VT_I1:
+					Number(out, (int)*(const int8_t*)pData);
+					break;
+				case VT_UI1:
+					Number(out, (unsigned)*(const uint8_t*)pData);
+					break;
+				case VT_I2:
+					Number(out, *(const int16_t*)pData);
+					break;
+				case VT_UI2:
+					Number(out, *(const uint16_t*)pData);
+					break;
+				case VT_I4:
+				case VT_INT:
+					Number(out, *(const int32_t*)pData);
+					break;
+				case VT_UI4:
+				case VT_UINT:
+					Number(out, *(const uint32_t*)pData);
+					break;
+				case VT_I8:
+					Number(out, *(const int64_t*)pData);
+					break;
+				case VT_UI8:
+					Number(out, *(const uint64_t*)pData);
+					break;
+				case VT_R4:
+					Real(out, *(const float*)pData, json);
+					break;
+				case VT_R8:
+					Real(out, *(const double*)pData, json);
+					break;
+				case VT_BSTR:
+				{
+					BSTR bstr = *(const BSTR*)pData;
+					String(out, bstr ? bstr : _W(""), SysStringLen(bstr), type, json);
+					break;
+				}
+				case VT_UNKNOWN:
+				{
+					CComQIPtr<IWbemClassObject> pEmbedded(*(IUnknown* const*)pData);
+					if (json && pEmbedded)
+						JsonObject(out, pEmbedded, EnumNames(CComPtr<IWbemClassObject>(pEmbedded)));
+					else
+						out += (json ? "null" : "");
+					break;
+				}
+				default:
+					out += (json ? "null" : "");
+					break;
+				}
+			}
+
+			//-----------------------------------------------------------------
+			void Value(std::string& out, const VARIANT& val, CIMTYPE type, bool json)
+			{
+				if (val.vt == VT_NULL || val.vt == VT_EMPTY)
+				{
+					out += (json ? "null" : (m_format == Format::Text ? "NULL" : ""));
+					return;
+				}
+				if (!(val.vt & VT_ARRAY))
+				{
+					// every member of the union starts here
+					Scalar(out, val.vt, &val.llVal, type, json);
+					return;
+				}
+				// contiguous access, no per element copies
+				VARTYPE vt = (VARTYPE)(val.vt & VT_TYPEMASK);
+				SAFEARRAY* psa = val.parray;
+				void* pData = nullptr;
+				HRESULT hr = SafeArrayAccessData(psa, &pData);
+				nv2::throw_if(hr != S_OK, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+				ULONG count = (psa->cDims ? psa->rgsabound[0].cElements : 0);
+				out += (json ? "[" : "");
+				try
+				{
+					for (ULONG i = 0; i < count; i++)
+					{
+						if (i)
+							out += (json ? "," : ";");
+						Scalar(out, vt, (const uint8_t*)pData + (size_t)i * psa->cbElements, type, json);
+					}
+				}
+				catch (...)
+				{
+					SafeArrayUnaccessData(psa);
+					throw;
+				}
+				SafeArrayUnaccessData(psa);
+				out += (json ? "]" : "");
+			}
+
+			//-----------------------------------------------------------------
+			void JsonObject(std::string& out, IWbemClassObject* pObj, const std::vector<std::wstring>& names)
+			{
+				out += '{';
+				for (size_t i = 0; i < names.size(); i++)
+				{
+					CComVariant val;
+					CIMTYPE type = CIM_EMPTY;
+					HRESULT hr = pObj->Get(names[i].c_str(), 0, &val, &type, NULL);
+					nv2::throw_if(hr != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+					if (i)
+						out += ',';
+					out += '"';
+					AppendUtf8(out, names[i].data(), names[i].size(), true);
+					out += "\":";
+					Value(out, val, type, true);
+				}
+				out += '}';
+			}
+
+			//-----------------------------------------------------------------
+			// quote if needed, doubling embedded quotes
+			void CsvField(const std::string& field)
+			{
+				if (field.find_first_of(",\"\r\n") == std::string::npos)
+				{
+					m_out += field;
+					return;
+				}
+				m_out += '"';
+				for (char c : field)
+				{
+					if (c == '"')
+						m_out += '"';
+					m_out += c;
+				}
+				m_out += '"';
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			// properties selects and orders the output. empty => every
+			// (non system) property of each object
+			Encoder(Format format,
+					HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE),
+					const std::vector<std::wstring>& properties = std::vector<std::wstring>(),
+					size_t flushAt = 64 * 1024)
+				: m_format(format)
+				, m_hOut(hOut)
+				, m_properties(properties)
+				, m_flushAt(flushAt)
+			{
+				nv2::throw_if(m_hOut == NULL || m_hOut == INVALID_HANDLE_VALUE, (nv2::acc(LFL) << nv2::s_error(ERROR_INVALID_HANDLE)));
+				m_out.reserve(m_flushAt + m_flushAt / 4);
+			}
+
+			Encoder(const Encoder&) = delete;
+			Encoder& operator=(const Encoder&) = delete;
+
+			~Encoder()
+			{
+				try
+				{
+					End();
+				}
+				catch (...)
+				{
+					DBMSG("~Encoder => exception");
+				}
+			}
+
+			//-----------------------------------------------------------------
+			void Write(const Object& obj)
+			{
+				nv2::throw_if(m_ended || !obj.Valid(), (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_UNEXPECTED))));
+				IWbemClassObject* pObj = obj.Interface();
+				// CSV columns are fixed by the first object
+				if (m_properties.empty() && (m_format != Format::Csv || m_count == 0))
+				{
+					std::vector<std::wstring> names = obj.GetProperties();
+					if (m_format == Format::Csv)
+						m_properties = names;
+					else
+						return Write(pObj, names);
+				}
+				Write(pObj, m_properties);
+			}
+
+			//-----------------------------------------------------------------
+			void Write(IWbemClassObject* pObj, const std::vector<std::wstring>& names)
+			{
+				switch (m_format)
+				{
+				case Format::Json:
+					m_out += (m_count ? ",\n" : "[\n");
+					JsonObject(m_out, pObj, names);
+					break;
+				case Format::NdJson:
+					JsonObject(m_out, pObj, names);
+					m_out += '\n';
+					break;
+				case Format::Csv:
+					if (m_count == 0)
+					{
+						for (size_t i = 0; i < names.size(); i++)
+						{
+							if (i)
+								m_out += ',';
+							m_field.clear();
+							AppendUtf8(m_field, names[i].data(), names[i].size(), false);
+							CsvField(m_field);
+						}
+						m_out += "\r\n";
+					}
+					for (size_t i = 0; i < names.size(); i++)
+					{
+						CComVariant val;
+						CIMTYPE type = CIM_EMPTY;
+						HRESULT hr = pObj->Get(names[i].c_str(), 0, &val, &type, NULL);
+						nv2::throw_if(hr != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+						if (i)
+							m_out += ',';
+						m_field.clear();
+						Value(m_field, val, type, false);
+						CsvField(m_field);
+					}
+					m_out += "\r\n";
+					break;
+				default:
+					for (auto& name : names)
+					{
+						CComVariant val;
+						CIMTYPE type = CIM_EMPTY;
+						HRESULT hr = pObj->Get(name.c_str(), 0, &val, &type, NULL);
+						nv2::throw_if(hr != WBEM_S_NO_ERROR, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(hr))));
+						AppendUtf8(m_out, name.data(), name.size(), false);
+						m_out += " => ";
+						Value(m_out, val, type, false);
+						m_out += '\n';
+					}
+					break;
+				}
+				m_count++;
+				if (m_out.size() >= m_flushAt)
+					Flush();
+			}
+
+			//-----------------------------------------------------------------
+			// write whatever is buffered
+			void Flush()
+			{
+				size_t offset = 0;
+				while (offset < m_out.size())
+				{
+					DWORD written = 0;
+					DWORD cb = (DWORD)std::min<size_t>(m_out.size() - offset, 1 << 30);
+					BOOL ok = WriteFile(m_hOut, m_out.data() + offset, cb, &written, NULL);
+					nv2::throw_if(!ok, (nv2::acc(LFL) << nv2::s_error(GetLastError())));
+					offset += written;
+				}
+				m_out.clear();
+			}
+
+			//-----------------------------------------------------------------
+			// close the JSON array and flush. nothing may be written after
+			void End()
+			{
+				if (m_ended)
+					return;
+				m_ended = true;
+				if (m_format == Format::Json)
+					m_out += (m_count ? "\n]\n" : "[]\n");
+				Flush();
+			}
+
+			//-----------------------------------------------------------------
+			// objects written so far
+			size_t Count() const
+			{
+				return m_count;
+			}
+		};
+	}
+}
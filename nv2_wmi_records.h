@@ -0,0 +1,431 @@
+/*
+
+	C++ WMI COM classes
+
+	Visit https://github.com/g40
+
+	Copyright (c) Jerry Evans, 2016-2024
+
+	All rights reserved.
+
+	The MIT License (MIT)
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+#include "nv2_wmi_table.h"
+
+namespace nv2
+{
+	namespace wmi
+	{
+		//---------------------------------------------------------------------
+		// bump allocator. memory is handed out from large blocks and given
+		// back all at once by Reset, which keeps the blocks for reuse, or
+		// Release. only for trivially destructible types: nothing handed
+		// out is ever destroyed
+		class Arena
+		{
+			struct Block
+			{
+				std::unique_ptr<char[]> data;
+				size_t size = 0;
+				size_t used = 0;
+			};
+
+			std::vector<Block> m_blocks;
+			// first block with room, everything before it is full
+			size_t m_current = 0;
+			size_t m_blockSize = 0;
+			size_t m_used = 0;
+
+			//-----------------------------------------------------------------
+			// cb from the current block or a later one, appending a block
+			// (oversized for large requests) when none fits
+			void* Take(size_t cb, size_t align)
+			{
+				for (; m_current < m_blocks.size(); m_current++)
+				{
+					Block& block = m_blocks[m_current];
+					size_t offset = (block.used + align - 1) & ~(align - 1);
+					if (offset + cb <= block.size)
+					{
+						block.used = offset + cb;
+						m_used += cb;
+						return block.data.get() + offset;
+					}
+				}
+				Block block;
+				block.size = (std::max)(m_blockSize, cb + align);
+				block.data.reset(new char[block.size]);
+				m_blocks.push_back(std::move(block));
+				m_current = m_blocks.size() - 1;
+				return Take(cb, align);
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			explicit Arena(size_t blockSize = 64 * 1024)
+				: m_blockSize(blockSize ? blockSize : 1)
+			{
+			}
+
+			Arena(const Arena&) = delete;
+			Arena& operator=(const Arena&) = delete;
+			Arena(Arena&&) = default;
+			Arena& operator=(Arena&&) = default;
+
+			//-----------------------------------------------------------------
+			// align must be a power of 2
+			void* Allocate(size_t cb, size_t align = alignof(std::max_align_t))
+			{
+				return Take(cb ? cb : 1, align);
+			}
+
+			//-----------------------------------------------------------------
+			// count default constructed Ts
+			template <typename T>
+			T* Allocate(size_t count)
+			{
+				static_assert(std::is_trivially_destructible<T>::value, "Arena never runs destructors");
+				T* ret = static_cast<T*>(Take(sizeof(T) * (count ? count : 1), alignof(T)));
+				for (size_t i = 0; i < count; i++)
+					new (ret + i) T();
+				return ret;
+			}
+
+			//-----------------------------------------------------------------
+			// NUL terminated copy. the view excludes the terminator
+			std::wstring_view Copy(const wchar_t* p, size_t cch)
+			{
+				wchar_t* ret = static_cast<wchar_t*>(Take((cch + 1) * sizeof(wchar_t), alignof(wchar_t)));
+				if (cch)
+					memcpy(ret, p, cch * sizeof(wchar_t));
+				ret[cch] = 0;
+				return std::wstring_view(ret, cch);
+			}
+
+			std::wstring_view Copy(std::wstring_view value)
+			{
+				return Copy(value.data(), value.size());
+			}
+
+			//-----------------------------------------------------------------
+			// invalidate everything allocated so far in one step. the blocks
+			// are kept, so a steady state Reset/Allocate cycle does not touch
+			// the heap
+			void Reset()
+			{
+				for (auto& block : m_blocks)
+					block.used = 0;
+				m_current = 0;
+				m_used = 0;
+			}
+
+			//-----------------------------------------------------------------
+			// Reset and free the blocks
+			void Release()
+			{
+				m_blocks.clear();
+				m_current = 0;
+				m_used = 0;
+			}
+
+			//-----------------------------------------------------------------
+			// bytes handed out since the last Reset, excluding padding
+			size_t Used() const
+			{
+				return m_used;
+			}
+
+			// bytes held in blocks
+			size_t Reserved() const
+			{
+				size_t ret = 0;
+				for (auto& block : m_blocks)
+					ret += block.size;
+				return ret;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// one property of a Record. which member holds the value depends on
+		// type, as for Column. strings point into the RecordStream's Arena
+		struct Field
+		{
+			ColumnType type = ColumnType::UInt64;
+			bool present = false;
+			union
+			{
+				int64_t i64;
+				uint64_t u64;	// UInt64, Bool, DateTime (FILETIME ticks)
+				double real;
+			};
+			std::wstring_view text;
+
+			Field() : u64(0) {}
+
+			bool IsNull() const
+			{
+				return !present;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// a plain copy of one instance, in RecordStream property order. no
+		// COM references: the memory belongs to the arena
+		struct Record
+		{
+			// the instance's __CLASS, which differs for subclasses in deep
+			// enumerations
+			std::wstring_view className;
+			const Field* fields = nullptr;
+			size_t count = 0;
+
+			const Field& operator[](size_t i) const
+			{
+				return fields[i];
+			}
+
+			size_t Size() const
+			{
+				return count;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// Materialize and release. Enumerates a projection of a class one
+		// batch at a time, copying the requested properties into Records
+		// allocated from an Arena and releasing every COM object of the
+		// batch before NextBatch returns. The next call resets the arena,
+		// so peak memory is one batch of instances plus one batch of
+		// records whatever the size of the result.
+		//
+		// The next batch is only requested from WMI when the consumer asks
+		// for it. Unconsumed instances queue in WMI, which throttles the
+		// provider once a client falls behind (HighThresholdOnClientObjects
+		// in the WMI throttling settings), so a slow consumer slows the
+		// provider rather than growing either process.
+		// Properties may not be arrays or embedded objects. see ColumnTypeOf
+		class RecordStream
+		{
+			InstanceStream m_stream;
+			std::vector<std::wstring> m_properties;
+			std::vector<ColumnType> m_types;
+			// handles per class. Record::className views the keys
+			BoundClasses m_bound;
+			Arena m_arena;
+			std::vector<Record> m_records;
+			// reused by every string read
+			std::wstring m_scratch;
+			size_t m_total = 0;
+
+			//-----------------------------------------------------------------
+			static
+			InstanceStream
+				Open(const Services& services,
+						const std::wstring& className,
+						const std::vector<std::wstring>& properties,
+						const std::wstring& where,
+						ULONG batchSize)
+			{
+				PreparedQuery query = PreparedQuery::Select(className, properties, where);
+				return services.Enumerate(query, batchSize);
+			}
+
+			//-----------------------------------------------------------------
+			void Read(IWbemObjectAccess* pAccess, const BoundProperty& prop, ColumnType type, Field& field)
+			{
+				field.type = type;
+				switch (type)
+				{
+				case ColumnType::Int64:
+					field.present = prop.ReadInt64(pAccess, field.i64);
+					break;
+				case ColumnType::UInt64:
+				case ColumnType::Bool:
+					field.present = prop.ReadUInt64(pAccess, field.u64);
+					break;
+				case ColumnType::DateTime:
+				{
+					FILETIME ft = {};
+					field.present = prop.ReadFileTime(pAccess, ft);
+					field.u64 = (field.present ? (((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) : 0);
+					break;
+				}
+				case ColumnType::Double:
+					field.present = prop.ReadDouble(pAccess, field.real);
+					break;
+				case ColumnType::String:
+					field.present = prop.ReadString(pAccess, m_scratch);
+					if (field.present)
+						field.text = m_arena.Copy(m_scratch);
+					break;
+				}
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			// where, if given, is a WQL condition, i.e. Where::Text()
+			RecordStream(const Services& services,
+							const std::wstring& className,
+							const std::vector<std::wstring>& properties,
+							ULONG batchSize = 256,
+							const std::wstring& where = _W(""),
+							size_t arenaBlock = 64 * 1024)
+				: m_stream(Open(services, className, properties, where, batchSize))
+				, m_properties(properties)
+				, m_bound(properties)
+				, m_arena(arenaBlock)
+			{
+				nv2::throw_if(services.Cache() == nullptr || properties.empty(), (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_INVALIDARG))));
+				std::shared_ptr<const ClassSchema> schema = services.Cache()->Get(className);
+				m_types.reserve(properties.size());
+				for (auto& name : properties)
+				{
+					const PropertyDef* prop = schema->Property(name);
+					nv2::throw_if(prop == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_NOT_FOUND))));
+					m_types.push_back(ColumnTypeOf(prop->type));
+				}
+				m_records.reserve(batchSize ? batchSize : 1);
+			}
+
+			RecordStream(const RecordStream&) = delete;
+			RecordStream& operator=(const RecordStream&) = delete;
+			RecordStream(RecordStream&&) = default;
+
+			//-----------------------------------------------------------------
+			// see InstanceStream::SetDeadline
+			void SetDeadline(const Deadline& deadline)
+			{
+				m_stream.SetDeadline(deadline);
+			}
+
+			HRESULT Status() const
+			{
+				return m_stream.Status();
+			}
+
+			//-----------------------------------------------------------------
+			// drop the previous batch's records, fetch the next batch of
+			// instances, copy them out and release them. returns the number
+			// of records, 0 at the end of the enumeration
+			size_t NextBatch()
+			{
+				m_records.clear();
+				m_arena.Reset();
+				if (!m_stream.NextBatch())
+					return 0;
+				for (auto it = m_stream.BatchBegin(); it != m_stream.BatchEnd(); ++it)
+				{
+					CComPtr<IWbemObjectAccess> pAccess = ObjectAccess(*it);
+					const BoundClasses::entry_t& found = m_bound.Bind(pAccess);
+
+					Record record;
+					record.className = found.first;
+					record.count = m_types.size();
+					Field* fields = m_arena.Allocate<Field>(record.count);
+					for (size_t i = 0; i < record.count; i++)
+					{
+						Read(pAccess, found.second[i], m_types[i], fields[i]);
+					}
+					record.fields = fields;
+					m_records.push_back(record);
+				}
+				m_stream.ReleaseBatch();
+				m_total += m_records.size();
+				return m_records.size();
+			}
+
+			//-----------------------------------------------------------------
+			// the current batch. valid until the next NextBatch
+			const std::vector<Record>& Records() const
+			{
+				return m_records;
+			}
+
+			std::vector<Record>::const_iterator begin() const
+			{
+				return m_records.begin();
+			}
+
+			std::vector<Record>::const_iterator end() const
+			{
+				return m_records.end();
+			}
+
+			//-----------------------------------------------------------------
+			const std::vector<std::wstring>& Properties() const
+			{
+				return m_properties;
+			}
+
+			ColumnType Type(size_t i) const
+			{
+				return m_types[i];
+			}
+
+			//-----------------------------------------------------------------
+			// records delivered so far
+			size_t Total() const
+			{
+				return m_total;
+			}
+
+			const Arena& GetArena() const
+			{
+				return m_arena;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// run fn over each batch of className's instances, i.e.
+		// ForEachRecordBatch(srv, L"CIM_DataFile", { L"Name", L"FileSize" },
+		//		[&](const std::vector<Record>& batch) { ... });
+		// fn returning false stops the enumeration. returns the record count
+		template <typename F>
+		size_t
+			ForEachRecordBatch(const Services& services,
+								const std::wstring& className,
+								const std::vector<std::wstring>& properties,
+								F fn,
+								ULONG batchSize = 256,
+								const std::wstring& where = _W(""))
+		{
+			RecordStream stream(services, className, properties, batchSize, where);
+			while (stream.NextBatch())
+			{
+				if (!fn(stream.Records()))
+					break;
+			}
+			return stream.Total();
+		}
+	}
+}
@@ -0,0 +1,255 @@
+/*
+
+	C++ WMI COM classes
+
+	Visit https://github.com/g40
+
+	Copyright (c) Jerry Evans, 2016-2024
+
+	All rights reserved.
+
+	The MIT License (MIT)
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+#pragma once
+
+#include <atomic>
+#include <cwctype>
+#include <thread>
+
+#include "nv2_wmi.h"
+
+namespace nv2
+{
+	namespace wmi
+	{
+		//---------------------------------------------------------------------
+		// errors that mean the proxy is dead and a fresh connection may help
+		static
+		bool
+			IsDisconnect(HRESULT hr)
+		{
+			return hr == RPC_E_DISCONNECTED 
+				|| hr == RPC_E_SERVERFAULT
+				|| hr == WBEM_E_TRANSPORT_FAILURE
+				|| hr == HRESULT_FROM_WIN32(RPC_S_SERVER_UNAVAILABLE)
+				|| hr == HRESULT_FROM_WIN32(RPC_S_CALL_FAILED);
+		}
+
+		//---------------------------------------------------------------------
+		// Authenticated connections keyed by (host, namespace), reused across
+		// calls and re-established when a call fails with a dead proxy.
+		// Connections are made on the calling thread: use from MTA threads
+		// (see ComInit, Executor) so the proxies may be shared between them.
+		class ConnectionPool
+		{
+			using key_t = std::pair<std::wstring, std::wstring>;
+
+			Credentials m_default;
+			std::mutex m_lock;
+			std::map<std::wstring, Credentials> m_credentials;
+			std::map<key_t, std::shared_ptr<Services>> m_connections;
+
+			//-----------------------------------------------------------------
+			// host names are case insensitive
+			static key_t Key(const std::wstring& host, const std::wstring& ns)
+			{
+				key_t ret(host, ns);
+				for (auto& c : ret.first)
+					c = towlower(c);
+				for (auto& c : ret.second)
+					c = towupper(c);
+				return ret;
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			explicit ConnectionPool(const Credentials& creds = Credentials())
+				: m_default(creds)
+			{
+			}
+
+			//-----------------------------------------------------------------
+			// per host credentials, replacing the default
+			void SetCredentials(const std::wstring& host, const Credentials& creds)
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_credentials[Key(host, _W("")).first] = creds;
+			}
+
+			//-----------------------------------------------------------------
+			// cached connection or a new one. the connect happens outside the
+			// lock so one slow host does not stall the others
+			std::shared_ptr<Services> Acquire(const std::wstring& host, const std::wstring& ns)
+			{
+				key_t key = Key(host, ns);
+				Credentials creds;
+				{
+					std::lock_guard<std::mutex> lock(m_lock);
+					auto it = m_connections.find(key);
+					if (it != m_connections.end())
+						return it->second;
+					auto ic = m_credentials.find(key.first);
+					creds = (ic != m_credentials.end() ? ic->second : m_default);
+				}
+				auto srv = std::make_shared<Services>(host, ns, creds);
+				std::lock_guard<std::mutex> lock(m_lock);
+				// if another thread got there first use theirs
+				return m_connections.insert(std::make_pair(key, srv)).first->second;
+			}
+
+			//-----------------------------------------------------------------
+			// drop a connection so the next Acquire reconnects
+			void Evict(const std::wstring& host, const std::wstring& ns)
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_connections.erase(Key(host, ns));
+			}
+
+			//-----------------------------------------------------------------
+			void Clear()
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_connections.clear();
+			}
+
+			//-----------------------------------------------------------------
+			size_t Size()
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				return m_connections.size();
+			}
+
+			//-----------------------------------------------------------------
+			// run f(Services&). if it throws and the connection turns out to be
+			// dead (RPC_E_DISCONNECTED etc) reconnect once and retry
+			template <typename F>
+			auto Call(const std::wstring& host, const std::wstring& ns, F f) -> decltype(f(std::declval<Services&>()))
+			{
+				std::shared_ptr<Services> srv = Acquire(host, ns);
+				try
+				{
+					return f(*srv);
+				}
+				catch (...)
+				{
+					HRESULT hr = srv->Ping();
+					if (!IsDisconnect(hr))
+						throw;
+					DBMSG("ConnectionPool: reconnecting to " << host << " " << ns << " => " << nv2::s_error(uw32::Win32FromHResult(hr)));
+					Evict(host, ns);
+				}
+				srv = Acquire(host, ns);
+				return f(*srv);
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// outcome of one host in a FanOut
+		template <typename R>
+		struct HostResult
+		{
+			std::wstring host;
+			bool ok = false;
+			R value = R();
+			// exception or Win32 error text (UTF-8) if !ok
+			std::string error;
+		};
+
+		//---------------------------------------------------------------------
+		// run f(Services&) against namespace ns on every host, with at most
+		// maxInFlight hosts in progress at a time. each in flight slot is an
+		// MTA thread. results are in the same order as hosts. i.e.
+		// auto results = FanOut(pool, hosts, L"ROOT\\CIMV2", 
+		//		[](Services& srv) { return srv.GetInstances(L"Win32_OperatingSystem").size(); }, 64);
+		template <typename F>
+		auto FanOut(ConnectionPool& pool,
+					const std::vector<std::wstring>& hosts,
+					const std::wstring& ns,
+					F f,
+					size_t maxInFlight = 32)
+			-> std::vector<HostResult<decltype(f(std::declval<Services&>()))>>
+		{
+			using result_t = HostResult<decltype(f(std::declval<Services&>()))>;
+			std::vector<result_t> ret(hosts.size());
+			std::atomic<size_t> next{ 0 };
+
+			auto worker = [&]()
+			{
+				std::unique_ptr<ComInit> ci;
+				try
+				{
+					ci.reset(new ComInit(COINIT_MULTITHREADED));
+				}
+				catch (...)
+				{
+				}
+				for (size_t i = next++; i < hosts.size(); i = next++)
+				{
+					result_t& r = ret[i];
+					r.host = hosts[i];
+					if (!ci)
+					{
+						r.error = "ComInit failed";
+						continue;
+					}
+					try
+					{
+						r.value = pool.Call(hosts[i], ns, f);
+						r.ok = true;
+					}
+					catch (const DWORD& ex)
+					{
+						// i.e. access denied or the RPC server unavailable
+						std::wstring text = nv2::s_error(ex);
+						int cb = WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), NULL, 0, NULL, NULL);
+						r.error.resize(cb > 0 ? (size_t)cb : 0);
+						if (cb > 0)
+							WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), &r.error[0], cb, NULL, NULL);
+					}
+					catch (const std::exception& ex)
+					{
+						r.error = ex.what();
+					}
+					catch (...)
+					{
+						r.error = "unknown error";
+					}
+				}
+			};
+
+			size_t threads = (std::min)(maxInFlight ? maxInFlight : 1, hosts.size());
+			std::vector<std::thread> pool_threads;
+			for (size_t i = 0; i < threads; i++)
+			{
+				pool_threads.push_back(std::thread(worker));
+			}
+			for (auto& t : pool_threads)
+			{
+				t.join();
+			}
+			return ret;
+		}
+	}
+}
@@ -0,0 +1,331 @@
+/*
+
+	C++ WMI COM classes
+
+	Visit https://github.com/g40
+
+	Copyright (c) Jerry Evans, 2016-2024
+
+	All rights reserved.
+
+	The MIT License (MIT)
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+
+
+#pragma once
+
+#include "nv2_wmi.h"
+
+namespace nv2
+{
+	namespace wmi
+	{
+		//---------------------------------------------------------------------
+		// Periodic collection shared between many subscribers. Registrations
+		// for the same class and WHERE clause are merged into one group that
+		// issues a single query for the union of their properties, and each
+		// subscriber's timer is aligned to multiples of its interval so 30s
+		// and 60s subscribers are served by the same query every 60s. WMI
+		// load then grows with the number of distinct queries, not with the
+		// number of subscribers.
+		//
+		// Add and Remove may be called from any thread. Run (or RunDue) from
+		// one collection thread, which is also where callbacks are made
+		class CollectionScheduler
+		{
+		public:
+
+			using clock = std::chrono::steady_clock;
+			// objects carry the union of the group's properties
+			using collect_fn = std::function<void(const QueryResult&)>;
+
+		private:
+
+			struct Subscriber
+			{
+				size_t id = 0;
+				std::vector<std::wstring> properties;
+				std::chrono::milliseconds interval{ 0 };
+				clock::time_point next;
+				collect_fn onCollect;
+			};
+
+			struct Group
+			{
+				std::wstring className;
+				std::wstring where;
+				std::vector<Subscriber> subscribers;
+				// dropped whenever the member list changes and rebuilt by
+				// RunDue. building it makes COM objects, so that happens on
+				// the collection thread
+				std::shared_ptr<PreparedQuery> pQuery;
+			};
+
+			// one query run, built under the lock and executed outside it
+			struct Job
+			{
+				std::shared_ptr<PreparedQuery> pQuery;
+				std::chrono::milliseconds timeout{ 0 };
+				std::vector<collect_fn> callbacks;
+			};
+
+			mutable std::mutex m_lock;
+			// keyed by lower case class name and WHERE clause
+			std::map<std::pair<std::wstring, std::wstring>, Group> m_groups;
+			size_t m_nextId = 1;
+			// intervals are aligned to this
+			clock::time_point m_epoch = clock::now();
+			std::atomic<uint64_t> m_queries{ 0 };
+			std::atomic<uint64_t> m_deliveries{ 0 };
+
+			//-----------------------------------------------------------------
+			// first multiple of interval (from the epoch) after now
+			clock::time_point Align(clock::time_point now, std::chrono::milliseconds interval) const
+			{
+				auto ticks = (now - m_epoch) / interval;
+				return m_epoch + (ticks + 1) * interval;
+			}
+
+			//-----------------------------------------------------------------
+			// SELECT <union of properties>. any subscriber wanting every
+			// property (an empty list) makes it SELECT *
+			static std::shared_ptr<PreparedQuery> MakeQuery(const Group& group)
+			{
+				std::vector<std::wstring> properties;
+				std::set<std::wstring> seen;
+				for (auto& sub : group.subscribers)
+				{
+					if (sub.properties.empty())
+					{
+						properties.clear();
+						break;
+					}
+					for (auto& prop : sub.properties)
+					{
+						std::wstring key = prop;
+						for (auto& c : key)
+							c = towlower(c);
+						if (seen.insert(key).second)
+							properties.push_back(prop);
+					}
+				}
+				return std::make_shared<PreparedQuery>(PreparedQuery::Select(group.className, properties, group.where));
+			}
+
+		public:
+
+			CollectionScheduler() {}
+
+			CollectionScheduler(const CollectionScheduler&) = delete;
+			CollectionScheduler& operator=(const CollectionScheduler&) = delete;
+
+			//-----------------------------------------------------------------
+			// collect properties of className every interval. where, if given,
+			// is the WHERE clause: only registrations with the same class and
+			// where are merged. returns an id for Remove
+			size_t Add(const std::wstring& className,
+						const std::vector<std::wstring>& properties,
+						std::chrono::milliseconds interval,
+						collect_fn onCollect,
+						const std::wstring& where = _W(""))
+			{
+				nv2::throw_if(interval.count() <= 0 || !onCollect, (nv2::acc(LFL) << nv2::s_error(ERROR_INVALID_PARAMETER)));
+
+				std::wstring lower = className;
+				for (auto& c : lower)
+					c = towlower(c);
+
+				std::lock_guard<std::mutex> guard(m_lock);
+				Group& group = m_groups[std::make_pair(lower, where)];
+				if (group.subscribers.empty())
+				{
+					group.className = className;
+					group.where = where;
+				}
+				Subscriber sub;
+				sub.id = m_nextId++;
+				sub.properties = properties;
+				sub.interval = interval;
+				sub.next = Align(clock::now(), interval);
+				sub.onCollect = std::move(onCollect);
+				group.subscribers.push_back(std::move(sub));
+				group.pQuery.reset();
+				return group.subscribers.back().id;
+			}
+
+			//-----------------------------------------------------------------
+			// false if id is unknown. a collection already under way may
+			// still deliver to it once
+			bool Remove(size_t id)
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				for (auto it = m_groups.begin(); it != m_groups.end(); ++it)
+				{
+					auto& subs = it->second.subscribers;
+					auto sub = std::find_if(subs.begin(), subs.end(), [id](const Subscriber& s) { return s.id == id; });
+					if (sub == subs.end())
+						continue;
+					subs.erase(sub);
+					if (subs.empty())
+						m_groups.erase(it);
+					else
+						it->second.pQuery.reset();
+					return true;
+				}
+				return false;
+			}
+
+			//-----------------------------------------------------------------
+			// run every group with a subscriber due, one query per group, and
+			// deliver to the subscribers that are due. a query is bounded by
+			// the shortest interval among them so a stuck provider delays the
+			// next round by at most that. returns the time until the next
+			// subscriber is due
+			std::chrono::milliseconds RunDue(const Services& services)
+			{
+				std::vector<Job> jobs;
+				{
+					std::lock_guard<std::mutex> guard(m_lock);
+					clock::time_point now = clock::now();
+					for (auto& kv : m_groups)
+					{
+						Job job;
+						for (auto& sub : kv.second.subscribers)
+						{
+							if (sub.next > now)
+								continue;
+							if (job.callbacks.empty() || sub.interval < job.timeout)
+								job.timeout = sub.interval;
+							job.callbacks.push_back(sub.onCollect);
+							// skip whatever ticks were missed
+							sub.next = Align(now, sub.interval);
+						}
+						if (job.callbacks.empty())
+							continue;
+						if (!kv.second.pQuery)
+						{
+							try
+							{
+								kv.second.pQuery = MakeQuery(kv.second);
+							}
+							catch (...)
+							{
+								// delivered as a failed collection below
+								DBMSG("CollectionScheduler: " << kv.second.className << " => query not built");
+							}
+						}
+						job.pQuery = kv.second.pQuery;
+						jobs.push_back(std::move(job));
+					}
+				}
+
+				for (auto& job : jobs)
+				{
+					QueryResult result;
+					result.status = WBEM_E_FAILED;
+					try
+					{
+						if (job.pQuery)
+						{
+							m_queries++;
+							result = services.GetInstances(*job.pQuery, Deadline(job.timeout));
+						}
+					}
+					catch (...)
+					{
+						DBMSG("CollectionScheduler: " << job.pQuery->Text() << " => exception");
+						result.objects.clear();
+						result.status = WBEM_E_FAILED;
+					}
+					for (auto& onCollect : job.callbacks)
+					{
+						try
+						{
+							m_deliveries++;
+							onCollect(result);
+						}
+						catch (...)
+						{
+							DBMSG("CollectionScheduler: callback => exception");
+						}
+					}
+				}
+				return NextDue();
+			}
+
+			//-----------------------------------------------------------------
+			// RunDue until token is cancelled. sleeps in slices of at most
+			// 100ms so cancellation and new registrations are noticed
+			void Run(const Services& services, const CancelToken& token)
+			{
+				while (!token.Cancelled())
+				{
+					std::chrono::milliseconds wait = RunDue(services);
+					std::this_thread::sleep_for((std::min)(wait, std::chrono::milliseconds(100)));
+				}
+			}
+
+			//-----------------------------------------------------------------
+			// time until the earliest subscriber is due. 0 if overdue, 1s if
+			// there are no subscribers
+			std::chrono::milliseconds NextDue() const
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				clock::time_point now = clock::now();
+				clock::time_point next = now + std::chrono::seconds(1);
+				for (auto& kv : m_groups)
+				{
+					for (auto& sub : kv.second.subscribers)
+					{
+						next = (std::min)(next, sub.next);
+					}
+				}
+				if (next <= now)
+					return std::chrono::milliseconds(0);
+				return std::chrono::duration_cast<std::chrono::milliseconds>(next - now);
+			}
+
+			//-----------------------------------------------------------------
+			// distinct queries, i.e. groups
+			size_t Groups() const
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				return m_groups.size();
+			}
+
+			//-----------------------------------------------------------------
+			// queries issued and callbacks made so far. their ratio is the
+			// sharing achieved
+			uint64_t Queries() const
+			{
+				return m_queries;
+			}
+
+			uint64_t Deliveries() const
+			{
+				return m_deliveries;
+			}
+		};
+	}
+}
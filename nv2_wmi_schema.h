@@ -0,0 +1,521 @@
+/*
+
+	C++ WMI COM classes
+
+	Visit https://github.com/g40
+
+	Copyright (c) Jerry Evans, 2016-2024
+
+	All rights reserved.
+
+	The MIT License (MIT)
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+
+
+#pragma once
+
+#include <cstring>
+
+#include "nv2_wmi.h"
+
+namespace nv2
+{
+	namespace wmi
+	{
+		//---------------------------------------------------------------------
+		// the OS build, i.e. L"22631.4317". schemas change with updates
+		static
+		std::wstring
+			OsBuildStamp()
+		{
+			static const LPCWSTR key = _W("SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion");
+			wchar_t build[32] = {};
+			DWORD cb = sizeof(build);
+			DWORD ubr = 0;
+			DWORD cbUbr = sizeof(ubr);
+			std::wstring ret;
+			if (RegGetValueW(HKEY_LOCAL_MACHINE, key, _W("CurrentBuildNumber"), RRF_RT_REG_SZ, NULL, build, &cb) == ERROR_SUCCESS)
+				ret = build;
+			if (RegGetValueW(HKEY_LOCAL_MACHINE, key, _W("UBR"), RRF_RT_REG_DWORD, NULL, &ubr, &cbUbr) == ERROR_SUCCESS)
+				ret += _W(".") + std::to_wstring(ubr);
+			return ret;
+		}
+
+		//---------------------------------------------------------------------
+		// little endian, length prefixed serialization for SchemaStore
+		class SchemaWriter
+		{
+			std::vector<uint8_t> m_buffer;
+
+		public:
+
+			void Bytes(const void* pData, size_t cb)
+			{
+				const uint8_t* p = (const uint8_t*)pData;
+				m_buffer.insert(m_buffer.end(), p, p + cb);
+			}
+
+			template <typename T>
+			void Value(T value)
+			{
+				static_assert(std::is_arithmetic<T>::value, "arithmetic types only");
+				Bytes(&value, sizeof(value));
+			}
+
+			void String(std::wstring_view value)
+			{
+				Value((uint32_t)value.size());
+				Bytes(value.data(), value.size() * sizeof(wchar_t));
+			}
+
+			void Strings(const std::vector<std::wstring>& values)
+			{
+				Value((uint32_t)values.size());
+				for (auto& value : values)
+				{
+					String(value);
+				}
+			}
+
+			//-----------------------------------------------------------------
+			// the qualifier types worth keeping. false (and nothing written)
+			// for anything else
+			static bool Persistable(const VARIANT& val)
+			{
+				switch (val.vt)
+				{
+				case VT_BOOL:
+				case VT_I4:
+				case VT_R8:
+				case VT_BSTR:
+				case VT_ARRAY | VT_BSTR:
+				case VT_ARRAY | VT_I4:
+					return true;
+				default:
+					break;
+				}
+				return false;
+			}
+
+			void Variant(const VARIANT& val)
+			{
+				Value((uint16_t)val.vt);
+				switch (val.vt)
+				{
+				case VT_BOOL:
+					Value((int32_t)val.boolVal);
+					break;
+				case VT_I4:
+					Value((int32_t)val.lVal);
+					break;
+				case VT_R8:
+					Value(val.dblVal);
+					break;
+				case VT_BSTR:
+					String(std::wstring_view(val.bstrVal ? val.bstrVal : _W(""), SysStringLen(val.bstrVal)));
+					break;
+				case VT_ARRAY | VT_BSTR:
+				{
+					// val is not ours, so view it without taking the array
+					SafeArrayView<BSTR> elements(val.parray, false);
+					Value((uint32_t)elements.size());
+					for (BSTR element : elements)
+					{
+						String(std::wstring_view(element ? element : _W(""), SysStringLen(element)));
+					}
+					break;
+				}
+				case VT_ARRAY | VT_I4:
+				{
+					SafeArrayView<int32_t> elements(val.parray, false);
+					Value((uint32_t)elements.size());
+					for (int32_t element : elements)
+					{
+						Value(element);
+					}
+					break;
+				}
+				default:
+					break;
+				}
+			}
+
+			void Qualifiers(const qualifier_map& qualifiers)
+			{
+				uint32_t count = 0;
+				for (auto& kv : qualifiers)
+				{
+					if (Persistable(kv.second))
+						count++;
+				}
+				Value(count);
+				for (auto& kv : qualifiers)
+				{
+					if (!Persistable(kv.second))
+						continue;
+					String(kv.first);
+					Variant(kv.second);
+				}
+			}
+
+			const std::vector<uint8_t>& Buffer() const
+			{
+				return m_buffer;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// bounds checked. throws ERROR_BAD_FORMAT on a short or corrupt file
+		class SchemaReader
+		{
+			const uint8_t* m_p;
+			const uint8_t* m_end;
+
+		public:
+
+			SchemaReader(const uint8_t* p, size_t cb)
+				: m_p(p)
+				, m_end(p + cb)
+			{
+			}
+
+			void Bytes(void* pData, size_t cb)
+			{
+				nv2::throw_if((size_t)(m_end - m_p) < cb, (nv2::acc(LFL) << nv2::s_error(ERROR_BAD_FORMAT)));
+				memcpy(pData, m_p, cb);
+				m_p += cb;
+			}
+
+			template <typename T>
+			T Value()
+			{
+				T ret = T();
+				Bytes(&ret, sizeof(ret));
+				return ret;
+			}
+
+			std::wstring String()
+			{
+				uint32_t len = Value<uint32_t>();
+				nv2::throw_if((size_t)(m_end - m_p) / sizeof(wchar_t) < len, (nv2::acc(LFL) << nv2::s_error(ERROR_BAD_FORMAT)));
+				std::wstring ret((const wchar_t*)m_p, len);
+				m_p += len * sizeof(wchar_t);
+				return ret;
+			}
+
+			std::vector<std::wstring> Strings()
+			{
+				uint32_t count = Value<uint32_t>();
+				std::vector<std::wstring> ret;
+				for (uint32_t i = 0; i < count; i++)
+				{
+					ret.push_back(String());
+				}
+				return ret;
+			}
+
+			CComVariant Variant()
+			{
+				CComVariant ret;
+				VARTYPE vt = Value<uint16_t>();
+				switch (vt)
+				{
+				case VT_BOOL:
+					ret = CComVariant(Value<int32_t>() != 0);
+					break;
+				case VT_I4:
+					ret = CComVariant((long)Value<int32_t>());
+					break;
+				case VT_R8:
+					ret = CComVariant(Value<double>());
+					break;
+				case VT_BSTR:
+					ret = CComVariant(String().c_str());
+					break;
+				case VT_ARRAY | VT_BSTR:
+				case VT_ARRAY | VT_I4:
+				{
+					uint32_t count = Value<uint32_t>();
+					nv2::throw_if((size_t)(m_end - m_p) < count, (nv2::acc(LFL) << nv2::s_error(ERROR_BAD_FORMAT)));
+					SAFEARRAY* psa = SafeArrayCreateVector((VARTYPE)(vt & VT_TYPEMASK), 0, count);
+					nv2::throw_if(psa == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_OUTOFMEMORY))));
+					// owned by ret from here
+					ret.vt = vt;
+					ret.parray = psa;
+					for (LONG i = 0; i < (LONG)count; i++)
+					{
+						if (vt == (VT_ARRAY | VT_BSTR))
+						{
+							CComBSTR element(String().c_str());
+							SafeArrayPutElement(psa, &i, (BSTR)element);
+						}
+						else
+						{
+							LONG element = Value<int32_t>();
+							SafeArrayPutElement(psa, &i, &element);
+						}
+					}
+					break;
+				}
+				default:
+					nv2::throw_if(true, (nv2::acc(LFL) << nv2::s_error(ERROR_BAD_FORMAT)));
+				}
+				return ret;
+			}
+
+			qualifier_map Qualifiers()
+			{
+				qualifier_map ret;
+				uint32_t count = Value<uint32_t>();
+				for (uint32_t i = 0; i < count; i++)
+				{
+					std::wstring name = String();
+					ret[name] = Variant();
+				}
+				return ret;
+			}
+
+			bool End() const
+			{
+				return m_p == m_end;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// On disk cache of class schemas for one namespace, so a tool can
+		// skip the schema round trips at startup. Persisted: property names,
+		// CIM types, qualifiers (bool, int, real, string and arrays of those
+		// last two) and method signatures. The class objects are not: a
+		// loaded schema is !Complete() and MakeInParams refetches the class
+		// the first time a method is actually called.
+		//
+		// A file is ignored (Load returns 0) if it is for another namespace,
+		// another OS build or application version, older than maxAge, or
+		// corrupt. see SchemaWatcher for changes while running
+		class SchemaStore
+		{
+			static const uint32_t Magic = 0x31484353;	// "SCH1"
+			static const uint32_t Version = 1;
+
+			std::wstring m_path;
+			std::wstring m_namespace;
+			std::wstring m_stamp;
+			std::chrono::hours m_maxAge;
+
+		public:
+
+			//-----------------------------------------------------------------
+			// version is the application's own stamp, i.e. to force a rebuild
+			SchemaStore(const std::wstring& path,
+						const std::wstring& ns = _W("ROOT\\CIMV2"),
+						const std::wstring& version = _W(""),
+						std::chrono::hours maxAge = std::chrono::hours(24 * 7))
+				: m_path(path)
+				, m_namespace(ns)
+				, m_stamp(OsBuildStamp() + _W("/") + version)
+				, m_maxAge(maxAge)
+			{
+			}
+
+			//-----------------------------------------------------------------
+			const std::wstring& Path() const
+			{
+				return m_path;
+			}
+
+			//-----------------------------------------------------------------
+			// seed cache from the file. returns the number of classes loaded
+			size_t Load(ClassCache& cache) const
+			{
+				std::vector<uint8_t> data;
+				HANDLE hFile = CreateFileW(m_path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+				if (hFile == INVALID_HANDLE_VALUE)
+				{
+					DBMSG("SchemaStore::Load: " << m_path << " => " << nv2::s_error(GetLastError()));
+					return 0;
+				}
+				LARGE_INTEGER size = {};
+				DWORD read = 0;
+				bool ok = GetFileSizeEx(hFile, &size) && size.QuadPart < (1ll << 31);
+				if (ok)
+				{
+					data.resize((size_t)size.QuadPart);
+					ok = ReadFile(hFile, data.data(), (DWORD)data.size(), &read, NULL) && read == data.size();
+				}
+				CloseHandle(hFile);
+				if (!ok)
+					return 0;
+
+				std::vector<std::shared_ptr<ClassSchema>> schemas;
+				try
+				{
+					SchemaReader reader(data.data(), data.size());
+					if (reader.Value<uint32_t>() != Magic || reader.Value<uint32_t>() != Version)
+						return 0;
+					if (reader.String() != m_stamp || _wcsicmp(reader.String().c_str(), m_namespace.c_str()) != 0)
+						return 0;
+					uint64_t ticks = reader.Value<uint64_t>();
+					FILETIME now = {};
+					GetSystemTimeAsFileTime(&now);
+					uint64_t nowTicks = ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+					// 100ns ticks
+					uint64_t maxAge = (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(m_maxAge).count() * 10000000ull;
+					if (ticks > nowTicks || nowTicks - ticks > maxAge)
+						return 0;
+
+					uint32_t count = reader.Value<uint32_t>();
+					for (uint32_t i = 0; i < count; i++)
+					{
+						auto schema = std::make_shared<ClassSchema>();
+						schema->name = reader.String();
+						schema->qualifiers = reader.Qualifiers();
+						uint32_t props = reader.Value<uint32_t>();
+						for (uint32_t p = 0; p < props; p++)
+						{
+							PropertyDef prop;
+							prop.name = reader.String();
+							prop.type = (CIMTYPE)reader.Value<int32_t>();
+							prop.qualifiers = reader.Qualifiers();
+							schema->names.push_back(prop.name);
+							schema->properties.push_back(std::move(prop));
+						}
+						uint32_t methods = reader.Value<uint32_t>();
+						for (uint32_t m = 0; m < methods; m++)
+						{
+							MethodDef def;
+							def.name = reader.String();
+							def.ipParams = reader.Strings();
+							def.opParams = reader.Strings();
+							schema->methods.push_back(std::move(def));
+						}
+						schemas.push_back(schema);
+					}
+					if (!reader.End())
+						return 0;
+				}
+				catch (...)
+				{
+					DBMSG("SchemaStore::Load: " << m_path << " => corrupt");
+					return 0;
+				}
+				for (auto& schema : schemas)
+				{
+					cache.Put(schema);
+				}
+				return schemas.size();
+			}
+
+			//-----------------------------------------------------------------
+			// write everything in cache. written alongside and renamed into place
+			void Save(ClassCache& cache) const
+			{
+				std::vector<std::shared_ptr<const ClassSchema>> schemas = cache.Snapshot();
+
+				SchemaWriter writer;
+				writer.Value(Magic);
+				writer.Value(Version);
+				writer.String(m_stamp);
+				writer.String(m_namespace);
+				FILETIME now = {};
+				GetSystemTimeAsFileTime(&now);
+				writer.Value(((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime);
+				writer.Value((uint32_t)schemas.size());
+				for (auto& schema : schemas)
+				{
+					writer.String(schema->name);
+					writer.Qualifiers(schema->qualifiers);
+					writer.Value((uint32_t)schema->properties.size());
+					for (auto& prop : schema->properties)
+					{
+						writer.String(prop.name);
+						writer.Value((int32_t)prop.type);
+						writer.Qualifiers(prop.qualifiers);
+					}
+					writer.Value((uint32_t)schema->methods.size());
+					for (auto& def : schema->methods)
+					{
+						writer.String(def.name);
+						writer.Strings(def.ipParams);
+						writer.Strings(def.opParams);
+					}
+				}
+
+				std::wstring tmpPath = m_path + _W(".tmp");
+				HANDLE hFile = CreateFileW(tmpPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+				nv2::throw_if(hFile == INVALID_HANDLE_VALUE, (nv2::acc(LFL) << nv2::s_error(GetLastError())));
+				const std::vector<uint8_t>& buffer = writer.Buffer();
+				DWORD written = 0;
+				BOOL ok = WriteFile(hFile, buffer.data(), (DWORD)buffer.size(), &written, NULL) && written == buffer.size();
+				DWORD error = (ok ? (DWORD)ERROR_SUCCESS : GetLastError());
+				CloseHandle(hFile);
+				if (ok)
+				{
+					ok = MoveFileExW(tmpPath.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING);
+					error = (ok ? (DWORD)ERROR_SUCCESS : GetLastError());
+				}
+				if (!ok)
+					DeleteFileW(tmpPath.c_str());
+				nv2::throw_if(!ok, (nv2::acc(LFL) << nv2::s_error(error ? error : ERROR_WRITE_FAULT)));
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// drops cached schemas when their class is created, modified or
+		// deleted (__ClassOperationEvent). Apply from the consumer thread
+		// from time to time, i.e. before each collection, and Save the
+		// store when it reports changes
+		class SchemaWatcher
+		{
+			std::shared_ptr<ClassCache> m_pCache;
+			std::unique_ptr<Subscription> m_pSubscription;
+			std::vector<Object> m_events;
+
+		public:
+
+			//-----------------------------------------------------------------
+			explicit SchemaWatcher(const Services& services)
+				: m_pCache(services.Cache())
+				, m_pSubscription(services.Subscribe(_W("SELECT * FROM __ClassOperationEvent")))
+			{
+				nv2::throw_if(m_pCache == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+			}
+
+			//-----------------------------------------------------------------
+			// invalidate whatever has changed. returns the number of events
+			size_t Apply()
+			{
+				m_events.clear();
+				size_t ret = m_pSubscription->Dequeue(m_events, 256, 0);
+				for (auto& ev : m_events)
+				{
+					std::wstring className = ev.GetEmbedded(_W("TargetClass")).GetValue(_W("__CLASS"));
+					DBMSG("SchemaWatcher: " << className << " changed");
+					m_pCache->Invalidate(className);
+				}
+				m_events.clear();
+				return ret;
+			}
+		};
+	}
+}
@@ -0,0 +1,885 @@
+/*
+
+	C++ WMI COM classes
+
+	Visit https://github.com/g40
+
+	Copyright (c) Jerry Evans, 2016-2024
+
+	All rights reserved.
+
+	The MIT License (MIT)
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+
+
+#pragma once
+
+#include <deque>
+#include <unordered_map>
+
+#include "nv2_wmi.h"
+
+namespace nv2
+{
+	namespace wmi
+	{
+		//---------------------------------------------------------------------
+		// storage type of a Table column
+		enum class ColumnType : uint8_t
+		{
+			Int64,		// signed integers
+			UInt64,		// unsigned integers and CIM_CHAR16
+			Double,		// CIM_REAL32, CIM_REAL64
+			Bool,		// 0 or 1 in the uint64 storage
+			DateTime,	// FILETIME ticks (UTC) in the uint64 storage
+			String		// CIM_STRING, CIM_REFERENCE. ids into the Table's StringPool
+		};
+
+		//---------------------------------------------------------------------
+		// arrays and embedded objects have no column representation
+		static
+		ColumnType
+			ColumnTypeOf(CIMTYPE type)
+		{
+			nv2::throw_if((type & CIM_FLAG_ARRAY) != 0, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_TYPE_MISMATCH))));
+			switch (type)
+			{
+			case CIM_SINT8:
+			case CIM_SINT16:
+			case CIM_SINT32:
+			case CIM_SINT64:
+				return ColumnType::Int64;
+			case CIM_UINT8:
+			case CIM_UINT16:
+			case CIM_UINT32:
+			case CIM_UINT64:
+			case CIM_CHAR16:
+				return ColumnType::UInt64;
+			case CIM_REAL32:
+			case CIM_REAL64:
+				return ColumnType::Double;
+			case CIM_BOOLEAN:
+				return ColumnType::Bool;
+			case CIM_DATETIME:
+				return ColumnType::DateTime;
+			case CIM_STRING:
+			case CIM_REFERENCE:
+				return ColumnType::String;
+			default:
+				break;
+			}
+			nv2::throw_if(true, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_TYPE_MISMATCH))));
+			return ColumnType::String;
+		}
+
+		//---------------------------------------------------------------------
+		// interned strings. each distinct value is stored once and referred
+		// to by a dense 32 bit id. id 0 is always the empty string
+		class StringPool
+		{
+			// deque so the views in m_index survive growth
+			std::deque<std::wstring> m_strings;
+			std::unordered_map<std::wstring_view, uint32_t> m_index;
+
+		public:
+
+			StringPool()
+			{
+				Intern(std::wstring_view());
+			}
+
+			StringPool(const StringPool&) = delete;
+			StringPool& operator=(const StringPool&) = delete;
+			StringPool(StringPool&&) = default;
+			StringPool& operator=(StringPool&&) = default;
+
+			//-----------------------------------------------------------------
+			uint32_t Intern(std::wstring_view value)
+			{
+				auto it = m_index.find(value);
+				if (it != m_index.end())
+					return it->second;
+				uint32_t id = (uint32_t)m_strings.size();
+				m_strings.emplace_back(value);
+				m_index.emplace(std::wstring_view(m_strings.back()), id);
+				return id;
+			}
+
+			//-----------------------------------------------------------------
+			const std::wstring& operator[](uint32_t id) const
+			{
+				return m_strings[id];
+			}
+
+			//-----------------------------------------------------------------
+			size_t Size() const
+			{
+				return m_strings.size();
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// one property of every row. values are contiguous: integral, bool
+		// and datetime columns share uint64 storage, strings are pool ids.
+		// NULLs are stored as 0 and flagged in the validity bitmap (bit set
+		// means present)
+		class Column
+		{
+			std::wstring m_name;
+			ColumnType m_type = ColumnType::UInt64;
+			CIMTYPE m_cimType = CIM_EMPTY;
+			size_t m_size = 0;
+			std::vector<uint64_t> m_values;
+			std::vector<double> m_reals;
+			std::vector<uint32_t> m_ids;
+			std::vector<uint64_t> m_validity;
+			size_t m_nulls = 0;
+
+			//-----------------------------------------------------------------
+			void PushValid(bool present)
+			{
+				if ((m_size & 63) == 0)
+					m_validity.push_back(0);
+				if (present)
+					m_validity.back() |= (1ull << (m_size & 63));
+				else
+					m_nulls++;
+				m_size++;
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			Column(const std::wstring& name, CIMTYPE cimType)
+				: m_name(name)
+				, m_type(ColumnTypeOf(cimType))
+				, m_cimType(cimType)
+			{
+			}
+
+			//-----------------------------------------------------------------
+			const std::wstring& Name() const
+			{
+				return m_name;
+			}
+
+			ColumnType Type() const
+			{
+				return m_type;
+			}
+
+			CIMTYPE CimType() const
+			{
+				return m_cimType;
+			}
+
+			size_t Size() const
+			{
+				return m_size;
+			}
+
+			size_t NullCount() const
+			{
+				return m_nulls;
+			}
+
+			//-----------------------------------------------------------------
+			bool IsNull(size_t row) const
+			{
+				return (m_validity[row >> 6] & (1ull << (row & 63))) == 0;
+			}
+
+			// (Size() + 63) / 64 words
+			const uint64_t* Validity() const
+			{
+				return m_validity.data();
+			}
+
+			//-----------------------------------------------------------------
+			// Size() values. which one is valid depends on Type()
+			const uint64_t* UInt64() const
+			{
+				return m_values.data();
+			}
+
+			const int64_t* Int64() const
+			{
+				return reinterpret_cast<const int64_t*>(m_values.data());
+			}
+
+			const double* Double() const
+			{
+				return m_reals.data();
+			}
+
+			const uint32_t* StringIds() const
+			{
+				return m_ids.data();
+			}
+
+			//-----------------------------------------------------------------
+			void Reserve(size_t rows)
+			{
+				if (m_type == ColumnType::Double)
+					m_reals.reserve(rows);
+				else if (m_type == ColumnType::String)
+					m_ids.reserve(rows);
+				else
+					m_values.reserve(rows);
+				m_validity.reserve((rows + 63) / 64);
+			}
+
+			//-----------------------------------------------------------------
+			// read one value from an instance. scratch is reused for strings
+			void Append(IWbemObjectAccess* pAccess, const BoundProperty& prop, StringPool& pool, std::wstring& scratch)
+			{
+				bool present = false;
+				switch (m_type)
+				{
+				case ColumnType::Int64:
+				{
+					int64_t v = 0;
+					present = prop.ReadInt64(pAccess, v);
+					m_values.push_back((uint64_t)v);
+					break;
+				}
+				case ColumnType::UInt64:
+				case ColumnType::Bool:
+				{
+					uint64_t v = 0;
+					present = prop.ReadUInt64(pAccess, v);
+					m_values.push_back(v);
+					break;
+				}
+				case ColumnType::DateTime:
+				{
+					FILETIME ft = {};
+					present = prop.ReadFileTime(pAccess, ft);
+					m_values.push_back(present ? (((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) : 0);
+					break;
+				}
+				case ColumnType::Double:
+				{
+					double v = 0;
+					present = prop.ReadDouble(pAccess, v);
+					m_reals.push_back(v);
+					break;
+				}
+				case ColumnType::String:
+				{
+					present = prop.ReadString(pAccess, scratch);
+					m_ids.push_back(present ? pool.Intern(scratch) : 0);
+					break;
+				}
+				}
+				PushValid(present);
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// Columnar copy of a set of instances. holds no COM objects, so it
+		// can outlive the connection and be scanned, sorted or summed
+		// without touching WMI. see Snapshot
+		class Table
+		{
+			std::wstring m_className;
+			std::vector<Column> m_columns;
+			StringPool m_strings;
+			size_t m_rows = 0;
+			// reused by every string read
+			std::wstring m_scratch;
+
+		public:
+
+			//-----------------------------------------------------------------
+			// one column per property, typed from the class schema
+			Table(const ClassSchema& schema, const std::vector<std::wstring>& properties)
+				: m_className(schema.name)
+			{
+				m_columns.reserve(properties.size());
+				for (auto& name : properties)
+				{
+					const PropertyDef* prop = schema.Property(name);
+					nv2::throw_if(prop == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(WBEM_E_NOT_FOUND))));
+					m_columns.push_back(Column(prop->name, prop->type));
+				}
+			}
+
+			Table(const Table&) = delete;
+			Table& operator=(const Table&) = delete;
+			Table(Table&&) = default;
+			Table& operator=(Table&&) = default;
+
+			//-----------------------------------------------------------------
+			const std::wstring& ClassName() const
+			{
+				return m_className;
+			}
+
+			size_t Rows() const
+			{
+				return m_rows;
+			}
+
+			size_t Columns() const
+			{
+				return m_columns.size();
+			}
+
+			const Column& operator[](size_t i) const
+			{
+				return m_columns[i];
+			}
+
+			//-----------------------------------------------------------------
+			// null if there is no such column
+			const Column* Find(const std::wstring& name) const
+			{
+				for (auto& col : m_columns)
+				{
+					if (_wcsicmp(col.Name().c_str(), name.c_str()) == 0)
+						return &col;
+				}
+				return nullptr;
+			}
+
+			//-----------------------------------------------------------------
+			const StringPool& Strings() const
+			{
+				return m_strings;
+			}
+
+			// value of a String column
+			const std::wstring& String(const Column& col, size_t row) const
+			{
+				return m_strings[col.StringIds()[row]];
+			}
+
+			//-----------------------------------------------------------------
+			void Reserve(size_t rows)
+			{
+				for (auto& col : m_columns)
+				{
+					col.Reserve(rows);
+				}
+			}
+
+			//-----------------------------------------------------------------
+			// append one instance. props must be bound in column order
+			// against an instance of the same class as pAccess
+			void Append(IWbemObjectAccess* pAccess, const PropertySet& props)
+			{
+				nv2::throw_if(props.Size() != m_columns.size(), (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_INVALIDARG))));
+				for (size_t i = 0; i < m_columns.size(); i++)
+				{
+					m_columns[i].Append(pAccess, props[i], m_strings, m_scratch);
+				}
+				m_rows++;
+			}
+		};
+
+		//---------------------------------------------------------------------
+		// Enumerate className (projected to properties) straight into a
+		// Table. values are read through IWbemObjectAccess handles bound once
+		// per class and each batch of COM objects is released before the
+		// next is fetched
+		static
+		Table
+			Snapshot(const Services& services,
+						const std::wstring& className,
+						const std::vector<std::wstring>& properties,
+						ULONG batchSize = 256)
+		{
+			nv2::throw_if(services.Cache() == nullptr, (nv2::acc(LFL) << nv2::s_error(uw32::Win32FromHResult(E_POINTER))));
+			Table ret(*services.Cache()->Get(className), properties);
+
+			BoundClasses bound(properties);
+			InstanceStream stream = services.Enumerate(className, properties, batchSize);
+			while (stream.NextBatch())
+			{
+				for (auto it = stream.BatchBegin(); it != stream.BatchEnd(); ++it)
+				{
+					CComPtr<IWbemObjectAccess> pAccess = ObjectAccess(*it);
+					ret.Append(pAccess, bound.Bind(pAccess).second);
+				}
+			}
+			return ret;
+		}
+
+		//---------------------------------------------------------------------
+		// On disk layout of a Table. little endian, every block 8 byte aligned
+		// so a mapped file can be used in place:
+		//   TableFileHeader
+		//   TableFileColumn[columns]
+		//   uint64_t[strings + 1] string offsets, in wchar_t from stringData
+		//   string data. UTF-16, each string NUL terminated
+		//   per column: validity words, then the values
+		// the dictionary holds the Table's StringPool (same ids) followed by
+		// the class and column names
+		struct TableFileHeader
+		{
+			uint32_t magic;			// TableFileMagic
+			uint32_t version;		// TableFileVersion
+			uint64_t rows;
+			uint64_t timestamp;		// FILETIME (UTC) when written
+			uint32_t columns;
+			uint32_t strings;		// dictionary entries
+			uint32_t className;		// string id
+			uint32_t reserved;
+			uint64_t stringOffsets;	// file offset of the offset array
+			uint64_t stringData;	// file offset of the first character
+			uint64_t fileSize;
+		};
+
+		struct TableFileColumn
+		{
+			uint32_t name;			// string id
+			int32_t cimType;
+			uint8_t type;			// ColumnType
+			uint8_t reserved[7];
+			uint64_t nulls;
+			uint64_t validity;		// file offset, (rows + 63) / 64 words
+			uint64_t values;		// file offset, rows values
+		};
+
+		static const uint32_t TableFileMagic = 0x314C4254;	// "TBL1"
+		static const uint32_t TableFileVersion = 1;
+
+		//---------------------------------------------------------------------
+		// bytes per value in column storage
+		static
+		size_t
+			ColumnValueSize(ColumnType type)
+		{
+			if (type == ColumnType::String)
+				return sizeof(uint32_t);
+			return sizeof(uint64_t);
+		}
+
+		//---------------------------------------------------------------------
+		// write table to path. the file is written alongside and renamed
+		// into place so a reader never maps a partial file
+		static
+		void
+			WriteTable(const Table& table, const std::wstring& path)
+		{
+			auto align = [](uint64_t offset) { return (offset + 7) & ~7ull; };
+
+			// dictionary: pool strings keep their ids, then the names
+			const StringPool& pool = table.Strings();
+			std::vector<std::wstring_view> dict;
+			dict.reserve(pool.Size() + table.Columns() + 1);
+			for (uint32_t i = 0; i < (uint32_t)pool.Size(); i++)
+			{
+				dict.push_back(pool[i]);
+			}
+			uint32_t classNameId = (uint32_t)dict.size();
+			dict.push_back(table.ClassName());
+			for (size_t i = 0; i < table.Columns(); i++)
+			{
+				dict.push_back(table[i].Name());
+			}
+
+			// lay out the file
+			TableFileHeader header = {};
+			header.magic = TableFileMagic;
+			header.version = TableFileVersion;
+			header.rows = table.Rows();
+			header.columns = (uint32_t)table.Columns();
+			header.strings = (uint32_t)dict.size();
+			header.className = classNameId;
+			FILETIME now = {};
+			GetSystemTimeAsFileTime(&now);
+			header.timestamp = ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+			std::vector<uint64_t> offsets(dict.size() + 1);
+			for (size_t i = 0; i < dict.size(); i++)
+			{
+				offsets[i + 1] = offsets[i] + dict[i].size() + 1;
+			}
+
+			uint64_t offset = sizeof(TableFileHeader) + sizeof(TableFileColumn) * header.columns;
+			header.stringOffsets = offset;
+			offset += sizeof(uint64_t) * offsets.size();
+			header.stringData = offset;
+			offset = align(offset + sizeof(wchar_t) * offsets.back());
+
+			const uint64_t words = (header.rows + 63) / 64;
+			std::vector<TableFileColumn> columns(header.columns);
+			for (uint32_t i = 0; i < header.columns; i++)
+			{
+				const Column& col = table[i];
+				TableFileColumn& entry = columns[i];
+				entry.name = classNameId + 1 + i;
+				entry.cimType = (int32_t)col.CimType();
+				entry.type = (uint8_t)col.Type();
+				entry.nulls = col.NullCount();
+				entry.validity = offset;
+				offset += sizeof(uint64_t) * words;
+				entry.values = offset;
+				offset = align(offset + ColumnValueSize(col.Type()) * header.rows);
+			}
+			header.fileSize = offset;
+
+			// and write it out
+			std::wstring tmpPath = path + _W(".tmp");
+			HANDLE hFile = CreateFileW(tmpPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			nv2::throw_if(hFile == INVALID_HANDLE_VALUE, (nv2::acc(LFL) << nv2::s_error(GetLastError())));
+
+			uint64_t written = 0;
+			std::vector<uint8_t> buffer;
+			buffer.reserve(1 << 20);
+			auto flush = [&]()
+			{
+				DWORD cb = 0;
+				BOOL ok = WriteFile(hFile, buffer.data(), (DWORD)buffer.size(), &cb, NULL);
+				DWORD error = GetLastError();
+				if (!ok || cb != buffer.size())
+				{
+					CloseHandle(hFile);
+					DeleteFileW(tmpPath.c_str());
+					nv2::throw_if(true, (nv2::acc(LFL) << nv2::s_error(ok ? ERROR_WRITE_FAULT : error)));
+				}
+				buffer.clear();
+			};
+			auto write = [&](const void* pData, size_t cb)
+			{
+				const uint8_t* p = (const uint8_t*)pData;
+				while (cb)
+				{
+					size_t chunk = (std::min)(cb, buffer.capacity() - buffer.size());
+					buffer.insert(buffer.end(), p, p + chunk);
+					p += chunk;
+					cb -= chunk;
+					written += chunk;
+					if (buffer.size() == buffer.capacity())
+						flush();
+				}
+			};
+			auto pad = [&]()
+			{
+				static const uint8_t zeros[8] = {};
+				write(zeros, (size_t)(align(written) - written));
+			};
+
+			write(&header, sizeof(header));
+			write(columns.data(), sizeof(TableFileColumn) * columns.size());
+			write(offsets.data(), sizeof(uint64_t) * offsets.size());
+			for (auto& s : dict)
+			{
+				const wchar_t nul = 0;
+				write(s.data(), sizeof(wchar_t) * s.size());
+				write(&nul, sizeof(nul));
+			}
+			pad();
+			for (uint32_t i = 0; i < header.columns; i++)
+			{
+				const Column& col = table[i];
+				write(col.Validity(), (size_t)(sizeof(uint64_t) * words));
+				const void* pValues = (col.Type() == ColumnType::String ? (const void*)col.StringIds()
+										: col.Type() == ColumnType::Double ? (const void*)col.Double()
+										: (const void*)col.UInt64());
+				write(pValues, (size_t)(ColumnValueSize(col.Type()) * header.rows));
+				pad();
+			}
+			flush();
+			CloseHandle(hFile);
+
+			BOOL moved = MoveFileExW(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+			DWORD error = GetLastError();
+			if (!moved)
+				DeleteFileW(tmpPath.c_str());
+			nv2::throw_if(!moved, (nv2::acc(LFL) << nv2::s_error(error)));
+		}
+
+		//---------------------------------------------------------------------
+		// Read only view of a file written by WriteTable. the file is mapped
+		// and columns point straight into the mapping: opening validates the
+		// header, block bounds and dictionary offsets, nothing is copied.
+		// string ids in the values are checked as they are read
+		class MappedTable
+		{
+			HANDLE m_hFile = INVALID_HANDLE_VALUE;
+			HANDLE m_hMap = NULL;
+			const uint8_t* m_pBase = nullptr;
+			uint64_t m_size = 0;
+			const TableFileHeader* m_pHeader = nullptr;
+			const TableFileColumn* m_pColumns = nullptr;
+			const uint64_t* m_pOffsets = nullptr;
+			const wchar_t* m_pChars = nullptr;
+
+			//-----------------------------------------------------------------
+			void Close()
+			{
+				if (m_pBase)
+					UnmapViewOfFile(m_pBase);
+				if (m_hMap)
+					CloseHandle(m_hMap);
+				if (m_hFile != INVALID_HANDLE_VALUE)
+					CloseHandle(m_hFile);
+				m_pBase = nullptr;
+				m_hMap = NULL;
+				m_hFile = INVALID_HANDLE_VALUE;
+			}
+
+			//-----------------------------------------------------------------
+			bool InBounds(uint64_t offset, uint64_t cb) const
+			{
+				return offset <= m_size && cb <= m_size - offset;
+			}
+
+			//-----------------------------------------------------------------
+			void Validate()
+			{
+				bool ok = InBounds(0, sizeof(TableFileHeader));
+				if (ok)
+				{
+					m_pHeader = (const TableFileHeader*)m_pBase;
+					ok = m_pHeader->magic == TableFileMagic
+						&& m_pHeader->version == TableFileVersion
+						&& m_pHeader->fileSize == m_size
+						&& m_pHeader->className < m_pHeader->strings
+						&& InBounds(sizeof(TableFileHeader), sizeof(TableFileColumn) * (uint64_t)m_pHeader->columns)
+						&& (m_pHeader->stringOffsets & 7) == 0
+						&& InBounds(m_pHeader->stringOffsets, sizeof(uint64_t) * ((uint64_t)m_pHeader->strings + 1));
+				}
+				if (ok)
+				{
+					m_pColumns = (const TableFileColumn*)(m_pBase + sizeof(TableFileHeader));
+					m_pOffsets = (const uint64_t*)(m_pBase + m_pHeader->stringOffsets);
+					m_pChars = (const wchar_t*)(m_pBase + m_pHeader->stringData);
+					ok = m_pOffsets[0] == 0
+						&& (m_pHeader->stringData & 1) == 0
+						&& m_pOffsets[m_pHeader->strings] <= m_size / sizeof(wchar_t)
+						&& InBounds(m_pHeader->stringData, sizeof(wchar_t) * m_pOffsets[m_pHeader->strings]);
+				}
+				// every entry ascending and NUL terminated, so String never
+				// leaves the block
+				for (uint32_t i = 0; ok && i < m_pHeader->strings; i++)
+				{
+					ok = m_pOffsets[i] < m_pOffsets[i + 1]
+						&& m_pChars[m_pOffsets[i + 1] - 1] == 0;
+				}
+				const uint64_t rows = (ok ? m_pHeader->rows : 0);
+				for (uint32_t i = 0; ok && i < m_pHeader->columns; i++)
+				{
+					const TableFileColumn& col = m_pColumns[i];
+					ok = col.name < m_pHeader->strings
+						&& col.type <= (uint8_t)ColumnType::String
+						&& InBounds(col.validity, sizeof(uint64_t) * ((rows + 63) / 64))
+						&& InBounds(col.values, ColumnValueSize((ColumnType)col.type) * rows)
+						&& (col.validity & 7) == 0
+						&& (col.values & 7) == 0;
+				}
+				if (!ok)
+				{
+					Close();
+					nv2::throw_if(true, (nv2::acc(LFL) << nv2::s_error(ERROR_BAD_FORMAT)));
+				}
+			}
+
+		public:
+
+			//-----------------------------------------------------------------
+			// one column of the mapping. valid while the MappedTable is
+			class ColumnView
+			{
+				friend class MappedTable;
+
+				const MappedTable* m_pTable = nullptr;
+				const TableFileColumn* m_pColumn = nullptr;
+
+				ColumnView(const MappedTable* pTable, const TableFileColumn* pColumn)
+					: m_pTable(pTable)
+					, m_pColumn(pColumn)
+				{
+				}
+
+				const void* At(uint64_t offset) const
+				{
+					return m_pTable->m_pBase + offset;
+				}
+
+			public:
+
+				ColumnView() {}
+
+				//-------------------------------------------------------------
+				// false for a Find miss
+				bool Valid() const
+				{
+					return m_pColumn != nullptr;
+				}
+
+				std::wstring_view Name() const
+				{
+					return m_pTable->String(m_pColumn->name);
+				}
+
+				ColumnType Type() const
+				{
+					return (ColumnType)m_pColumn->type;
+				}
+
+				CIMTYPE CimType() const
+				{
+					return (CIMTYPE)m_pColumn->cimType;
+				}
+
+				size_t Size() const
+				{
+					return m_pTable->Rows();
+				}
+
+				size_t NullCount() const
+				{
+					return (size_t)m_pColumn->nulls;
+				}
+
+				//-------------------------------------------------------------
+				bool IsNull(size_t row) const
+				{
+					return (Validity()[row >> 6] & (1ull << (row & 63))) == 0;
+				}
+
+				const uint64_t* Validity() const
+				{
+					return (const uint64_t*)At(m_pColumn->validity);
+				}
+
+				//-------------------------------------------------------------
+				// as Column. which one is valid depends on Type()
+				const uint64_t* UInt64() const
+				{
+					return (const uint64_t*)At(m_pColumn->values);
+				}
+
+				const int64_t* Int64() const
+				{
+					return (const int64_t*)At(m_pColumn->values);
+				}
+
+				const double* Double() const
+				{
+					return (const double*)At(m_pColumn->values);
+				}
+
+				const uint32_t* StringIds() const
+				{
+					return (const uint32_t*)At(m_pColumn->values);
+				}
+			};
+
+			//-----------------------------------------------------------------
+			explicit MappedTable(const std::wstring& path)
+			{
+				m_hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+				nv2::throw_if(m_hFile == INVALID_HANDLE_VALUE, (nv2::acc(LFL) << nv2::s_error(GetLastError())));
+
+				LARGE_INTEGER size = {};
+				if (!GetFileSizeEx(m_hFile, &size) || size.QuadPart == 0)
+				{
+					DWORD error = (size.QuadPart == 0 ? (DWORD)ERROR_BAD_FORMAT : GetLastError());
+					Close();
+					nv2::throw_if(true, (nv2::acc(LFL) << nv2::s_error(error)));
+				}
+				m_size = (uint64_t)size.QuadPart;
+
+				m_hMap = CreateFileMappingW(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+				if (m_hMap)
+					m_pBase = (const uint8_t*)MapViewOfFile(m_hMap, FILE_MAP_READ, 0, 0, 0);
+				if (!m_pBase)
+				{
+					DWORD error = GetLastError();
+					Close();
+					nv2::throw_if(true, (nv2::acc(LFL) << nv2::s_error(error)));
+				}
+				Validate();
+			}
+
+			MappedTable(const MappedTable&) = delete;
+			MappedTable& operator=(const MappedTable&) = delete;
+
+			~MappedTable()
+			{
+				Close();
+			}
+
+			//-----------------------------------------------------------------
+			std::wstring_view ClassName() const
+			{
+				return String(m_pHeader->className);
+			}
+
+			// when the file was written
+			FILETIME Timestamp() const
+			{
+				FILETIME ret = { (DWORD)m_pHeader->timestamp, (DWORD)(m_pHeader->timestamp >> 32) };
+				return ret;
+			}
+
+			size_t Rows() const
+			{
+				return (size_t)m_pHeader->rows;
+			}
+
+			size_t Columns() const
+			{
+				return m_pHeader->columns;
+			}
+
+			ColumnView operator[](size_t i) const
+			{
+				return ColumnView(this, m_pColumns + i);
+			}
+
+			//-----------------------------------------------------------------
+			// !Valid() if there is no such column
+			ColumnView Find(const std::wstring& name) const
+			{
+				for (uint32_t i = 0; i < m_pHeader->columns; i++)
+				{
+					if (_wcsicmp(String(m_pColumns[i].name).data(), name.c_str()) == 0)
+						return ColumnView(this, m_pColumns + i);
+				}
+				return ColumnView();
+			}
+
+			//-----------------------------------------------------------------
+			// dictionary entry. NUL terminated in the mapping. throws
+			// ERROR_BAD_FORMAT for an id outside the dictionary
+			std::wstring_view String(uint32_t id) const
+			{
+				nv2::throw_if(id >= m_pHeader->strings, (nv2::acc(LFL) << nv2::s_error(ERROR_BAD_FORMAT)));
+				return std::wstring_view(m_pChars + m_pOffsets[id], (size_t)(m_pOffsets[id + 1] - m_pOffsets[id] - 1));
+			}
+
+			// value of a String column
+			std::wstring_view String(const ColumnView& col, size_t row) const
+			{
+				return String(col.StringIds()[row]);
+			}
+		};
+	}
+}
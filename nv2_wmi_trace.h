@@ -0,0 +1,214 @@
+/*
+
+	C++ WMI COM classes
+
+	Visit https://github.com/g40
+
+	Copyright (c) Jerry Evans, 2016-2024
+
+	All rights reserved.
+
+	The MIT License (MIT)
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+
+
+#pragma once
+
+#include <ostream>
+
+#include "nv2_wmi.h"
+
+// define NV2_WMI_TRACELOGGING to get TraceLoggingInstrumentation (ETW)
+#ifdef NV2_WMI_TRACELOGGING
+#include <TraceLoggingProvider.h>
+#endif
+
+namespace nv2
+{
+	namespace wmi
+	{
+		//---------------------------------------------------------------------
+		// In process aggregation: call counts, failure counts by HRESULT and
+		// a latency histogram for each (operation, target) pair.
+		//
+		//		nv2::wmi::CallStats stats;
+		//		nv2::wmi::SetInstrumentation(&stats);
+		//		...
+		//		nv2::wmi::SetInstrumentation(nullptr);
+		//		stats.Dump(std::wcout);
+		class CallStats : public Instrumentation
+		{
+		public:
+
+			// bucket 0 is < 1us, bucket i is [2^(i-1), 2^i) us, the last is open
+			static const size_t Buckets = 32;
+
+			struct Entry
+			{
+				uint64_t calls = 0;
+				uint64_t failures = 0;
+				uint64_t objects = 0;
+				uint64_t totalNs = 0;
+				uint64_t maxNs = 0;
+				uint64_t histogram[Buckets] = {};
+				// failing HRESULT => count
+				std::map<HRESULT, uint64_t> errors;
+
+				//-------------------------------------------------------------
+				// upper bound (us) of the bucket holding percentile p
+				uint64_t Percentile(double p) const
+				{
+					uint64_t rank = (uint64_t)(p / 100.0 * calls + 0.5);
+					uint64_t seen = 0;
+					for (size_t i = 0; i < Buckets; i++)
+					{
+						seen += histogram[i];
+						if (seen >= rank && seen)
+							return (1ull << i);
+					}
+					return (1ull << (Buckets - 1));
+				}
+			};
+
+			using key_t = std::pair<Op, std::wstring>;
+			using map_t = std::map<key_t, Entry>;
+
+		private:
+
+			mutable std::mutex m_lock;
+			map_t m_entries;
+			// when false targets are not recorded, one entry per operation
+			bool m_perTarget;
+
+		public:
+
+			//-----------------------------------------------------------------
+			explicit CallStats(bool perTarget = true)
+				: m_perTarget(perTarget)
+			{
+			}
+
+			//-----------------------------------------------------------------
+			static size_t Bucket(uint64_t ns)
+			{
+				uint64_t us = ns / 1000;
+				size_t ret = 0;
+				while (us && ret < Buckets - 1)
+				{
+					us >>= 1;
+					ret++;
+				}
+				return ret;
+			}
+
+			//-----------------------------------------------------------------
+			void OnCall(const CallInfo& info) override
+			{
+				key_t key(info.op, (m_perTarget && info.target) ? info.target : _W(""));
+				std::lock_guard<std::mutex> lock(m_lock);
+				Entry& entry = m_entries[key];
+				entry.calls++;
+				entry.objects += info.objects;
+				entry.totalNs += info.ns;
+				entry.maxNs = (std::max)(entry.maxNs, info.ns);
+				entry.histogram[Bucket(info.ns)]++;
+				if (FAILED(info.hr))
+				{
+					entry.failures++;
+					entry.errors[info.hr]++;
+				}
+			}
+
+			//-----------------------------------------------------------------
+			// a consistent copy
+			map_t Snapshot() const
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				return m_entries;
+			}
+
+			//-----------------------------------------------------------------
+			void Reset()
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_entries.clear();
+			}
+
+			//-----------------------------------------------------------------
+			// one line per entry
+			void Dump(std::wostream& os) const
+			{
+				for (auto& kv : Snapshot())
+				{
+					const Entry& e = kv.second;
+					os << OpName(kv.first.first);
+					if (!kv.first.second.empty())
+						os << _W(" ") << kv.first.second;
+					os << _W(": calls=") << e.calls
+						<< _W(" failures=") << e.failures
+						<< _W(" objects=") << e.objects
+						<< _W(" mean=") << (e.calls ? e.totalNs / e.calls / 1000 : 0) << _W("us")
+						<< _W(" p50<") << e.Percentile(50) << _W("us")
+						<< _W(" p99<") << e.Percentile(99) << _W("us")
+						<< _W(" max=") << e.maxNs / 1000 << _W("us");
+					for (auto& err : e.errors)
+					{
+						os << _W(" [0x") << std::hex << (unsigned long)err.first << std::dec << _W(" x") << err.second << _W("]");
+					}
+					os << std::endl;
+				}
+			}
+		};
+
+#ifdef NV2_WMI_TRACELOGGING
+		//---------------------------------------------------------------------
+		// one ETW event per call. the provider is the application's: it is
+		// defined (TRACELOGGING_DEFINE_PROVIDER) and registered in one
+		// translation unit and passed in here, so this header can be
+		// included anywhere
+		class TraceLoggingInstrumentation : public Instrumentation
+		{
+			TraceLoggingHProvider m_hProvider;
+
+		public:
+
+			explicit TraceLoggingInstrumentation(TraceLoggingHProvider hProvider)
+				: m_hProvider(hProvider)
+			{
+			}
+
+			void OnCall(const CallInfo& info) override
+			{
+				TraceLoggingWrite(m_hProvider,
+					"WmiCall",
+					TraceLoggingWideString(OpName(info.op), "Op"),
+					TraceLoggingWideString(info.target ? info.target : L"", "Target"),
+					TraceLoggingHResult(info.hr, "HResult"),
+					TraceLoggingUInt64(info.ns, "DurationNs"),
+					TraceLoggingUInt32(info.objects, "Objects"));
+			}
+		};
+#endif
+	}
+}